@@ -0,0 +1,487 @@
+/*
+ * async_log.h
+ * -----------
+ * Asynchronous logging for the server: a session thread never formats a
+ * message, takes a lock or makes a system call to log one.
+ *
+ * Every thread that logs gets its own single-producer / single-consumer byte
+ * ring. A record is binary: a static format string plus its integer
+ * arguments (or, for the rare message assembled elsewhere, the text itself),
+ * a few dozen bytes copied in and published with one release store. One
+ * flusher thread drains every ring, renders the records, and writes a round's
+ * text with one writev() per descriptor, so a burst of a thousand connect
+ * lines costs a couple of system calls instead of a thousand.
+ *
+ * Nothing makes a producer wait. When its ring is full (the flusher is behind,
+ * or stdout is a pipe nobody reads) the record is dropped and counted, and the
+ * flusher reports the count. A producer wakes the flusher (a futex, through
+ * std::atomic::wait/notify) only when the flusher has gone to sleep, so an idle
+ * server has no thread ticking and a busy one logs without system calls.
+ *
+ * Rings live on a list that only grows, pushed and walked without a lock. A
+ * thread's first line claims a drained ring of an exited thread with one
+ * compare-and-swap, or a spare that start() allocated. So even with a thread
+ * per connection, logging the connect takes no lock and usually allocates nothing.
+ *
+ * Records carry a steady-clock stamp and each round writes what it drained
+ * in stamp order, so lines from different threads come out in the order
+ * they were logged (a record published while a round is collecting may
+ * land in the next one). Before start() and after stop() records are
+ * written on the spot, by the thread that logs them.
+ *
+ * Formats take integer arguments only:
+ *   %d signed   %u unsigned   %s static C string (only the pointer is stored)
+ *   %a IPv4 address and port, packed by AsyncLog::addr()
+ *   %e errno value, as its strerror() text   %% a percent sign
+ * Error records go to the error descriptor (stderr), the rest to stdout.
+ */
+
+#pragma once
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+enum class LogLevel : uint8_t { Error, Warn, Info, Debug };
+
+class AsyncLog {
+public:
+    static constexpr uint32_t kRingBytes = 64 * 1024;  // per logging thread (pages are touched as used)
+    static constexpr uint32_t kMaxText   = 1024;       // longer text records are cut
+    static constexpr size_t   kMaxArgs   = 6;
+    static constexpr int      kSpareRings = 16;       // allocated by start(), ahead of the threads that log
+
+    AsyncLog() : id_(next_id().fetch_add(1, std::memory_order_relaxed) + 1) {}
+    AsyncLog(const AsyncLog&)            = delete;
+    AsyncLog& operator=(const AsyncLog&) = delete;
+    ~AsyncLog() { stop(); }  // rings are not freed: a thread may still hold one (see Holder)
+
+    /* Start the flusher; from now on records go through the rings. */
+    void start(int out_fd = STDOUT_FILENO, int err_fd = STDERR_FILENO) {
+        if (flusher_.joinable()) return;
+        out_fd_ = out_fd;
+        err_fd_ = err_fd;
+        for (int i = 0; i < kSpareRings; ++i) add_ring(Free);
+        running_.store(true, std::memory_order_release);
+        flusher_ = std::thread([this] { run(); });
+    }
+
+    /* Write out everything logged so far and join the flusher. */
+    void stop() {
+        if (!flusher_.joinable()) return;
+        running_.store(false, std::memory_order_release);
+        wake_.fetch_add(1, std::memory_order_release);
+        wake_.notify_one();
+        flusher_.join();
+        flush_round();  // anything a producer published while the flusher was finishing
+    }
+
+    void     set_level(LogLevel lv)     { level_.store(lv, std::memory_order_relaxed); }
+    LogLevel level() const              { return level_.load(std::memory_order_relaxed); }
+    bool     enabled(LogLevel lv) const { return lv <= level(); }
+
+    /* Records lost to full rings so far. */
+    uint64_t dropped() const {
+        uint64_t n = 0;
+        for (Ring* r = rings_.load(std::memory_order_acquire); r; r = r->next) n += r->dropped.load(std::memory_order_relaxed);
+        return n;
+    }
+
+    /* Rings allocated so far, spares included. */
+    size_t rings() const {
+        size_t n = 0;
+        for (Ring* r = rings_.load(std::memory_order_acquire); r; r = r->next) ++n;
+        return n;
+    }
+
+    /* Log `fmt` (a string literal: only its address is kept) with integer or static-string arguments. */
+    template <class... A>
+    void write(LogLevel lv, const char* fmt, A... args) {
+        static_assert(sizeof...(A) <= kMaxArgs, "too many log arguments");
+        if (!enabled(lv)) return;
+        const uint64_t v[sizeof...(A) + 1] = {arg(args)...};
+        emit_format(lv, fmt, v, sizeof...(A));
+    }
+
+    /* Log text built by the caller (copied; cut at kMaxText bytes). */
+    void text(LogLevel lv, std::string_view s) {
+        if (!enabled(lv)) return;
+        s = s.substr(0, kMaxText);
+        Ring* r = running_.load(std::memory_order_acquire) ? ring() : nullptr;
+        char* p = r ? reserve(*r, static_cast<uint32_t>(sizeof(Header) + s.size())) : nullptr;
+        if (!p) {
+            if (r) return;
+            write_all(fd_for(lv), s.data(), s.size());
+            return;
+        }
+        Header h{record_size(static_cast<uint32_t>(sizeof(Header) + s.size())), Text, static_cast<uint8_t>(lv),
+                 static_cast<uint32_t>(s.size()), stamp()};
+        std::memcpy(p, &h, sizeof(h));
+        std::memcpy(p + sizeof(h), s.data(), s.size());
+        commit(*r);
+    }
+
+    /* An IPv4 endpoint as one %a argument. */
+    static uint64_t addr(const sockaddr_in& a) {
+        return uint64_t{ntohl(a.sin_addr.s_addr)} << 16 | ntohs(a.sin_port);
+    }
+
+    /* Append `fmt` with its arguments substituted to `out` (what the flusher does with a record). */
+    static void render(std::string& out, const char* fmt, const uint64_t* args, size_t nargs) {
+        size_t k = 0;
+        char   buf[64];
+        for (const char* p = fmt; *p; ++p) {
+            if (*p != '%' || !p[1]) { out += *p; continue; }
+            char c = *++p;
+            if (c == '%') { out += '%'; continue; }
+            uint64_t v = k < nargs ? args[k++] : 0;
+            switch (c) {
+            case 'd': out += std::to_string(static_cast<int64_t>(v)); break;
+            case 'u': out += std::to_string(v); break;
+            case 's': out += v ? reinterpret_cast<const char*>(v) : "(null)"; break;
+            case 'a':
+                std::snprintf(buf, sizeof(buf), "%u.%u.%u.%u:%u", unsigned(v >> 40 & 255), unsigned(v >> 32 & 255),
+                              unsigned(v >> 24 & 255), unsigned(v >> 16 & 255), unsigned(v & 0xffff));
+                out += buf;
+                break;
+            case 'e': out += ::strerror_r(static_cast<int>(v), buf, sizeof(buf)); break;
+            default: out += '%'; out += c; break;
+            }
+        }
+    }
+
+private:
+    enum Kind : uint8_t { Format, Text, Skip };
+
+    /* A ring's life: InUse -> Retired (its thread exited) -> Free (drained, by the flusher) -> InUse (claimed). */
+    enum RingState : uint8_t { InUse, Retired, Free };
+
+    struct Header {
+        uint16_t size;   // whole record, a multiple of sizeof(Header)
+        uint8_t  kind;
+        uint8_t  level;
+        uint32_t count;  // arguments (Format) or bytes (Text)
+        uint64_t when;   // stamp(), for ordering across threads
+    };
+    static_assert(sizeof(Header) == 16);
+    static_assert(kRingBytes <= 65536 && (kRingBytes & (kRingBytes - 1)) == 0, "Header::size must hold a Skip");
+
+    struct Ring {
+        alignas(64) std::atomic<uint32_t> tail{0};     // written by the producer
+        uint32_t              next_tail = 0;           // producer: tail after the reserved record
+        std::atomic<uint64_t> dropped{0};              // producer: records that did not fit
+        alignas(64) std::atomic<uint32_t> head{0};     // written by the flusher
+        std::atomic<uint8_t>  state{InUse};            // RingState
+        Ring*                 next = nullptr;          // next on rings_; fixed once the ring is on it
+        char                  data[kRingBytes];
+    };
+
+    /* A thread's ring, tagged with the logger it came from (loggers may come and go in tests). */
+    struct Holder {
+        Ring*    ring = nullptr;
+        uint64_t id   = 0;
+        ~Holder() {
+            if (ring) ring->state.store(Retired, std::memory_order_release);
+        }
+    };
+
+    static std::atomic<uint64_t>& next_id() {
+        static std::atomic<uint64_t> id{0};
+        return id;
+    }
+
+    static Holder& holder() {
+        thread_local Holder h;
+        return h;
+    }
+
+    template <class T>
+    static uint64_t arg(T x) {
+        if constexpr (std::is_pointer_v<T>) {
+            return reinterpret_cast<uintptr_t>(x);
+        } else {
+            static_assert(std::is_integral_v<T>, "log arguments are integers or static strings");
+            if constexpr (std::is_signed_v<T>) return static_cast<uint64_t>(static_cast<int64_t>(x));
+            else return static_cast<uint64_t>(x);
+        }
+    }
+
+    static uint64_t stamp() {
+        return static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+    }
+
+    /* Records are whole headers long, so the room left before the end of the buffer always fits a Skip header. */
+    static uint16_t record_size(uint32_t bytes) {
+        return static_cast<uint16_t>((bytes + sizeof(Header) - 1) & ~uint32_t{sizeof(Header) - 1});
+    }
+
+    int fd_for(LogLevel lv) const { return lv == LogLevel::Error ? err_fd_ : out_fd_; }
+
+    void emit_format(LogLevel lv, const char* fmt, const uint64_t* v, size_t n) {
+        Ring* r = running_.load(std::memory_order_acquire) ? ring() : nullptr;
+        uint32_t size = static_cast<uint32_t>(sizeof(Header) + sizeof(fmt) + n * sizeof(uint64_t));
+        char* p = r ? reserve(*r, size) : nullptr;
+        if (!p) {
+            if (r) return;  // dropped and counted
+            std::string s;
+            render(s, fmt, v, n);
+            write_all(fd_for(lv), s.data(), s.size());
+            return;
+        }
+        Header h{record_size(size), Format, static_cast<uint8_t>(lv), static_cast<uint32_t>(n), stamp()};
+        std::memcpy(p, &h, sizeof(h));
+        std::memcpy(p + sizeof(h), &fmt, sizeof(fmt));
+        std::memcpy(p + sizeof(h) + sizeof(fmt), v, n * sizeof(uint64_t));
+        commit(*r);
+    }
+
+    Ring* ring() {
+        Holder& h = holder();
+        if (h.id != id_) {
+            if (h.ring) h.ring->state.store(Retired, std::memory_order_release);
+            h.ring = claim();
+            h.id   = id_;
+        }
+        return h.ring;
+    }
+
+    /* A free ring (a spare, or drained after its thread exited), else a new one. No lock. */
+    Ring* claim() {
+        if (free_rings_.load(std::memory_order_relaxed) > 0) {
+            for (Ring* r = rings_.load(std::memory_order_acquire); r; r = r->next) {
+                uint8_t expect = Free;
+                if (r->state.load(std::memory_order_relaxed) == Free &&
+                    r->state.compare_exchange_strong(expect, InUse, std::memory_order_acquire)) {
+                    free_rings_.fetch_sub(1, std::memory_order_relaxed);
+                    return r;
+                }
+            }
+        }
+        return add_ring(InUse);
+    }
+
+    /* Push a new ring onto rings_ (rings are never removed, so walking the list needs no lock). */
+    Ring* add_ring(RingState state) {
+        Ring* r = new Ring;
+        r->state.store(state, std::memory_order_relaxed);
+        if (state == Free) free_rings_.fetch_add(1, std::memory_order_relaxed);
+        r->next = rings_.load(std::memory_order_relaxed);
+        while (!rings_.compare_exchange_weak(r->next, r, std::memory_order_release, std::memory_order_relaxed)) {}
+        return r;
+    }
+
+    /*
+     * Room for a record of `bytes` at the ring's tail, or null (the record is
+     * dropped and counted). A record never wraps: when it does not fit before
+     * the end of the buffer, a Skip record pads out the rest.
+     */
+    static char* reserve(Ring& r, uint32_t bytes) {
+        uint32_t size = record_size(bytes);
+        uint32_t tail = r.tail.load(std::memory_order_relaxed);
+        uint32_t head = r.head.load(std::memory_order_acquire);
+        uint32_t pos  = tail & (kRingBytes - 1);
+        uint32_t room = kRingBytes - pos;
+        uint32_t need = size <= room ? size : size + room;
+        if (kRingBytes - (tail - head) < need) {
+            r.dropped.store(r.dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        if (size > room) {
+            Header skip{static_cast<uint16_t>(room), Skip, 0, 0, 0};
+            std::memcpy(r.data + pos, &skip, sizeof(skip));
+            pos = 0;
+        }
+        r.next_tail = tail + need;
+        return r.data + pos;
+    }
+
+    /* Publish the reserved record; wake the flusher if it is asleep. */
+    void commit(Ring& r) {
+        r.tail.store(r.next_tail, std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst);  // pairs with the flusher's, before it sleeps
+        if (idle_.load(std::memory_order_relaxed) && idle_.exchange(false, std::memory_order_relaxed)) {
+            wake_.fetch_add(1, std::memory_order_release);
+            wake_.notify_one();
+        }
+    }
+
+    void run() {
+        while (true) {
+            bool stopping = !running_.load(std::memory_order_acquire);
+            if (flush_round() > 0) continue;
+            if (stopping) return;
+            uint32_t seen = wake_.load(std::memory_order_acquire);
+            idle_.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!pending() && running_.load(std::memory_order_acquire)) wake_.wait(seen, std::memory_order_acquire);
+            idle_.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    bool pending() const {
+        for (Ring* r = rings_.load(std::memory_order_acquire); r; r = r->next) {
+            if (r->head.load(std::memory_order_relaxed) != r->tail.load(std::memory_order_acquire)) return true;
+        }
+        return false;
+    }
+
+    struct Pending {
+        uint64_t    when;
+        const char* rec;  // in its ring, until the round ends
+    };
+
+    /* One piece of output: ring bytes, or a span of the rendered text for its descriptor. */
+    struct Segment {
+        const char* base;  // null: offset into rendered_[fd]
+        size_t      off, len;
+    };
+
+    /* Drain every ring once and write what it held; returns the records written. */
+    size_t flush_round() {
+        snap_.clear();
+        for (Ring* r = rings_.load(std::memory_order_acquire); r; r = r->next) snap_.push_back(r);
+        ends_.resize(snap_.size());
+        for (int i = 0; i < 2; ++i) {
+            rendered_[i].clear();
+            segs_[i].clear();
+        }
+
+        // Collect, then order by stamp (each ring is in order already, so this is a merge in effect)
+        batch_.clear();
+        for (size_t i = 0; i < snap_.size(); ++i) {
+            Ring&    r    = *snap_[i];
+            uint32_t head = r.head.load(std::memory_order_relaxed);
+            uint32_t tail = r.tail.load(std::memory_order_acquire);
+            ends_[i] = tail;
+            while (head != tail) {
+                const char* p = r.data + (head & (kRingBytes - 1));
+                Header h;
+                std::memcpy(&h, p, sizeof(h));
+                head += h.size;
+                if (h.kind != Skip) batch_.push_back({h.when, p});
+            }
+        }
+        std::stable_sort(batch_.begin(), batch_.end(),
+                         [](const Pending& a, const Pending& b) { return a.when < b.when; });
+
+        for (const Pending& e : batch_) {
+            Header h;
+            std::memcpy(&h, e.rec, sizeof(h));
+            int fd = h.level == static_cast<uint8_t>(LogLevel::Error);
+            if (h.kind == Text) {
+                segs_[fd].push_back({e.rec + sizeof(h), 0, h.count});
+            } else {
+                const char* fmt;
+                uint64_t    v[kMaxArgs];
+                std::memcpy(&fmt, e.rec + sizeof(h), sizeof(fmt));
+                std::memcpy(v, e.rec + sizeof(h) + sizeof(fmt), h.count * sizeof(uint64_t));
+                size_t at = rendered_[fd].size();
+                render(rendered_[fd], fmt, v, h.count);
+                add_rendered(fd, at);
+            }
+        }
+
+        uint64_t lost = 0;
+        for (Ring* r : snap_) lost += r->dropped.load(std::memory_order_relaxed);
+        if (lost > reported_) {
+            size_t at = rendered_[1].size();
+            uint64_t n = lost - reported_;
+            render(rendered_[1], "Log: %u messages dropped (log buffers full).\n", &n, 1);
+            add_rendered(1, at);
+            reported_ = lost;
+        }
+
+        write_segments(out_fd_, 0);
+        write_segments(err_fd_, 1);
+
+        for (size_t i = 0; i < snap_.size(); ++i) {
+            Ring& r = *snap_[i];
+            // Read the state first: a thread retires its ring after its last record
+            bool gone = r.state.load(std::memory_order_acquire) == Retired;
+            r.head.store(ends_[i], std::memory_order_release);
+            if (gone && ends_[i] == r.tail.load(std::memory_order_acquire)) {
+                r.state.store(Free, std::memory_order_release);
+                free_rings_.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        return batch_.size();
+    }
+
+    void add_rendered(int fd, size_t at) {
+        size_t len = rendered_[fd].size() - at;
+        auto&  s   = segs_[fd];
+        if (!s.empty() && !s.back().base && s.back().off + s.back().len == at) s.back().len += len;
+        else s.push_back({nullptr, at, len});
+    }
+
+    void write_segments(int fd, int which) {
+        if (segs_[which].empty()) return;
+        iov_.clear();
+        for (const Segment& s : segs_[which]) {
+            const char* p = s.base ? s.base : rendered_[which].data() + s.off;
+            iov_.push_back({const_cast<char*>(p), s.len});
+        }
+        size_t i = 0;
+        while (i < iov_.size()) {
+            ssize_t n = ::writev(fd, &iov_[i], static_cast<int>(std::min<size_t>(iov_.size() - i, IOV_MAX)));
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return;  // nowhere to log that logging failed
+            }
+            size_t left = static_cast<size_t>(n);
+            while (i < iov_.size() && left >= iov_[i].iov_len) left -= iov_[i++].iov_len;
+            if (left > 0) {  // a partial write: resume inside iov_[i]
+                iov_[i].iov_base = static_cast<char*>(iov_[i].iov_base) + left;
+                iov_[i].iov_len -= left;
+            }
+        }
+    }
+
+    static void write_all(int fd, const char* p, size_t len) {
+        while (len > 0) {
+            ssize_t n = ::write(fd, p, len);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            p += n;
+            len -= static_cast<size_t>(n);
+        }
+    }
+
+    const uint64_t        id_;
+    std::atomic<LogLevel> level_{LogLevel::Info};
+    std::atomic<bool>     running_{false};
+    int                   out_fd_ = STDOUT_FILENO, err_fd_ = STDERR_FILENO;
+
+    std::atomic<Ring*>   rings_{nullptr};  // every ring, newest first
+    std::atomic<int64_t> free_rings_{0};   // how many are Free (a hint: claim() skips the walk at 0)
+
+    alignas(64) std::atomic<bool> idle_{false};  // the flusher is (about to be) asleep on wake_
+    std::atomic<uint32_t>         wake_{0};
+    std::thread                   flusher_;
+
+    // Flusher state
+    std::vector<Ring*>    snap_;
+    std::vector<uint32_t> ends_;
+    std::vector<Pending>  batch_;
+    std::string           rendered_[2];  // [0] stdout, [1] stderr
+    std::vector<Segment>  segs_[2];
+    std::vector<iovec>    iov_;
+    uint64_t              reported_ = 0;  // dropped records already reported
+};
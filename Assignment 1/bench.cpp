@@ -0,0 +1,764 @@
+/*
+ * bench.cpp
+ * ---------
+ * In-process micro-benchmarks for the server building blocks.
+ *
+ * Usage:
+ *   ./bench              -> run every benchmark
+ *   ./bench <name>...    -> run only the named ones (see kBenches below)
+ *
+ * Build:
+ *   g++ -std=c++20 -Wall -Wextra -O2 -pthread bench.cpp -lsqlite3 -o bench
+ */
+
+#include "async_log.h"
+#include "catalog_db.h"
+#include "ip_limiter.h"
+#include "latency.h"
+#include "line_reader.h"
+#include "reply_match.h"
+#include "selector.h"
+#include "session.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// ------------------------------ Harness ------------------------------
+
+/*
+ * Every recv() made by this binary (ours or LineReader's) goes through this
+ * definition, which lets the benchmarks report real syscall counts.
+ */
+static atomic<long> recv_calls{0};
+
+extern "C" ssize_t recv(int fd, void* buf, size_t n, int flags) noexcept {
+    recv_calls.fetch_add(1, memory_order_relaxed);
+    return ::syscall(SYS_recvfrom, fd, buf, n, flags, nullptr, nullptr);
+}
+
+static double now_ns() {
+    return static_cast<double>(chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+static bool write_all(int fd, const string& s) {
+    const char* p = s.data();
+    size_t left = s.size();
+    while (left) {
+        ssize_t n = ::send(fd, p, left, 0);
+        if (n <= 0) return false;
+        p += n; left -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// ---------------------------- Line reader ----------------------------
+
+/* The original one-byte-per-recv() reader, kept here as the baseline. */
+static bool legacy_recv_line(int fd, string& line) {
+    line.clear();
+    char ch;
+    while (true) {
+        ssize_t n = ::recv(fd, &ch, 1, 0);
+        if (n <= 0) return false;
+        if (ch == '\r') continue;
+        if (ch == '\n') break;
+        line.push_back(ch);
+        if (line.size() > 4096) break;
+    }
+    return true;
+}
+
+/*
+ * One full joke exchange as seen by both ends: the server's four turns and the
+ * client's three replies. Each element is one write by the sender.
+ */
+static const vector<string> kExchange = {
+    "Knock knock! <input>\n",
+    "Who's there?\n",
+    "Harry <input>\n",
+    "Harry who?\n",
+    "Harry up and open the Chamber of Secrets before I get caught!\n"
+    "Would you like to listen to another? (Y/N) <input>\n",
+    "N\n",
+};
+
+static size_t lines_in(const string& s) {
+    size_t n = 0;
+    for (char c : s) n += c == '\n';
+    return n;
+}
+
+/*
+ * Lock-step: each turn is written, then read back line by line before the
+ * next turn, like a real conversation. Pipelined: the whole exchange is
+ * written up front and then read, which only the buffered reader can exploit.
+ */
+static void run_linereader(const char* label, bool buffered, bool pipelined, int rounds) {
+    int sv[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) { perror("socketpair"); return; }
+
+    LineReader in(sv[1], 4096);
+    string line;
+    auto read_one = [&]() { return buffered ? in.read_line(line) : legacy_recv_line(sv[1], line); };
+
+    long   calls0 = recv_calls.load();
+    double t0     = now_ns();
+    for (int r = 0; r < rounds; ++r) {
+        if (pipelined) {
+            string all;
+            size_t n = 0;
+            for (const auto& turn : kExchange) { all += turn; n += lines_in(turn); }
+            write_all(sv[0], all);
+            for (size_t i = 0; i < n; ++i) read_one();
+        } else {
+            for (const auto& turn : kExchange) {
+                write_all(sv[0], turn);
+                for (size_t i = lines_in(turn); i > 0; --i) read_one();
+            }
+        }
+    }
+    double dt    = now_ns() - t0;
+    long   calls = recv_calls.load() - calls0;
+
+    printf("  %-22s %8.1f recv()/exchange %10.0f ns/exchange\n",
+           label, static_cast<double>(calls) / rounds, dt / rounds);
+    ::close(sv[0]);
+    ::close(sv[1]);
+}
+
+static void bench_linereader() {
+    const int rounds = 20000;
+    puts("linereader: one full joke exchange (7 lines) over a socketpair");
+    run_linereader("legacy, lock-step", false, false, rounds);
+    run_linereader("buffered, lock-step", true, false, rounds);
+    run_linereader("legacy, pipelined", false, true, rounds);
+    run_linereader("buffered, pipelined", true, true, rounds);
+}
+
+// ---------------------------- Joke selection ----------------------------
+
+/* The original selection: rebuild the untold list, probe a std::set per row. */
+static size_t legacy_pick(mt19937& rng, size_t n, set<size_t>& told) {
+    vector<size_t> avail;
+    avail.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        if (!told.count(i)) avail.push_back(i);
+    }
+    uniform_int_distribution<size_t> dist(0, avail.size() - 1);
+    size_t idx = avail[dist(rng)];
+    told.insert(idx);
+    return idx;
+}
+
+static volatile size_t sink;
+
+/* Heap + inline bytes a session spends on its selector (bits inline up to 64 rows, no tree up to one block). */
+static size_t bitset_bytes(size_t n) {
+    if (n <= 64) return sizeof(JokePicker);
+    size_t blocks = ((n + 63) / 64 + 63) / 64;
+    return sizeof(JokePicker) + (n + 63) / 64 * 8 + (blocks > 1 ? (blocks + 1) * 4 : 0);
+}
+
+static void bench_select() {
+    puts("select: ns per pick and selector bytes per session");
+    puts("  (legacy = avail vector + std::set; bitset = --select=bitset; feistel = --select=feistel)");
+    printf("  %10s %12s %12s %12s %12s %14s %14s\n", "catalog", "legacy", "bitset 10%",
+           "bitset all", "feistel all", "bitset B/sess", "feistel B/sess");
+    for (size_t n : {1000UL, 100000UL, 1000000UL, 10000000UL}) {
+        mt19937 rng(42);
+
+        // Legacy: a handful of picks is plenty, each one scans the whole catalog
+        char legacy[32] = "-";
+        if (n <= 1000000) {
+            set<size_t> told;
+            size_t picks = n >= 1000000 ? 10 : 100;
+            double t0 = now_ns();
+            for (size_t i = 0; i < picks; ++i) sink = legacy_pick(rng, n, told);
+            snprintf(legacy, sizeof(legacy), "%.0f", (now_ns() - t0) / static_cast<double>(picks));
+        }
+
+        // Bitset: first 10% of the catalog (typical session), then the full catalog
+        JokePicker picker;
+        size_t idx = 0;
+        picker.reset(n);
+        double t0 = now_ns();
+        for (size_t i = 0; i < n / 10; ++i) { picker.pick(rng, n, idx); sink = idx; }
+        double early = (now_ns() - t0) / static_cast<double>(n / 10);
+
+        picker.reset(n);
+        t0 = now_ns();
+        while (picker.pick(rng, n, idx)) sink = idx;
+        double all = (now_ns() - t0) / static_cast<double>(n);
+
+        // Feistel: the full catalog; cost does not depend on how much was told
+        PermutationPicker perm;
+        t0 = now_ns();
+        while (perm.pick(rng, n, idx)) sink = idx;
+        double feistel = (now_ns() - t0) / static_cast<double>(n);
+
+        printf("  %10zu %12s %12.1f %12.1f %12.1f %14zu %14zu\n", n, legacy, early, all, feistel,
+               bitset_bytes(n), sizeof(PermutationPicker));
+    }
+}
+
+// ---------------------------- Session seeding ----------------------------
+
+/* ns to seed one session's generator and draw its first joke, averaged over `n` sessions. */
+template <class Seed>
+static double ns_per_seed(size_t n, Seed seed) {
+    double t0 = now_ns();
+    for (size_t i = 0; i < n; ++i) sink = seed();
+    return (now_ns() - t0) / static_cast<double>(n);
+}
+
+static void bench_seed() {
+    puts("seed: ns per connection to seed its generator and draw a first joke (catalog of 20)");
+    const size_t n = 20000;
+    size_t idx = 0;
+    double legacy = ns_per_seed(n, [&] {
+        random_device rd;
+        mt19937 rng(rd());
+        JokePicker picker;
+        picker.pick(rng, 20, idx);
+        return idx;
+    });
+    double device = ns_per_seed(n, [&] {
+        random_device rd;
+        Pcg32 rng(rd());
+        JokePicker picker;
+        picker.pick(rng, 20, idx);
+        return idx;
+    });
+    SeedSource seeds(42);
+    double derived = ns_per_seed(n, [&] {
+        Pcg32 rng(seeds.next());
+        JokePicker picker;
+        picker.pick(rng, 20, idx);
+        return idx;
+    });
+    printf("  %-40s %10.1f\n", "random_device + mt19937 (legacy)", legacy);
+    printf("  %-40s %10.1f\n", "random_device + Pcg32", device);
+    printf("  %-40s %10.1f\n", "startup seed + splitmix64 + Pcg32", derived);
+}
+
+// ---------------------------- Catalog startup ----------------------------
+
+/* Create a jokes table with `rows` synthetic rows (bulk insert in one transaction). */
+static bool make_synthetic_db(const string& path, size_t rows) {
+    ::unlink(path.c_str());
+    sqlite3* db = nullptr;
+    if (sqlite3_open(path.c_str(), &db) != SQLITE_OK) { sqlite3_close(db); return false; }
+    sqlite3_exec(db, "PRAGMA journal_mode=OFF; PRAGMA synchronous=OFF;"
+                     "CREATE TABLE jokes (id INTEGER PRIMARY KEY AUTOINCREMENT,"
+                     " setup TEXT NOT NULL, punchline TEXT NOT NULL); BEGIN;",
+                 nullptr, nullptr, nullptr);
+    sqlite3_stmt* st = nullptr;
+    sqlite3_prepare_v2(db, "INSERT INTO jokes (setup, punchline) VALUES (?, ?);", -1, &st, nullptr);
+    char setup[32], punch[96];
+    for (size_t i = 0; i < rows; ++i) {
+        int sl = snprintf(setup, sizeof(setup), "Setup%zu", i);
+        int pl = snprintf(punch, sizeof(punch), "Setup%zu up and open the door, it is cold out here!", i);
+        sqlite3_bind_text(st, 1, setup, sl, SQLITE_STATIC);
+        sqlite3_bind_text(st, 2, punch, pl, SQLITE_STATIC);
+        sqlite3_step(st);
+        sqlite3_reset(st);
+    }
+    sqlite3_finalize(st);
+    sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
+    sqlite3_close(db);
+    return true;
+}
+
+static double ms_since(double t0) { return (now_ns() - t0) / 1e6; }
+
+/* The loader before prepared statements: sqlite3_exec() with a per-row text callback. */
+static int legacy_row(void* data, int argc, char** argv, char**) {
+    if (argc == 3) {
+        static_cast<Catalog*>(data)->add(argv[0] ? strtoll(argv[0], nullptr, 10) : 0,
+                                         argv[1] ? argv[1] : "", argv[2] ? argv[2] : "");
+    }
+    return 0;
+}
+
+static bool legacy_load(const string& path, Catalog& out) {
+    sqlite3* db = nullptr;
+    bool ok = sqlite3_open_v2(path.c_str(), &db, SQLITE_OPEN_READONLY, nullptr) == SQLITE_OK &&
+              sqlite3_exec(db, "SELECT rowid, setup, punchline FROM jokes ORDER BY rowid;",
+                           legacy_row, &out, nullptr) == SQLITE_OK;
+    sqlite3_close(db);
+    return ok;
+}
+
+static void bench_catalog() {
+    puts("catalog: time until the server can tell the first joke (ms; first joke in us)");
+    printf("  %10s %10s %10s %10s %10s %10s %10s %12s\n", "rows", "exec", "stmt x1", "stmt x2",
+           "stmt x4", "stmt x8", "mmap", "first joke");
+    const string db = "/tmp/kk_bench_jokes.db", kkc = "/tmp/kk_bench_jokes.kkc";
+    for (size_t rows : {10000UL, 1000000UL, 10000000UL}) {
+        if (!make_synthetic_db(db, rows)) { puts("  cannot create synthetic database"); return; }
+
+        double t0 = now_ns();
+        {
+            Catalog legacy;
+            legacy_load(db, legacy);
+        }
+        double exec_ms = ms_since(t0);
+
+        // Prepared-statement loader at increasing thread counts (1 = no split)
+        double stmt_ms[4];
+        const unsigned threads[4] = {1, 2, 4, 8};
+        Catalog loaded;
+        for (int i = 0; i < 4; ++i) {
+            loaded = Catalog();
+            t0 = now_ns();
+            load_jokes_from_db(db, loaded, threads[i]);
+            stmt_ms[i] = ms_since(t0);
+        }
+
+        string err;
+        loaded.write_file(kkc, err);
+        loaded = Catalog();
+        t0 = now_ns();
+        Catalog mapped;
+        Catalog::map_file(kkc, mapped, err);
+        double mmap_ms = ms_since(t0);
+
+        // First access pays the page faults the mapping deferred
+        t0 = now_ns();
+        sink = mapped[mapped.size() / 2].punchline.size();
+        double first_us = (now_ns() - t0) / 1e3;
+
+        printf("  %10zu %10.1f %10.1f %10.1f %10.1f %10.1f %10.3f %12.1f\n", rows, exec_ms,
+               stmt_ms[0], stmt_ms[1], stmt_ms[2], stmt_ms[3], mmap_ms, first_us);
+    }
+    printf("  (%u hardware threads)\n", thread::hardware_concurrency());
+    ::unlink(db.c_str());
+    ::unlink(kkc.c_str());
+}
+
+// ---------------------------- Reply matching ----------------------------
+
+/* The original comparison: trim and lower both sides into fresh strings. */
+static string legacy_trim(const string& s) {
+    size_t i = s.find_first_not_of(" \t\r\n");
+    if (i == string::npos) return "";
+    size_t j = s.find_last_not_of(" \t\r\n");
+    return s.substr(i, j - i + 1);
+}
+static string legacy_lower(string s) {
+    for (char& c : s) c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+    return s;
+}
+static bool legacy_iequals(const string& a, const string& b) {
+    return legacy_lower(legacy_trim(a)) == legacy_lower(legacy_trim(b));
+}
+
+template <class F>
+static double ns_per_match(const vector<string>& replies, const string& expect, F match, int rounds) {
+    size_t hits = 0;
+    double t0 = now_ns();
+    for (int r = 0; r < rounds; ++r) {
+        for (const auto& reply : replies) hits += match(reply, expect);
+    }
+    sink = hits;
+    return (now_ns() - t0) / (static_cast<double>(rounds) * replies.size());
+}
+
+static void bench_match() {
+    puts("match: ns per reply check (half the replies match in mixed case, half differ in the last letter)");
+    printf("  %-24s %6s %12s %12s %12s\n", "expected", "bytes", "iequals", "scalar", "simd");
+    const vector<string> answers = {
+        "y",
+        "who's there?",
+        "hermione granger who?",
+        "the boy who lived under the stairs for eleven long years who?",
+        string(200, 'x') + " who?",
+    };
+    const int rounds = 200000;
+    for (const auto& expect : answers) {
+        vector<string> replies;
+        for (int i = 0; i < 8; ++i) {
+            string r = expect;
+            for (size_t k = i; k < r.size(); k += 3) r[k] = static_cast<char>(toupper(static_cast<unsigned char>(r[k])));
+            if (i % 2) r.back() = 'Q';
+            replies.push_back(i % 4 == 0 ? " " + r + "\r" : r);
+        }
+        double legacy = ns_per_match(replies, expect, legacy_iequals, rounds / 4);
+        double scalar = ns_per_match(replies, expect, [](const string& a, const string& b) {
+            return reply_matches_scalar(a, b); }, rounds);
+        double simd = ns_per_match(replies, expect, [](const string& a, const string& b) {
+            return reply_matches(a, b); }, rounds);
+        string label = expect.size() > 24 ? expect.substr(0, 21) + "..." : expect;
+        printf("  %-24s %6zu %12.1f %12.1f %12.1f\n", label.c_str(), expect.size(), legacy, scalar, simd);
+    }
+}
+
+// ---------------------------- Accept path ----------------------------
+
+/*
+ * Accepts per second on a loopback listener while two threads connect and
+ * reset in a loop from 127.0.0.1-127.0.0.16, with each accepted socket run
+ * through `lim` (if any) the way the server's accept path does: admit,
+ * close, release.
+ */
+static void run_accept(const char* label, IpLimiter* lim) {
+    int lfd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int one = 1;
+    ::setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr{};
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t alen = sizeof(addr);
+    if (::bind(lfd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || ::listen(lfd, SOMAXCONN) < 0 ||
+        ::getsockname(lfd, reinterpret_cast<sockaddr*>(&addr), &alen) < 0) {
+        perror("accept bench: listen");
+        ::close(lfd);
+        return;
+    }
+
+    atomic<bool> stop{false};
+    vector<thread> clients;
+    for (int c = 0; c < 2; ++c) {
+        clients.emplace_back([&, c] {
+            linger hard{1, 0};  // reset on close: no TIME_WAIT pile-up
+            for (uint32_t i = static_cast<uint32_t>(c); !stop.load(memory_order_relaxed); i += 2) {
+                int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+                sockaddr_in src{};
+                src.sin_family      = AF_INET;
+                src.sin_addr.s_addr = htonl(INADDR_LOOPBACK + i % 16);
+                ::bind(fd, reinterpret_cast<sockaddr*>(&src), sizeof(src));
+                ::setsockopt(fd, SOL_SOCKET, SO_LINGER, &hard, sizeof(hard));
+                ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+                ::close(fd);
+            }
+        });
+    }
+
+    long accepted = 0, refused = 0;
+    double t0 = now_ns(), end = t0 + 1e9;
+    while (now_ns() < end) {
+        sockaddr_in peer{};
+        socklen_t   plen = sizeof(peer);
+        int fd = ::accept4(lfd, reinterpret_cast<sockaddr*>(&peer), &plen, SOCK_CLOEXEC);
+        if (fd < 0) continue;
+        ++accepted;
+        uint32_t ip = ntohl(peer.sin_addr.s_addr);
+        bool ok = !lim || lim->admit(ip, static_cast<int64_t>(now_ns() / 1000)) == IpLimiter::Verdict::Ok;
+        refused += !ok;
+        ::close(fd);
+        if (ok && lim) lim->release(ip);
+    }
+    double secs = (now_ns() - t0) / 1e9;
+    stop.store(true);
+    ::shutdown(lfd, SHUT_RDWR);  // a client still in connect() gets refused
+    for (auto& t : clients) t.join();
+    ::close(lfd);
+    printf("  %-34s %12.0f %12.0f\n", label, static_cast<double>(accepted) / secs, static_cast<double>(refused) / secs);
+}
+
+/* ns per admit + release from `threads` threads, over `addresses` source addresses. */
+static double ns_per_check(IpLimiter& lim, int threads, uint32_t addresses) {
+    const int rounds = 400000;
+    vector<thread> ths;
+    double t0 = now_ns();
+    for (int t = 0; t < threads; ++t) {
+        ths.emplace_back([&, t] {
+            for (int i = 0; i < rounds; ++i) {
+                uint32_t ip = 0x0a000000 + static_cast<uint32_t>(i * 7 + t) % addresses;
+                if (lim.admit(ip, 0) == IpLimiter::Verdict::Ok) lim.release(ip);
+            }
+        });
+    }
+    for (auto& th : ths) th.join();
+    return (now_ns() - t0) / (static_cast<double>(rounds) * threads);
+}
+
+static void bench_accept() {
+    puts("accept: loopback accepts per second, two threads connecting from 16 addresses");
+    printf("  %-34s %12s %12s\n", "per-address limiter", "accepts/s", "refused/s");
+    run_accept("off", nullptr);
+    IpLimiter generous;
+    generous.configure(1e6, 1000, 1000, 65536);
+    run_accept("on, nobody over the limits", &generous);
+    IpLimiter strict;
+    strict.configure(50, 10, 4, 65536);
+    run_accept("on, 50/s per address", &strict);
+
+    puts("  ns per admit + release (connection cap only, so every check passes)");
+    printf("  %-34s %12s %12s\n", "", "1 address", "4096 addrs");
+    for (int threads : {1, 4}) {
+        IpLimiter lim;
+        lim.configure(0, 0, 60000, 65536);
+        double hot  = ns_per_check(lim, threads, 1);
+        double wide = ns_per_check(lim, threads, 4096);
+        string label = to_string(threads) + (threads == 1 ? " thread" : " threads");
+        printf("  %-34s %12.1f %12.1f\n", label.c_str(), hot, wide);
+    }
+}
+
+// ----------------------------- Idle sessions -----------------------------
+
+/* Resident set size in bytes, from /proc/self/statm. */
+static long resident_bytes() {
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    long size = 0, resident = 0;
+    if (fscanf(f, "%ld %ld", &size, &resident) != 2) resident = 0;
+    fclose(f);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+/*
+ * C1M: a million sessions set up the way the reactor does it (slab session,
+ * fd-table slot, deadline armed), each one exchange in and waiting for its
+ * next line. Sockets are left out, so the growth in resident memory is what
+ * the server itself spends per idle connection; the kernel's socket buffers
+ * come on top.
+ */
+static void bench_sessions() {
+    const size_t n = 1000000;
+    printf("sessions: resident bytes per idle session, %zu sessions waiting for their next line\n", n);
+    printf("  sizeof: session %zu = picker %zu + reader %zu + output %zu + timer %zu + the rest\n",
+           sizeof(ClientSession), sizeof(JokePicker), sizeof(LineReader), sizeof(OutQueue), sizeof(TimerWheel::Timer));
+
+    auto jokes = make_shared<Catalog>();  // jokes.db size: the picker keeps its bits inline
+    for (int i = 1; i <= 20; ++i) {
+        string who = "Setup" + to_string(i);
+        jokes->add(i, who, who + " up and open the door, it is cold out here!");
+    }
+    TimerWheel timers;
+    long rss0 = resident_bytes();
+    double t0 = now_ns();
+    vector<ClientSession*> table(n);  // the reactor's sessions_, indexed by fd
+    for (size_t i = 0; i < n; ++i) {
+        auto* s           = new ClientSession();
+        s->select_mode    = SelectMode::Bitset;
+        s->deadline.owner = s;
+        s->rng.seed(i);
+        adopt_catalog(s, jokes);
+        start_joke(s);
+        s->outbuf.consume(s->outbuf.size());  // "Knock knock!" went out
+
+        // The client answers; the setup line goes out; the session waits again
+        s->in.feed("Who's there?\n", 13);
+        string_view line;
+        while (s->in.next_line(line)) on_client_line(s, line);
+        s->outbuf.consume(s->outbuf.size());
+        timers.arm(s->deadline, 60000 + i % 1000);
+        table[i] = s;
+    }
+    double secs = (now_ns() - t0) / 1e9;
+    long   rss1 = resident_bytes();
+
+    printf("  %-34s %12.0f B/session %10.0f sessions/s set up\n", "slab sessions, buffers released",
+           static_cast<double>(rss1 - rss0) / static_cast<double>(n), static_cast<double>(n) / secs);
+
+    // The same bytes from the general-purpose heap, for comparison: header and rounding per block
+    vector<void*> heap(n);
+    long rss2 = resident_bytes();
+    for (size_t i = 0; i < n; ++i) {
+        heap[i] = malloc(sizeof(ClientSession));
+        memset(heap[i], 0, sizeof(ClientSession));
+    }
+    long rss3 = resident_bytes();
+    printf("  %-34s %12.0f B/session\n", "same size from malloc (no table)",
+           static_cast<double>(rss3 - rss2) / static_cast<double>(n));
+
+    for (void* p : heap) free(p);
+    for (ClientSession* s : table) {
+        timers.cancel(s->deadline);
+        delete s;
+    }
+}
+
+// -------------------------------- Logging --------------------------------
+
+/*
+ * ns a thread spends per connect line passed to log(), with `threads`
+ * threads each logging bursts of 1000 lines 2 ms apart (a busy accept loop,
+ * not a flood: a burst fits in a log ring).
+ */
+template <class F>
+static double ns_per_line(int threads, F log) {
+    const int bursts = 100, burst = 1000;
+    vector<thread> ths;
+    atomic<double> busy{0};
+    for (int t = 0; t < threads; ++t) {
+        ths.emplace_back([&, t] {
+            sockaddr_in a{};
+            a.sin_addr.s_addr = htonl(0x7f000001);
+            double mine = 0;
+            for (int b = 0; b < bursts; ++b) {
+                double t0 = now_ns();
+                for (int i = 0; i < burst; ++i) {
+                    a.sin_port = htons(static_cast<uint16_t>(40000 + i + t));
+                    log(a);
+                }
+                mine += now_ns() - t0;
+                this_thread::sleep_for(chrono::milliseconds(2));
+            }
+            busy.fetch_add(mine);
+        });
+    }
+    for (auto& th : ths) th.join();
+    return busy.load() / (static_cast<double>(bursts) * burst * threads);
+}
+
+/*
+ * What a session thread pays for one "Client connected from ..." line: the
+ * old way (format, then a write() per line as with line-buffered stdout, or
+ * a buffered stream shared under its lock) against a record in this thread's
+ * ring (async_log.h). Output goes to /dev/null, so this is the logging, not
+ * the terminal.
+ */
+static void bench_log() {
+    puts("log: ns per connect line, as seen by the logging thread (output to /dev/null)");
+    printf("  %-34s %12s %12s\n", "", "1 thread", "4 threads");
+    int null_fd = ::open("/dev/null", O_WRONLY | O_CLOEXEC);
+    FILE* null_file = fdopen(::dup(null_fd), "w");
+    mutex m;
+
+    auto by_write = [&](const sockaddr_in& a) {
+        char ip[INET_ADDRSTRLEN], line[64];
+        inet_ntop(AF_INET, &a.sin_addr, ip, sizeof(ip));
+        int n = snprintf(line, sizeof(line), "Client connected from %s:%u\n", ip, ntohs(a.sin_port));
+        [[maybe_unused]] ssize_t w = ::write(null_fd, line, static_cast<size_t>(n));
+    };
+    auto by_stream = [&](const sockaddr_in& a) {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &a.sin_addr, ip, sizeof(ip));
+        lock_guard<mutex> lk(m);
+        fprintf(null_file, "Client connected from %s:%u\n", ip, ntohs(a.sin_port));
+    };
+    printf("  %-34s %12.1f %12.1f\n", "format + write() per line", ns_per_line(1, by_write), ns_per_line(4, by_write));
+    printf("  %-34s %12.1f %12.1f\n", "format into a shared buffered stream", ns_per_line(1, by_stream),
+           ns_per_line(4, by_stream));
+
+    double ns[2];
+    uint64_t dropped = 0;
+    for (int k = 0; k < 2; ++k) {
+        AsyncLog log;
+        log.start(null_fd, null_fd);
+        ns[k] = ns_per_line(k ? 4 : 1, [&](const sockaddr_in& a) {
+            log.write(LogLevel::Info, "Client connected from %a\n", AsyncLog::addr(a));
+        });
+        log.stop();
+        dropped += log.dropped();
+    }
+    printf("  %-34s %12.1f %12.1f   (%llu lines dropped)\n", "record into a per-thread ring", ns[0], ns[1],
+           static_cast<unsigned long long>(dropped));
+    fclose(null_file);
+    ::close(null_fd);
+}
+
+/* Mean CPU ns per call of `op` on each of `threads` threads (thread CPU time, so a busy core doesn't count). */
+template <class F>
+static double ns_per_op(int threads, F op) {
+    const int kOps = 2'000'000;
+    atomic<double> total{0};
+    vector<thread> ts;
+    for (int t = 0; t < threads; ++t) {
+        ts.emplace_back([&, t] {
+            op(t, 1000);  // warm up
+            timespec a{}, b{};
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &a);
+            op(t, kOps);
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &b);
+            double ns = static_cast<double>(b.tv_sec - a.tv_sec) * 1e9 + static_cast<double>(b.tv_nsec - a.tv_nsec);
+            total.fetch_add(ns / kOps);
+        });
+    }
+    for (auto& th : ts) th.join();
+    return total.load() / threads;
+}
+
+static void bench_latency() {
+    puts("latency: ns per timed step (read the clock, record the interval)");
+    printf("  %-34s %12s %12s\n", "", "1 thread", "4 threads");
+    static latency::Histogram h;
+    volatile uint64_t sink = 0;
+    auto steady = [&](int, int n) {
+        for (int i = 0; i < n; ++i) sink = sink + static_cast<uint64_t>(chrono::steady_clock::now().time_since_epoch().count());
+    };
+    auto ticks = [&](int, int n) {
+        for (int i = 0; i < n; ++i) sink = sink + latency::now();
+    };
+    auto timed = [&](int n) {
+        uint64_t from = latency::now();
+        for (int i = 0; i < n; ++i) {
+            uint64_t to = latency::now();
+            h.record(latency::elapsed(from, to));
+            from = to;
+        }
+    };
+    auto own_slot = [&](int t, int n) {
+        set_counter_shard(static_cast<size_t>(t + 1));
+        timed(n);
+    };
+    auto one_slot = [&](int, int n) {
+        set_counter_shard(0);
+        timed(n);
+    };
+    printf("  %-34s %12.1f %12.1f\n", "steady_clock::now()", ns_per_op(1, steady), ns_per_op(4, steady));
+    printf("  %-34s %12.1f %12.1f\n", "latency::now() (rdtsc)", ns_per_op(1, ticks), ns_per_op(4, ticks));
+    printf("  %-34s %12.1f %12.1f\n", "now() + record, own slot", ns_per_op(1, own_slot), ns_per_op(4, own_slot));
+    printf("  %-34s %12.1f %12.1f\n", "now() + record, one shared slot", ns_per_op(1, one_slot), ns_per_op(4, one_slot));
+}
+
+// ------------------------------- Main --------------------------------
+
+struct Bench {
+    const char* name;
+    void (*fn)();
+};
+
+static const Bench kBenches[] = {
+    {"linereader", bench_linereader},
+    {"select",     bench_select},
+    {"seed",       bench_seed},
+    {"catalog",    bench_catalog},
+    {"match",      bench_match},
+    {"accept",     bench_accept},
+    {"sessions",   bench_sessions},
+    {"log",        bench_log},
+    {"latency",    bench_latency},
+};
+
+int main(int argc, char** argv) {
+    bool ran = false;
+    for (const auto& b : kBenches) {
+        bool wanted = argc < 2;
+        for (int i = 1; i < argc; ++i) wanted |= strcmp(argv[i], b.name) == 0;
+        if (!wanted) continue;
+        b.fn();
+        ran = true;
+    }
+    if (!ran) {
+        cerr << "Unknown benchmark. Available:";
+        for (const auto& b : kBenches) cerr << " " << b.name;
+        cerr << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,377 @@
+/*
+ * catalog.h
+ * ---------
+ * In-memory joke catalog with pre-rendered protocol frames.
+ *
+ * Everything the server ever sends or compares for a given joke is rendered
+ * once, when the catalog is loaded, into one contiguous string heap:
+ *
+ *   prompt      "<setup> <input>\n"
+ *   punchline   "<punchline>\n"
+ *   expect      "<setup> who?", trimmed and lower-cased (compared against replies)
+ *   correction  "You are supposed to say, \"<setup> who?\". Let's try again.\n"
+ *
+ * A session then only hands out string_views into the heap, so telling a joke
+ * does not allocate. add() may grow the heap, so take views only once loading
+ * has finished; after that they live as long as the Catalog.
+ *
+ * Catalogs are immutable once published. CatalogStore hands out snapshots
+ * RCU-style: the server loads a new Catalog on the side and publishes it with
+ * one pointer swap; sessions notice at their next joke (one atomic load) and
+ * move over, while jokes already in flight keep the snapshot they started on.
+ * A snapshot is freed when its last session lets go of it.
+ */
+
+#pragma once
+
+#include "reply_match.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/* Read-only view of one joke's frames. */
+struct Joke {
+    int64_t          id;          // database row id, stable across reloads
+    std::string_view setup;       // as stored in the database
+    std::string_view prompt;      // "<setup> <input>\n"
+    std::string_view punchline;   // "<punchline>\n"
+    std::string_view expect;      // normalized "<setup> who?"
+    std::string_view correction;  // correction line for a wrong "<setup> who?"
+};
+
+class Catalog {
+public:
+    static constexpr std::string_view kInputMarker = " <input>\n";
+
+    Catalog() = default;
+    Catalog(Catalog&& other) noexcept { *this = std::move(other); }
+    Catalog& operator=(Catalog&& other) noexcept {
+        heap_    = std::move(other.heap_);
+        recs_    = std::move(other.recs_);
+        map_     = std::move(other.map_);
+        sorted_  = other.sorted_;
+        version_ = other.version_;
+        sync();
+        other.sync();
+        return *this;
+    }
+    Catalog(const Catalog&)            = delete;
+    Catalog& operator=(const Catalog&) = delete;
+
+    size_t size()  const { return count_; }
+    bool   empty() const { return count_ == 0; }
+    size_t heap_size() const { return map_ ? map_->heap_sz : heap_.size(); }  // rendered bytes
+
+    /* Heap bytes add() needs for `jokes` rows with this much setup and punchline text. */
+    static size_t heap_bytes_for(size_t jokes, size_t setup_bytes, size_t punch_bytes) {
+        return 3 * setup_bytes + punch_bytes + jokes * kFramingBytes;
+    }
+
+    /* Pre-size so that adding that many rows never reallocates. */
+    void reserve(size_t jokes, size_t setup_bytes, size_t punch_bytes) {
+        recs_.reserve(jokes);
+        heap_.reserve(heap_bytes_for(jokes, setup_bytes, punch_bytes));
+        sync();
+    }
+
+    /* Pre-size for `jokes` rows whose rendered text is exactly `heap_bytes` (see append()). */
+    void reserve_exact(size_t jokes, size_t heap_bytes) {
+        recs_.reserve(jokes);
+        heap_.reserve(heap_bytes);
+        sync();
+    }
+
+    /* Render and append one joke; `id` is its database row id. */
+    void add(int64_t id, std::string_view setup, std::string_view punchline) {
+        if (!recs_.empty() && id <= recs_.back().id) sorted_ = false;
+
+        Record r{};
+        r.id        = id;
+        r.off       = heap_.size();
+        r.setup_len = static_cast<uint32_t>(setup.size());
+
+        heap_.append(setup);
+        heap_.append(kInputMarker);
+
+        // send_line() semantics: a newline is appended unless already present
+        heap_.append(punchline);
+        if (punchline.empty() || punchline.back() != '\n') heap_.push_back('\n');
+        r.punch_len = static_cast<uint32_t>(heap_.size() - r.off - r.setup_len - kInputMarker.size());
+
+        // expect = lower(trim(setup + " who?")); only the front can need trimming
+        size_t expect_off = heap_.size();
+        size_t lead = setup.find_first_not_of(" \t\r\n");
+        if (lead == std::string_view::npos) {
+            heap_.append("who?");
+        } else {
+            for (char c : setup.substr(lead)) heap_.push_back(ascii_lower(c));
+            heap_.append(" who?");
+        }
+        r.expect_len = static_cast<uint32_t>(heap_.size() - expect_off);
+
+        size_t corr_off = heap_.size();
+        heap_.append("You are supposed to say, \"");
+        heap_.append(setup);
+        heap_.append(" who?\". Let's try again.\n");
+        r.corr_len = static_cast<uint32_t>(heap_.size() - corr_off);
+
+        recs_.push_back(r);
+        sync();
+    }
+
+    /*
+     * Append every joke of `part` (built by add()) without re-rendering.
+     * Used to stitch range-loaded pieces into one contiguous catalog.
+     */
+    void append(const Catalog& part) {
+        if (part.empty()) return;
+        if (!recs_.empty() && part.rec_base_[0].id <= recs_.back().id) sorted_ = false;
+        sorted_ = sorted_ && part.sorted_;
+
+        uint64_t shift = heap_.size();
+        heap_.append(part.heap_base_, part.heap_size());
+        for (size_t i = 0; i < part.count_; ++i) {
+            Record r = part.rec_base_[i];
+            r.off += shift;
+            recs_.push_back(r);
+        }
+        sync();
+    }
+
+    Joke operator[](size_t i) const {
+        const Record& r = rec_base_[i];
+        const char*   p = heap_base_ + r.off;
+        Joke j;
+        j.id         = r.id;
+        j.setup      = {p, r.setup_len};
+        j.prompt     = {p, r.setup_len + kInputMarker.size()};
+        p           += j.prompt.size();
+        j.punchline  = {p, r.punch_len};
+        p           += r.punch_len;
+        j.expect     = {p, r.expect_len};
+        p           += r.expect_len;
+        j.correction = {p, r.corr_len};
+        return j;
+    }
+
+    int64_t id(size_t i) const { return rec_base_[i].id; }
+
+    /* Index of the joke with row id `id`, or size() if this catalog lacks it. */
+    size_t find(int64_t id) const {
+        const Record* end = rec_base_ + count_;
+        if (sorted_) {
+            const Record* it = std::lower_bound(rec_base_, end, id,
+                                                [](const Record& r, int64_t v) { return r.id < v; });
+            return (it != end && it->id == id) ? static_cast<size_t>(it - rec_base_) : size();
+        }
+        for (size_t i = 0; i < count_; ++i) {
+            if (rec_base_[i].id == id) return i;
+        }
+        return size();
+    }
+
+    /* Snapshot number assigned by CatalogStore::publish() (0 = never published). */
+    uint64_t version() const { return version_; }
+
+    /* True if the frames are served straight from a mapped catalog file. */
+    bool mapped() const { return map_ != nullptr; }
+
+    // --------------------- Compiled catalog files ---------------------
+    //
+    // `catalog-compile` writes a built Catalog to disk so the server can mmap
+    // it instead of querying SQLite: startup is O(1) regardless of row count,
+    // and every server process on the box shares one copy in the page cache.
+    //
+    //   FileHeader | Record[count] | frame heap
+    //
+    // Records and the heap are exactly the in-memory layout, so serving from
+    // the mapping needs no parsing. Integers are native-endian; `byte_order`
+    // rejects files compiled on a machine with the other endianness.
+
+    static constexpr char     kFileMagic[8] = {'K', 'K', 'C', 'A', 'T', 'L', 'G', '\0'};
+    static constexpr uint32_t kFileVersion  = 1;
+
+    struct FileHeader {
+        char     magic[8];
+        uint32_t file_version;
+        uint32_t byte_order;    // 0x01020304 as written by the compiler
+        uint32_t record_size;   // sizeof(Record)
+        uint32_t flags;         // bit 0: ids strictly increasing
+        uint64_t count;
+        uint64_t records_off;   // from the start of the file
+        uint64_t heap_off;
+        uint64_t heap_size;
+    };
+
+    /* Write this catalog as a compiled file (to a temp name, then rename). */
+    bool write_file(const std::string& path, std::string& err) const {
+        FileHeader h{};
+        std::memcpy(h.magic, kFileMagic, sizeof(h.magic));
+        h.file_version = kFileVersion;
+        h.byte_order   = 0x01020304;
+        h.record_size  = sizeof(Record);
+        h.flags        = sorted_ ? 1u : 0u;
+        h.count        = count_;
+        h.records_off  = sizeof(FileHeader);
+        h.heap_off     = h.records_off + count_ * sizeof(Record);
+        h.heap_size    = heap_size();
+
+        std::string tmp = path + ".tmp";
+        FILE* f = std::fopen(tmp.c_str(), "wb");
+        if (!f) { err = tmp + ": " + std::strerror(errno); return false; }
+        bool ok = std::fwrite(&h, sizeof(h), 1, f) == 1 &&
+                  (count_ == 0 || std::fwrite(rec_base_, sizeof(Record), count_, f) == count_) &&
+                  (h.heap_size == 0 || std::fwrite(heap_base_, 1, h.heap_size, f) == h.heap_size);
+        ok = (std::fclose(f) == 0) && ok;
+        if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+            err = path + ": " + std::strerror(errno);
+            std::remove(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    /*
+     * Map a compiled file read-only and serve from it. Only the header and the
+     * section bounds are checked, so this stays O(1); the file is trusted to
+     * come from catalog-compile.
+     */
+    static bool map_file(const std::string& path, Catalog& out, std::string& err) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) { err = path + ": " + std::strerror(errno); return false; }
+        struct stat st{};
+        if (::fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(FileHeader)) {
+            err = path + ": not a compiled catalog";
+            ::close(fd);
+            return false;
+        }
+        size_t len  = static_cast<size_t>(st.st_size);
+        void*  base = ::mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (base == MAP_FAILED) { err = path + ": " + std::strerror(errno); return false; }
+        auto map = std::make_unique<Mapping>(base, len);
+
+        FileHeader h;
+        std::memcpy(&h, base, sizeof(h));
+        if (std::memcmp(h.magic, kFileMagic, sizeof(h.magic)) != 0) { err = path + ": bad magic"; return false; }
+        if (h.file_version != kFileVersion) { err = path + ": unsupported version " + std::to_string(h.file_version); return false; }
+        if (h.byte_order != 0x01020304 || h.record_size != sizeof(Record)) { err = path + ": incompatible layout"; return false; }
+        if (h.records_off % alignof(Record) != 0 || h.count > (len - h.records_off) / sizeof(Record) ||
+            h.heap_off < h.records_off + h.count * sizeof(Record) || h.heap_off > len || h.heap_size > len - h.heap_off) {
+            err = path + ": truncated or corrupt";
+            return false;
+        }
+
+        out = Catalog();
+        out.map_          = std::move(map);
+        out.map_->recs    = reinterpret_cast<const Record*>(static_cast<const char*>(base) + h.records_off);
+        out.map_->heap    = static_cast<const char*>(base) + h.heap_off;
+        out.map_->count   = h.count;
+        out.map_->heap_sz = h.heap_size;
+        out.sorted_       = (h.flags & 1u) != 0;
+        out.sync();
+        ::madvise(base, len, MADV_RANDOM);  // jokes are picked at random
+        return true;
+    }
+
+private:
+    friend class CatalogStore;
+
+    // Fixed text added around each joke: marker, newline, " who?", correction wrapper
+    static constexpr size_t kFramingBytes = 9 + 1 + 5 + 51;
+
+    struct Record {
+        int64_t  id;          // database row id
+        uint64_t off;         // start of this joke's frames in the heap
+        uint32_t setup_len;
+        uint32_t punch_len;   // including the trailing '\n'
+        uint32_t expect_len;
+        uint32_t corr_len;
+    };
+
+    /* A read-only file mapping, unmapped with the last snapshot using it. */
+    struct Mapping {
+        Mapping(void* b, size_t l) : base(b), len(l) {}
+        ~Mapping() { ::munmap(base, len); }
+        void*         base;
+        size_t        len;
+        const Record* recs    = nullptr;
+        const char*   heap    = nullptr;
+        size_t        count   = 0;
+        size_t        heap_sz = 0;
+    };
+
+    /* Re-point the read path at whichever storage backs this catalog. */
+    void sync() {
+        if (map_) {
+            rec_base_  = map_->recs;
+            heap_base_ = map_->heap;
+            count_     = map_->count;
+        } else {
+            rec_base_  = recs_.data();
+            heap_base_ = heap_.data();
+            count_     = recs_.size();
+        }
+    }
+
+    // Built in memory (add) ...
+    std::string              heap_;
+    std::vector<Record>      recs_;
+    // ... or mapped from a compiled file
+    std::unique_ptr<Mapping> map_;
+
+    // Read path, valid for either backing
+    const Record* rec_base_  = nullptr;
+    const char*   heap_base_ = nullptr;
+    size_t        count_     = 0;
+
+    bool          sorted_  = true;  // ids strictly increasing -> binary search
+    uint64_t      version_ = 0;
+};
+
+/*
+ * The current catalog snapshot. acquire() is an atomic shared_ptr load, which
+ * libstdc++ guards with a short spin lock inside the atomic (not lock-free)
+ * and which bumps the snapshot's shared refcount, so callers keep a copy of
+ * their own and call it again only after version() -- a single atomic load --
+ * says a newer snapshot exists: the server's event loops and threads once per
+ * reload, sessions once per reload they live through. Only publishers
+ * (startup and the reloader) share a mutex.
+ */
+class CatalogStore {
+public:
+    /* Latest published version; cheap enough to check before every joke. */
+    uint64_t version() const { return version_.load(std::memory_order_acquire); }
+
+    std::shared_ptr<const Catalog> acquire() const { return current_.load(std::memory_order_acquire); }
+
+    /* Make `next` the catalog new jokes are drawn from. Returns its version. */
+    uint64_t publish(std::shared_ptr<Catalog> next) {
+        std::lock_guard<std::mutex> lk(publish_m_);
+        uint64_t v = version_.load(std::memory_order_relaxed) + 1;
+        next->version_ = v;
+        // The snapshot first: whoever sees version v acquires v or newer
+        current_.store(std::move(next), std::memory_order_release);
+        version_.store(v, std::memory_order_release);
+        return v;
+    }
+
+private:
+    std::mutex                                  publish_m_;
+    std::atomic<std::shared_ptr<const Catalog>> current_;
+    std::atomic<uint64_t>                       version_{0};
+};
@@ -0,0 +1,68 @@
+/*
+ * catalog_compile.cpp
+ * -------------------
+ * Compile the SQLite joke database into a memory-mappable catalog file.
+ *
+ * The output holds an offset table and one contiguous heap of pre-rendered
+ * protocol frames (see Catalog in catalog.h). `./server --catalog=<file>`
+ * maps it and serves straight from the page cache: no SQLite, no per-row
+ * allocation, and startup cost independent of the number of jokes. The file
+ * is written under a temporary name and renamed into place, so a running
+ * server watching it reloads exactly once, after the new file is complete.
+ *
+ * Usage:
+ *   ./catalog-compile                       -> jokes.db  -> jokes.kkc
+ *   ./catalog-compile <db>                  -> <db>      -> jokes.kkc
+ *   ./catalog-compile <db> <out>            -> <db>      -> <out>
+ *
+ * Build:
+ *   g++ -std=c++20 -Wall -Wextra -O2 -pthread catalog_compile.cpp -lsqlite3 -o catalog-compile
+ */
+
+#include "catalog_db.h"
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+int main(int argc, char** argv) {
+    string db_path  = argc >= 2 ? argv[1] : "jokes.db";
+    string out_path = argc >= 3 ? argv[2] : "jokes.kkc";
+
+    auto t0 = chrono::steady_clock::now();
+
+    Catalog catalog;
+    if (!load_jokes_from_db(db_path, catalog)) return 1;
+    if (catalog.empty()) {
+        cerr << "No jokes found in database!\n";
+        return 1;
+    }
+
+    string err;
+    if (!catalog.write_file(out_path, err)) {
+        cerr << "Write failed: " << err << "\n";
+        return 1;
+    }
+
+    // Round-trip check: the file must map back to the same jokes
+    Catalog mapped;
+    if (!Catalog::map_file(out_path, mapped, err) || mapped.size() != catalog.size()) {
+        cerr << "Verification failed: " << err << "\n";
+        return 1;
+    }
+    for (size_t i = 0; i < catalog.size(); ++i) {
+        Joke a = catalog[i], b = mapped[i];
+        if (a.id != b.id || a.prompt != b.prompt || a.punchline != b.punchline ||
+            a.expect != b.expect || a.correction != b.correction) {
+            cerr << "Verification failed at row " << a.id << "\n";
+            return 1;
+        }
+    }
+
+    auto ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - t0).count();
+    cout << "Compiled " << catalog.size() << " jokes from " << db_path << " into " << out_path
+         << " (" << ms << " ms).\n";
+    return 0;
+}
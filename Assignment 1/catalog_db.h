@@ -0,0 +1,216 @@
+/*
+ * catalog_db.h
+ * ------------
+ * Build a Catalog from the SQLite joke database.
+ * Used by the server (startup and hot reload) and by catalog-compile.
+ *
+ * Rows are read with prepared statements, straight from SQLite's column
+ * buffers into the Catalog heap (no per-row strings or callbacks). Large
+ * tables are split into rowid ranges that are loaded in parallel, one
+ * read-only connection per thread, and stitched together in rowid order.
+ * Each range is sized up front from its first kSampleRows rows (row density
+ * and text per row), so in the common case its catalog never reallocates
+ * while rows stream in; an exact pre-count would cost a second full scan.
+ *
+ * Link with -lsqlite3 -pthread.
+ */
+
+#pragma once
+
+#include "catalog.h"
+
+#include <sqlite3.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Tables smaller than this load on one thread; splitting them costs more than it saves
+constexpr int64_t kParallelLoadMinRows = 50000;
+
+/* Default loader thread count: one per core, at most 8. */
+inline unsigned default_load_threads() {
+    unsigned n = std::thread::hardware_concurrency();
+    return std::clamp(n, 1u, 8u);
+}
+
+namespace catalog_db {
+
+/* Read-only connection; false (with the reason in `err`) if it cannot be opened. */
+inline bool open_readonly(const std::string& filename, sqlite3*& db, std::string& err) {
+    db = nullptr;
+    if (sqlite3_open_v2(filename.c_str(), &db, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+        err = std::string("Can't open database: ") + sqlite3_errmsg(db);
+        sqlite3_close(db);
+        db = nullptr;
+        return false;
+    }
+    return true;
+}
+
+/* Prepare `sql`, bind [lo, hi] to its two parameters (if it has them). */
+inline sqlite3_stmt* prepare_range(sqlite3* db, const char* sql, int64_t lo, int64_t hi, std::string& err) {
+    sqlite3_stmt* st = nullptr;
+    if (sqlite3_prepare_v2(db, sql, -1, &st, nullptr) != SQLITE_OK) {
+        err = std::string("SQL error: ") + sqlite3_errmsg(db);
+        return nullptr;
+    }
+    if (sqlite3_bind_parameter_count(st) == 2) {
+        sqlite3_bind_int64(st, 1, lo);
+        sqlite3_bind_int64(st, 2, hi);
+    }
+    return st;
+}
+
+/* Text of column `col` as a view into SQLite's buffer (valid until the next step). */
+inline std::string_view column_view(sqlite3_stmt* st, int col) {
+    const unsigned char* p = sqlite3_column_text(st, col);
+    if (!p) return {};
+    return std::string_view(reinterpret_cast<const char*>(p), static_cast<size_t>(sqlite3_column_bytes(st, col)));
+}
+
+/* Estimated row count and text volume of a rowid range. */
+struct RangeSize {
+    int64_t rows        = 0;
+    int64_t setup_bytes = 0;
+    int64_t punch_bytes = 0;
+};
+
+constexpr int kSampleRows = 1024;
+
+/*
+ * Estimate the rows with rowid in [lo, hi] from the first kSampleRows of
+ * them, scaled by the rowid span they cover. Exact when the range is smaller
+ * than the sample; close for the usual dense or evenly spread ids.
+ */
+inline bool estimate_range(sqlite3* db, int64_t lo, int64_t hi, RangeSize& out, std::string& err) {
+    sqlite3_stmt* st = prepare_range(db,
+        "SELECT count(*), min(r), max(r), total(length(CAST(s AS BLOB))), total(length(CAST(p AS BLOB)))"
+        " FROM (SELECT rowid AS r, setup AS s, punchline AS p FROM jokes"
+        "       WHERE rowid BETWEEN ?1 AND ?2 ORDER BY rowid LIMIT 1024);",  // kSampleRows
+        lo, hi, err);
+    if (!st) return false;
+    bool ok = sqlite3_step(st) == SQLITE_ROW;
+    if (!ok) {
+        err = std::string("SQL error: ") + sqlite3_errmsg(db);
+    } else if (int64_t n = sqlite3_column_int64(st, 0)) {
+        double scale = 1.0;
+        if (n == kSampleRows) {
+            double covered = static_cast<double>(sqlite3_column_int64(st, 2) - sqlite3_column_int64(st, 1)) + 1;
+            scale = (static_cast<double>(hi - lo) + 1) / covered * (17.0 / 16.0);  // 1/16 headroom
+        }
+        out.rows        = static_cast<int64_t>(static_cast<double>(n) * scale);
+        out.setup_bytes = static_cast<int64_t>(sqlite3_column_double(st, 3) * scale);
+        out.punch_bytes = static_cast<int64_t>(sqlite3_column_double(st, 4) * scale);
+    }
+    sqlite3_finalize(st);
+    return ok;
+}
+
+/* Append the rows with rowid in [lo, hi] to `out`, in rowid order. */
+inline bool load_range(sqlite3* db, int64_t lo, int64_t hi, Catalog& out, std::string& err) {
+    sqlite3_stmt* st = prepare_range(db,
+        "SELECT rowid, setup, punchline FROM jokes WHERE rowid BETWEEN ?1 AND ?2 ORDER BY rowid;",
+        lo, hi, err);
+    if (!st) return false;
+    int rc;
+    while ((rc = sqlite3_step(st)) == SQLITE_ROW) {
+        out.add(sqlite3_column_int64(st, 0), column_view(st, 1), column_view(st, 2));
+    }
+    if (rc != SQLITE_DONE) err = std::string("SQL error: ") + sqlite3_errmsg(db);
+    sqlite3_finalize(st);
+    return rc == SQLITE_DONE;
+}
+
+/* One loader thread's work: estimate, reserve and fill the catalog for [lo, hi]. */
+inline bool load_part(const std::string& filename, int64_t lo, int64_t hi, Catalog& out, std::string& err) {
+    sqlite3* db = nullptr;
+    if (!open_readonly(filename, db, err)) return false;
+    RangeSize sz;
+    bool ok = estimate_range(db, lo, hi, sz, err);
+    if (ok) {
+        out.reserve(static_cast<size_t>(sz.rows), static_cast<size_t>(sz.setup_bytes),
+                    static_cast<size_t>(sz.punch_bytes));
+        ok = load_range(db, lo, hi, out, err);
+    }
+    sqlite3_close(db);
+    return ok;
+}
+
+}  // namespace catalog_db
+
+/*
+ * Load jokes from `filename` into `out`. Rows come ordered by rowid, the
+ * stable id sessions use to remember which jokes they have heard.
+ * Up to `threads` connections read disjoint rowid ranges concurrently.
+ * Table schema: CREATE TABLE jokes (id INTEGER PRIMARY KEY, setup TEXT, punchline TEXT);
+ */
+inline bool load_jokes_from_db(const std::string& filename, Catalog& out,
+                               unsigned threads = default_load_threads()) {
+    std::string err;
+    sqlite3* db = nullptr;
+    if (!catalog_db::open_readonly(filename, db, err)) {
+        std::cerr << err << "\n";
+        return false;
+    }
+
+    // Whole-table extent (two index lookups) and size estimate: decides how many ranges are worth it
+    int64_t lo = 0, hi = -1;
+    catalog_db::RangeSize total;
+    sqlite3_stmt* st = catalog_db::prepare_range(db,
+        "SELECT (SELECT min(rowid) FROM jokes), (SELECT max(rowid) FROM jokes);", 0, 0, err);
+    if (st && sqlite3_step(st) == SQLITE_ROW) {
+        lo = sqlite3_column_int64(st, 0);
+        hi = sqlite3_column_int64(st, 1);
+    } else if (st) {
+        err = std::string("SQL error: ") + sqlite3_errmsg(db);
+    }
+    sqlite3_finalize(st);
+    if (err.empty() && hi >= lo) catalog_db::estimate_range(db, lo, hi, total, err);
+    sqlite3_close(db);
+    if (!err.empty()) {
+        std::cerr << err << "\n";
+        return false;
+    }
+    if (total.rows == 0) return true;
+
+    unsigned parts = total.rows < kParallelLoadMinRows ? 1u : std::max(threads, 1u);
+    if (parts == 1) {
+        bool ok = catalog_db::load_part(filename, lo, hi, out, err);
+        if (!ok) std::cerr << err << "\n";
+        return ok;
+    }
+
+    // Split [lo, hi] into `parts` contiguous rowid ranges, one thread each
+    std::vector<Catalog>     pieces(parts);
+    std::vector<std::string> errors(parts);
+    std::vector<char>        done(parts, 0);
+    std::vector<std::thread> workers;
+    uint64_t span = static_cast<uint64_t>(hi - lo) + 1;
+    for (unsigned p = 0; p < parts; ++p) {
+        int64_t a = lo + static_cast<int64_t>(span * p / parts);
+        int64_t b = lo + static_cast<int64_t>(span * (p + 1) / parts) - 1;
+        workers.emplace_back([&, p, a, b] { done[p] = catalog_db::load_part(filename, a, b, pieces[p], errors[p]); });
+    }
+    for (auto& t : workers) t.join();
+
+    size_t jokes = 0, heap = 0;
+    for (unsigned p = 0; p < parts; ++p) {
+        if (!done[p]) {
+            std::cerr << errors[p] << "\n";
+            return false;
+        }
+        jokes += pieces[p].size();
+        heap  += pieces[p].heap_size();
+    }
+    out.reserve_exact(jokes, heap);
+    for (auto& piece : pieces) {
+        out.append(piece);
+        piece = Catalog();  // release each piece as soon as it is copied
+    }
+    return true;
+}
@@ -17,6 +17,8 @@
  *   g++ -std=c++17 -Wall -Wextra -O2 client.cpp -o client
  */
 
+#include "line_reader.h"
+
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
@@ -32,26 +34,6 @@ namespace {
 // Default port (must match your server)
 constexpr int kDefaultPort = 8079;
 
-// Receive exactly one line (ending with '\n'); strips '\r'. Returns false on EOF/error.
-bool recv_line(int fd, std::string& line) {
-    line.clear();
-    char ch = 0;
-    while (true) {
-        ssize_t n = ::recv(fd, &ch, 1, 0);
-        if (n <= 0) {
-            // n == 0 -> orderly shutdown by peer; n < 0 -> error/timeout
-            return false;
-        }
-        if (ch == '\r') continue;   // normalize CRLF to LF
-        if (ch == '\n') break;
-        line.push_back(ch);
-        if (line.size() > 8192) {   // safety cap to avoid unbounded growth
-            break;
-        }
-    }
-    return true;
-}
-
 // Send a whole line; appends '\n' if missing. Returns false on socket error.
 bool send_line(int fd, const std::string& s) {
     std::string out = s;
@@ -123,10 +105,11 @@ int main(int argc, char** argv) {
               << ". Type your responses when prompted.\n";
 
     // ---- Conversation loop ----
+    LineReader in(sock, 8192);  // safety cap to avoid unbounded growth
     std::string line;
     while (true) {
         // Read a line from the server
-        if (!recv_line(sock, line)) {
+        if (!in.read_line(line)) {
             std::cout << "Connection closed by server.\n";
             break;
         }
@@ -0,0 +1,434 @@
+/*
+ * coro.h
+ * ------
+ * A small C++20 coroutine runtime for the server's --mode=coro driver: code
+ * that reads like the blocking thread-per-client version (`co_await
+ * conn.read_line(line)`) but runs as a suspended coroutine on an event loop.
+ *
+ *   Task<T>     lazy coroutine that a caller co_awaits (symmetric transfer,
+ *               so awaiting chains never grow the native stack);
+ *   Detached    fire-and-forget top-level coroutine, frees itself at the end;
+ *   EventLoop   one epoll instance per thread; resumes a coroutine when the
+ *               socket it waits on becomes ready, or when the deadline it
+ *               waits with passes (timer_wheel.h; no periodic wakeups);
+ *   Conn        non-blocking socket with awaitable line reads and buffered
+ *               writes (input through LineReader, output gathered in an
+ *               OutQueue and sent when the coroutine next waits for input),
+ *               with optional read, send and lifetime deadlines.
+ *
+ * Coroutine frames come from FramePool, a per-thread free list per 64-byte
+ * size class carved from 64 KiB slabs: starting or finishing a coroutine is a
+ * list push/pop, not a malloc/free. A frame must be freed on the thread that
+ * allocated it, which holds because a session never leaves its loop.
+ *
+ * Requires -std=c++20.
+ */
+
+#pragma once
+
+#include "line_reader.h"
+#include "out_queue.h"
+#include "timer_wheel.h"
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace coro {
+
+// ------------------------------ Frame pool ------------------------------
+
+class FramePool {
+public:
+    static constexpr size_t kGranule  = 64;
+    static constexpr size_t kClasses  = 128;  // pooled frames up to 8 KiB
+    static constexpr size_t kSlabSize = 64 * 1024;
+
+    static void* allocate(size_t n) {
+        size_t c = (n + kGranule - 1) / kGranule;
+        if (c == 0 || c > kClasses) return ::operator new(n);
+        State& st = state();
+        ++st.live;
+        if (Block* b = st.free[c - 1]) {
+            st.free[c - 1] = b->next;
+            return b;
+        }
+        size_t bytes = c * kGranule;
+        if (st.slab_left < bytes) {
+            st.slabs.emplace_back(new char[kSlabSize]);
+            st.slab_next = st.slabs.back().get();
+            st.slab_left = kSlabSize;
+        }
+        void* p = st.slab_next;
+        st.slab_next += bytes;
+        st.slab_left -= bytes;
+        return p;
+    }
+
+    static void release(void* p, size_t n) {
+        size_t c = (n + kGranule - 1) / kGranule;
+        if (c == 0 || c > kClasses) { ::operator delete(p); return; }
+        State& st = state();
+        --st.live;
+        auto* b = static_cast<Block*>(p);
+        b->next = st.free[c - 1];
+        st.free[c - 1] = b;
+    }
+
+    /* Pooled frames currently in use on this thread. */
+    static size_t live() { return state().live; }
+
+private:
+    struct Block { Block* next; };
+    struct State {
+        Block* free[kClasses] = {};
+        std::vector<std::unique_ptr<char[]>> slabs;
+        char*  slab_next = nullptr;
+        size_t slab_left = 0;
+        size_t live      = 0;
+    };
+    static State& state() {
+        thread_local State st;
+        return st;
+    }
+};
+
+/* Mixed into every promise type so frames come from the pool. */
+struct PooledFrame {
+    static void* operator new(size_t n) { return FramePool::allocate(n); }
+    static void  operator delete(void* p, size_t n) { FramePool::release(p, n); }
+};
+
+// --------------------------------- Task ---------------------------------
+
+template <class T>
+class Task;
+
+namespace detail {
+
+/* At the end of a Task, resume whoever awaited it (or nothing). */
+struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    template <class P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+        auto next = h.promise().continuation;
+        return next ? next : std::noop_coroutine();
+    }
+    void await_resume() noexcept {}
+};
+
+struct PromiseBase : PooledFrame {
+    std::coroutine_handle<> continuation;
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { std::terminate(); }  // the server does not throw on these paths
+};
+
+template <class T>
+struct Promise : PromiseBase {
+    T value{};
+    Task<T> get_return_object();
+    void return_value(T v) { value = std::move(v); }
+};
+
+template <>
+struct Promise<void> : PromiseBase {
+    Task<void> get_return_object();
+    void return_void() {}
+};
+
+}  // namespace detail
+
+template <class T = void>
+class [[nodiscard]] Task {
+public:
+    using promise_type = detail::Promise<T>;
+
+    explicit Task(std::coroutine_handle<promise_type> h) : h_(h) {}
+    Task(Task&& o) noexcept : h_(std::exchange(o.h_, {})) {}
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() { if (h_) h_.destroy(); }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+        h_.promise().continuation = caller;
+        return h_;  // start the child right away
+    }
+    T await_resume() {
+        if constexpr (!std::is_void_v<T>) return std::move(h_.promise().value);
+    }
+
+private:
+    std::coroutine_handle<promise_type> h_;
+};
+
+namespace detail {
+template <class T>
+Task<T> Promise<T>::get_return_object() { return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this)); }
+inline Task<void> Promise<void>::get_return_object() {
+    return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+}  // namespace detail
+
+/* Top-level coroutine: runs eagerly when called and frees its frame when done. */
+struct Detached {
+    struct promise_type : PooledFrame {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// ------------------------------ Event loop ------------------------------
+
+/* Steady-clock milliseconds: the time base of every deadline below. */
+inline int64_t clock_ms() {
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+/* What a suspended coroutine is waiting for on one fd (registered as epoll data). */
+struct Waiter {
+    std::coroutine_handle<> handle;
+    TimerWheel::Timer timer;    // the wait's deadline, if it has one
+    bool timed_out = false;
+};
+
+class EventLoop {
+public:
+    EventLoop() : epfd_(::epoll_create1(EPOLL_CLOEXEC)) {}
+    ~EventLoop() { if (epfd_ >= 0) ::close(epfd_); }
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    bool ok() const { return epfd_ >= 0; }
+
+    /* clock_ms() as of the latest wakeup. */
+    int64_t now() const { return now_; }
+
+    /*
+     * Called as a Conn starts (+1, bytes pending) and stops (-1, -bytes)
+     * waiting for its client to take output, so the owner can keep gauges.
+     */
+    using StallHook = void (*)(int64_t sessions, int64_t bytes);
+    void set_stall_hook(StallHook hook) { stall_hook_ = hook; }
+    void note_stall(int64_t sessions, int64_t bytes) { if (stall_hook_) stall_hook_(sessions, bytes); }
+
+    /* Called with the bytes each Conn receives and sends, for the owner's traffic counters. */
+    using IoHook = void (*)(int64_t received, int64_t sent);
+    void set_io_hook(IoHook hook) { io_hook_ = hook; }
+    void note_io(int64_t received, int64_t sent) { if (io_hook_) io_hook_(received, sent); }
+
+    /* Watch `fd` (edge-triggered, both directions) on behalf of `w`. */
+    bool add(int fd, Waiter* w) {
+        epoll_event ev{};
+        ev.events   = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = w;
+        return ::epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) == 0;
+    }
+
+    /* Stop watching `fd` (before its Waiter goes away while the fd stays open). */
+    void remove(int fd) { ::epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr); }
+
+    /* Wait for `w`'s fd like ReadyAwaiter, but give up at `at` (clock_ms(); 0: never). True if ready. */
+    struct DeadlineAwaiter {
+        EventLoop& loop;
+        Waiter&    w;
+        int64_t    at;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h) noexcept {
+            w.handle    = h;
+            w.timed_out = false;
+            if (at) {
+                w.timer.owner = &w;
+                loop.timers_.arm(w.timer, static_cast<uint64_t>(at));
+            }
+        }
+        bool await_resume() noexcept {
+            loop.timers_.cancel(w.timer);
+            return !w.timed_out;
+        }
+    };
+    DeadlineAwaiter wait(Waiter& w, int64_t at) { return {*this, w, at}; }
+
+    /*
+     * Resume waiting coroutines until `done()` holds. Sleeps until the next
+     * I/O event or deadline, however long that is.
+     */
+    void run(const std::function<bool()>& done) {
+        std::vector<epoll_event> events(1024);
+        while (!done()) {
+            now_ = clock_ms();
+            int n = ::epoll_wait(epfd_, events.data(), static_cast<int>(events.size()),
+                                 timers_.timeout(static_cast<uint64_t>(now_)));
+            now_ = clock_ms();
+            for (int i = 0; i < n; ++i) {
+                auto* w = static_cast<Waiter*>(events[i].data.ptr);
+                if (w->handle) std::exchange(w->handle, {}).resume();
+            }
+            timers_.advance(static_cast<uint64_t>(now_), [](TimerWheel::Timer& t) {
+                auto* w = static_cast<Waiter*>(t.owner);
+                w->timed_out = true;
+                if (w->handle) std::exchange(w->handle, {}).resume();
+            });
+        }
+    }
+
+private:
+    int        epfd_;
+    int64_t    now_ = clock_ms();
+    TimerWheel timers_{static_cast<uint64_t>(now_)};
+    StallHook  stall_hook_ = nullptr;
+    IoHook     io_hook_    = nullptr;
+};
+
+/* Suspend until the loop sees `w`'s fd become ready. */
+struct ReadyAwaiter {
+    Waiter& w;
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) noexcept { w.handle = h; }
+    void await_resume() const noexcept {}
+};
+
+// ------------------------------ Connection ------------------------------
+
+/*
+ * A connected non-blocking socket on `loop`. `in` and `out` are the session's
+ * own buffers, so the coroutine driver shares them with the other drivers'
+ * state (see ClientSession).
+ */
+class Conn {
+public:
+    static constexpr size_t kBudget = 64 * 1024;  // default output budget, see below
+
+    /* Why a wait gave up (see set_deadlines()). */
+    enum class Expired { No, Read, Send, Lifetime };
+
+    /*
+     * `budget` bounds the pending output: write() flushes once that much is
+     * queued, even if the client's next line is already buffered.
+     */
+    Conn(EventLoop& loop, int fd, LineReader& in, OutQueue& out, size_t budget = kBudget)
+        : loop_(loop), fd_(fd), in_(in), out_(out), budget_(budget) { ok_ = loop.add(fd, &waiter_); }
+
+    int  fd() const { return fd_; }
+    bool ok() const { return ok_; }
+
+    /*
+     * Deadlines, each 0 for none: a line must arrive within `read_ms` of
+     * read_line() being called, output the client stops taking must move
+     * again within `send_ms`, and nothing waits past `ends_at` (clock_ms()).
+     * A wait that runs out fails like a broken socket and sets expired().
+     */
+    void set_deadlines(int64_t read_ms, int64_t send_ms, int64_t ends_at) {
+        read_ms_ = read_ms;
+        send_ms_ = send_ms;
+        ends_at_ = ends_at;
+    }
+    Expired expired() const { return expired_; }
+
+    /* Output not yet taken by the client. */
+    size_t pending() const { return out_.size(); }
+
+    /*
+     * Queue a frame for the client (not copied: it must stay valid until
+     * sent, see out_queue.h). Suspends only if too much is already pending.
+     */
+    Task<bool> write(std::string_view data) {
+        out_.append(data);
+        if (out_.size() >= budget_) co_return co_await flush();
+        co_return ok_;
+    }
+
+    /* Send everything queued, waiting for the socket as needed. On failure the unsent rest stays queued. */
+    Task<bool> flush() {
+        int64_t stalled_since = 0;  // the client stopped taking output
+        int64_t stalled_bytes = 0;
+        while (ok_ && !out_.empty()) {
+            ssize_t n = out_.send_some(fd_);
+            if (n > 0) { loop_.note_io(0, n); continue; }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (!stalled_since) {
+                    stalled_since = loop_.now();
+                    stalled_bytes = static_cast<int64_t>(out_.size());
+                    loop_.note_stall(1, stalled_bytes);
+                }
+                if (!co_await loop_.wait(waiter_, deadline(send_ms_ ? stalled_since + send_ms_ : 0))) {
+                    expire(Expired::Send);
+                }
+                continue;
+            }
+            ok_ = false;
+        }
+        if (stalled_since) loop_.note_stall(-1, -stalled_bytes);
+        if (ok_) out_.clear();
+        co_return ok_;
+    }
+
+    /*
+     * Flush pending output, then wait for the next complete line. The view
+     * stays valid until the next read. False on EOF, error or deadline. If
+     * that line is already buffered (a pipelining client), the output keeps
+     * accumulating so the answers to everything it sent leave in one write
+     * (up to the budget).
+     */
+    Task<bool> read_line(std::string_view& line) {
+        if (!ok_) co_return false;
+        if (!out_.empty() && !in_.has_line() && !co_await flush()) co_return false;
+        int64_t at = 0;  // computed at the first wait: a buffered line costs no clock read
+        while (!in_.next_line(line)) {
+            ssize_t n = in_.fill();
+            if (n > 0) { loop_.note_io(n, 0); continue; }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (!at) at = deadline(read_ms_ ? loop_.now() + read_ms_ : 0);
+                if (!co_await loop_.wait(waiter_, at)) { expire(Expired::Read); co_return false; }
+                continue;
+            }
+            ok_ = false;
+            co_return false;
+        }
+        co_return true;
+    }
+
+private:
+    /* `at` capped by the lifetime limit; 0: no deadline at all. */
+    int64_t deadline(int64_t at) const {
+        if (ends_at_ && (at == 0 || ends_at_ < at)) return ends_at_;
+        return at;
+    }
+
+    void expire(Expired why) {
+        expired_ = ends_at_ && loop_.now() >= ends_at_ ? Expired::Lifetime : why;
+        ok_      = false;
+    }
+
+    EventLoop&   loop_;
+    int          fd_;
+    LineReader&  in_;
+    OutQueue&    out_;
+    size_t       budget_;
+    Waiter       waiter_;
+    bool         ok_ = true;
+    int64_t      read_ms_ = 0, send_ms_ = 0, ends_at_ = 0;
+    Expired      expired_ = Expired::No;
+};
+
+}  // namespace coro
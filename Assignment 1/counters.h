@@ -0,0 +1,126 @@
+/*
+ * counters.h
+ * ----------
+ * Statistics counters that many threads update and few threads read.
+ *
+ * A plain std::atomic<int> bumped by every reactor bounces one cache line
+ * between all cores on every connect and disconnect. ShardedCounter gives
+ * each thread its own cache-line-sized slot instead: updates touch only the
+ * caller's slot (relaxed, uncontended), and readers add the slots up when
+ * they actually need the total (logging, the idle check). A sum taken while
+ * other threads are updating is a moment-in-time estimate, which is all those
+ * readers need.
+ *
+ * A thread picks its slot once with set_counter_shard(); threads that never
+ * do share slot 0, which behaves like the single atomic it replaces.
+ *
+ * ShardedLimit applies the same idea to a ceiling (the concurrent-session
+ * limit): its permits sit in a shared pool and in per-slot caches, so the
+ * common acquire() and release() touch only the caller's slot.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+constexpr size_t kCounterShards = 64;
+
+/* Slot index this thread updates (set once per long-lived thread). */
+inline size_t& counter_shard() {
+    thread_local size_t shard = 0;
+    return shard;
+}
+
+inline void set_counter_shard(size_t shard) { counter_shard() = shard % kCounterShards; }
+
+class ShardedCounter {
+public:
+    void add(int64_t delta) { slots_[counter_shard()].value.fetch_add(delta, std::memory_order_relaxed); }
+    void inc() { add(1); }
+    void dec() { add(-1); }
+
+    /* Sum over all slots. */
+    int64_t load() const {
+        int64_t total = 0;
+        for (const auto& s : slots_) total += s.value.load(std::memory_order_relaxed);
+        return total;
+    }
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<int64_t> value{0};
+    };
+    Slot slots_[kCounterShards];
+};
+
+/*
+ * At most `limit` holders at once. Each slot caches permits taken from the
+ * shared pool a batch at a time and keeps those its thread releases, up to
+ * two batches; only a slot that runs dry touches the pool, and when the pool
+ * is empty too acquire() borrows from the other slots' caches before it says
+ * no. A permit is always in exactly one place (pool, a cache, or a holder),
+ * so the limit is never exceeded; a refusal can at worst race with a release
+ * into a cache already looked at.
+ */
+class ShardedLimit {
+public:
+    static constexpr int64_t kBatch = 8;
+
+    /* Set the ceiling (0: unlimited). Call before any acquire(). */
+    void set_limit(int64_t limit) {
+        limit_ = limit;
+        pool_.store(limit > 0 ? limit : 0, std::memory_order_relaxed);
+    }
+    int64_t limit() const { return limit_; }
+
+    bool acquire() {
+        if (limit_ <= 0) return true;
+        std::atomic<int64_t>& mine = slots_[counter_shard()].value;
+        if (take(mine, 1)) return true;
+        int64_t free = pool_.load(std::memory_order_relaxed);
+        while (free > 0) {
+            int64_t n = free < kBatch ? free : kBatch;
+            if (pool_.compare_exchange_weak(free, free - n, std::memory_order_relaxed)) {
+                if (n > 1) mine.fetch_add(n - 1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        for (auto& s : slots_) {
+            if (take(s.value, 1)) return true;
+        }
+        return false;
+    }
+
+    void release() {
+        if (limit_ <= 0) return;
+        std::atomic<int64_t>& mine = slots_[counter_shard()].value;
+        if (mine.fetch_add(1, std::memory_order_relaxed) + 1 > 2 * kBatch && take(mine, kBatch)) {
+            pool_.fetch_add(kBatch, std::memory_order_relaxed);  // don't hoard what other slots may need
+        }
+    }
+
+    /* Permits not held by anyone (the pool plus every cache); a moment-in-time estimate. */
+    int64_t available() const {
+        int64_t total = pool_.load(std::memory_order_relaxed);
+        for (const auto& s : slots_) total += s.value.load(std::memory_order_relaxed);
+        return total;
+    }
+
+private:
+    static bool take(std::atomic<int64_t>& from, int64_t n) {
+        int64_t have = from.load(std::memory_order_relaxed);
+        while (have >= n) {
+            if (from.compare_exchange_weak(have, have - n, std::memory_order_relaxed)) return true;
+        }
+        return false;
+    }
+
+    struct alignas(64) Slot {
+        std::atomic<int64_t> value{0};
+    };
+    int64_t              limit_ = 0;
+    alignas(64) std::atomic<int64_t> pool_{0};
+    Slot                 slots_[kCounterShards];
+};
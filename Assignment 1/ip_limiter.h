@@ -0,0 +1,212 @@
+/*
+ * ip_limiter.h
+ * ------------
+ * Per-source-address limits, checked when a connection is accepted and
+ * before any session exists: a token bucket on the connection rate and a cap
+ * on concurrent connections.
+ *
+ * State lives in a fixed-size open-addressing table split into shards: the
+ * top bits of the address hash pick the shard, the next ones the home slot,
+ * and probing stays within a short window after it. An entry is two atomics,
+ * the IPv4 address and one 64-bit word holding both its connection count
+ * and its bucket, so admitting or releasing a known address is a lookup plus
+ * one compare-and-swap on its own entry: no locks, nothing shared between
+ * addresses. Only inserting a new address takes its shard's mutex, so two
+ * threads cannot insert the same address twice.
+ *
+ * The bucket is kept in its GCRA ("virtual scheduling") form: rather than a
+ * token count and a refill time it stores TAT, the theoretical arrival time
+ * of the next connection. A connection at `now` is allowed if TAT - now is at
+ * most (burst - 1) intervals, and moves TAT to max(TAT, now) + interval. That
+ * is exactly a bucket of `burst` tokens refilled at `rate` per second, in one
+ * number and without rounding.
+ *
+ * Expiry is lazy: nothing sweeps the table. An entry with no connections
+ * whose TAT has passed (its bucket is full again) carries no information,
+ * and an insert that finds one in its window takes the slot over. If every
+ * slot in the window is live the address goes untracked and is admitted: a
+ * full table fails open rather than locking new clients out.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+class IpLimiter {
+public:
+    enum class Verdict { Ok, TooFast, TooMany };
+
+    static constexpr size_t kShards = 16;
+    static constexpr size_t kProbe  = 16;  // slots looked at from an address's home slot
+
+    /*
+     * `rate` new connections per second with bursts of `burst` (rate 0: no
+     * rate limit), at most `max_conns` open at once (0: no cap), for about
+     * `capacity` addresses. Call before any admit().
+     */
+    void configure(double rate, unsigned burst, unsigned max_conns, size_t capacity) {
+        interval_  = rate > 0 ? static_cast<uint64_t>(1e6 / rate) : 0;
+        if (rate > 0 && interval_ == 0) interval_ = 1;
+        tolerance_ = interval_ * (burst > 1 ? burst - 1 : 0);
+        if (tolerance_ > kTatMask / 4) tolerance_ = kTatMask / 4;  // TAT stays well inside its 48 bits
+        max_conns_ = max_conns > kMaxConns ? kMaxConns : max_conns;
+        if (!enabled()) return;
+        size_t per_shard = 64;
+        while (per_shard * kShards < capacity) per_shard <<= 1;
+        for (auto& s : shards_) {
+            s.slots.reset(new Entry[per_shard]);
+            s.mask = per_shard - 1;
+        }
+    }
+
+    bool enabled() const { return interval_ != 0 || max_conns_ != 0; }
+
+    /* A connection from `ip` (host order; 0 is never tracked) at `now_us` on a steady clock. Counts it if Ok. */
+    Verdict admit(uint32_t ip, int64_t now_us) {
+        if (!enabled() || ip == 0) return Verdict::Ok;
+        uint64_t now = static_cast<uint64_t>(now_us) & kTatMask;
+        while (true) {
+            Entry* e = find(ip);
+            if (!e) {
+                bool admitted = false;
+                e = claim(ip, now, admitted);
+                if (!e || admitted) return Verdict::Ok;  // untracked (table full), or first of its address
+            }
+            uint64_t s = e->state.load(std::memory_order_acquire);
+            while (true) {
+                if (s == kLocked) { s = e->state.load(std::memory_order_acquire); continue; }  // being taken over
+                if (e->key.load(std::memory_order_acquire) != ip) break;                      // taken over: look again
+                uint64_t conns = s >> kConnShift, tat = s & kTatMask;
+                if (max_conns_ && conns >= max_conns_) return Verdict::TooMany;
+                if (interval_) {
+                    if (tat < now) tat = now;
+                    if (tat - now > tolerance_) return Verdict::TooFast;
+                    tat += interval_;
+                }
+                if (e->state.compare_exchange_weak(s, ((conns + 1) << kConnShift) | (tat & kTatMask),
+                                                   std::memory_order_acq_rel)) {
+                    return Verdict::Ok;
+                }
+            }
+        }
+    }
+
+    /* A connection admit() counted has closed. */
+    void release(uint32_t ip) {
+        if (!enabled() || ip == 0) return;
+        while (Entry* e = find(ip)) {
+            uint64_t s = e->state.load(std::memory_order_acquire);
+            while (true) {
+                if (s == kLocked) { s = e->state.load(std::memory_order_acquire); continue; }
+                if (e->key.load(std::memory_order_acquire) != ip) break;
+                if ((s >> kConnShift) == 0) return;  // admitted while untracked
+                if (e->state.compare_exchange_weak(s, s - (uint64_t{1} << kConnShift), std::memory_order_acq_rel)) return;
+            }
+        }
+    }
+
+    /* Addresses holding a slot (live or not yet taken over); for statistics. */
+    size_t tracked() const {
+        size_t n = 0;
+        for (const auto& s : shards_) n += s.used.load(std::memory_order_relaxed);
+        return n;
+    }
+
+private:
+    // state: connection count in the top 16 bits, TAT (steady microseconds, 48 bits: ~8.9 years) below
+    static constexpr unsigned kConnShift = 48;
+    static constexpr uint64_t kTatMask   = (uint64_t{1} << kConnShift) - 1;
+    static constexpr unsigned kMaxConns  = 0xfffe;
+    static constexpr uint64_t kLocked    = ~uint64_t{0};  // being handed to another address
+
+    struct alignas(16) Entry {
+        std::atomic<uint32_t> key{0};  // 0: never used
+        std::atomic<uint64_t> state{0};
+    };
+
+    struct alignas(64) Shard {
+        std::unique_ptr<Entry[]> slots;
+        size_t                   mask = 0;
+        std::mutex               m;        // inserts only
+        std::atomic<size_t>      used{0};  // slots ever claimed
+    };
+
+    /* A well-mixed 64-bit hash (the murmur3 finalizer): neighbouring addresses land far apart. */
+    static uint64_t hash(uint32_t ip) {
+        uint64_t h = ip;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    Shard& shard_of(uint64_t h) { return shards_[h >> 60]; }  // top bits; the low ones pick the slot
+
+    /* The entry holding `ip`, or null. Never writes. */
+    Entry* find(uint32_t ip) {
+        uint64_t h = hash(ip);
+        Shard&   s = shard_of(h);
+        for (size_t i = 0; i < kProbe; ++i) {
+            Entry&   e = s.slots[(h + i) & s.mask];
+            uint32_t k = e.key.load(std::memory_order_acquire);
+            if (k == ip) return &e;
+            if (k == 0) return nullptr;  // slots are filled in probe order and never emptied
+        }
+        return nullptr;
+    }
+
+    /*
+     * Under the shard lock: the entry for `ip`, inserting it (with this first
+     * connection counted, `admitted`) into the first empty or expired slot of
+     * its window. Null if the window is full of live addresses.
+     */
+    Entry* claim(uint32_t ip, uint64_t now, bool& admitted) {
+        uint64_t h = hash(ip);
+        Shard&   s = shard_of(h);
+        uint64_t first = (uint64_t{1} << kConnShift) | ((now + interval_) & kTatMask);
+        std::lock_guard<std::mutex> lk(s.m);
+        while (true) {
+            Entry*   spare = nullptr;
+            uint64_t seen  = 0;
+            for (size_t i = 0; i < kProbe; ++i) {
+                Entry&   e = s.slots[(h + i) & s.mask];
+                uint32_t k = e.key.load(std::memory_order_acquire);
+                if (k == ip) return &e;  // inserted meanwhile
+                if (k == 0) {
+                    if (!spare) spare = &e;
+                    break;
+                }
+                uint64_t st = e.state.load(std::memory_order_acquire);
+                if (!spare && st != kLocked && (st >> kConnShift) == 0 && (st & kTatMask) <= now) {
+                    spare = &e;
+                    seen  = st;
+                }
+            }
+            if (!spare) return nullptr;
+            if (spare->key.load(std::memory_order_relaxed) == 0) {
+                // Never used: readers only look at the state once they see the key
+                spare->state.store(first, std::memory_order_relaxed);
+                spare->key.store(ip, std::memory_order_release);
+                s.used.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                // Expired: lock it against a late update from its old address, then hand it over
+                if (!spare->state.compare_exchange_strong(seen, kLocked, std::memory_order_acq_rel)) continue;
+                spare->key.store(ip, std::memory_order_release);
+                spare->state.store(first, std::memory_order_release);
+            }
+            admitted = true;
+            return spare;
+        }
+    }
+
+    uint64_t interval_  = 0;  // microseconds between connections at the sustained rate (0: no rate limit)
+    uint64_t tolerance_ = 0;  // (burst - 1) intervals
+    unsigned max_conns_ = 0;
+    Shard    shards_[kShards];
+};
@@ -0,0 +1,167 @@
+/*
+ * latency.h
+ * ---------
+ * Latency histograms cheap enough to leave on in production.
+ *
+ * Timestamps are raw CPU ticks: rdtsc on x86-64 (a few nanoseconds, no system
+ * call, no vDSO), the steady clock in nanoseconds elsewhere. Ticks become
+ * nanoseconds only when a report is made, at the tick rate measured over the
+ * process's lifetime so far. This relies on an invariant TSC, which every
+ * x86-64 CPU of the last decade has ("constant_tsc" in /proc/cpuinfo).
+ *
+ * Histogram is HDR-style and log-linear. A value's highest set bit picks a
+ * row, and the kSubBits bits below it pick one of 32 equal buckets in that
+ * row. So a bucket is never wider than 1/32 of the values it holds (about 3%,
+ * or 1.6% reporting its midpoint), from single ticks up to 2^44 ticks (an hour
+ * or more). Longer values land in the last bucket. Recording is a clz, a shift
+ * and an increment.
+ *
+ * Like ShardedCounter, a histogram has one copy per counter slot
+ * (counters.h). A thread records into its own slot's copy, and summary()
+ * merges the copies when someone asks. The buckets are zero-initialised
+ * statics, so only the pages a thread has recorded into take memory.
+ */
+
+#pragma once
+
+#include "counters.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+namespace latency {
+
+/* Now, in ticks. */
+inline uint64_t now() {
+#if defined(__x86_64__)
+    return __rdtsc();
+#else
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                     std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+/* Ticks from `from` to `to`; 0 if `to` is earlier (a thread that moved to a core whose clock is behind). */
+inline uint64_t elapsed(uint64_t from, uint64_t to) { return to > from ? to - from : 0; }
+
+/*
+ * A timestamp in 32 bits, for state kept per connection: the tick count in
+ * units of 2^kStampShift ticks (about 0.3 us at 3 GHz), wrapping. The
+ * difference of two stamps is exact modulo 2^32 units, so intervals up to
+ * 2^42 ticks (about 20 minutes at 3 GHz, an hour and more on the steady
+ * clock) come out right; a longer one wraps to a shorter value.
+ */
+using Stamp = uint32_t;
+constexpr unsigned kStampShift = 10;
+
+inline Stamp stamp(uint64_t ticks) { return static_cast<Stamp>(ticks >> kStampShift); }
+
+/* Ticks from stamp `from` to `to` (ticks), rounded down to a whole unit. */
+inline uint64_t since(Stamp from, uint64_t to) {
+    return uint64_t{static_cast<Stamp>(stamp(to) - from)} << kStampShift;
+}
+
+#if defined(__x86_64__)
+// Where the tick rate is measured from: program start
+inline const uint64_t                              start_ticks = now();
+inline const std::chrono::steady_clock::time_point start_time  = std::chrono::steady_clock::now();
+#endif
+
+/* Nanoseconds per tick, measured from program start to now (at least 10 ms apart). */
+inline double ns_per_tick() {
+#if defined(__x86_64__)
+    using clock = std::chrono::steady_clock;
+    if (clock::now() - start_time < std::chrono::milliseconds(10)) {
+        std::this_thread::sleep_until(start_time + std::chrono::milliseconds(10));
+    }
+    uint64_t ticks = now();
+    double   ns    = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start_time).count());
+    return ticks > start_ticks ? ns / static_cast<double>(ticks - start_ticks) : 1.0;
+#else
+    return 1.0;
+#endif
+}
+
+/* Percentiles of a histogram, in nanoseconds (bucket midpoints). */
+struct Summary {
+    uint64_t count = 0;
+    double   p50 = 0, p90 = 0, p99 = 0, p999 = 0, max = 0;
+};
+
+class Histogram {
+public:
+    static constexpr unsigned kSubBits  = 5;
+    static constexpr unsigned kSub      = 1u << kSubBits;
+    static constexpr unsigned kMaxBits  = 44;  // values from 2^kMaxBits ticks up share the last bucket
+    static constexpr unsigned kBuckets  = (kMaxBits - kSubBits + 1) * kSub;
+
+    /*
+     * Count one value, in ticks. A plain load and store, not a locked add: the
+     * slot is normally this thread's alone. Threads that share a slot can at
+     * worst lose a count to a race, never corrupt one.
+     */
+    void record(uint64_t ticks) {
+        std::atomic<uint64_t>& n = slots_[counter_shard()].buckets[bucket(ticks)];
+        n.store(n.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    /* Bucket of a value: exact below kSub, then kSub buckets per power of two. */
+    static unsigned bucket(uint64_t v) {
+        if (v < kSub) return static_cast<unsigned>(v);
+        if (v >> kMaxBits) return kBuckets - 1;
+        unsigned top = 63 - static_cast<unsigned>(__builtin_clzll(v));  // >= kSubBits
+        unsigned sub = static_cast<unsigned>(v >> (top - kSubBits)) & (kSub - 1);
+        return (top - kSubBits + 1) * kSub + sub;
+    }
+
+    /* Smallest value in bucket `b`, and how many values it holds. */
+    static uint64_t bucket_start(unsigned b) {
+        unsigned row = b / kSub, sub = b % kSub;
+        return row == 0 ? sub : uint64_t{kSub + sub} << (row - 1);
+    }
+    static uint64_t bucket_width(unsigned b) { return b < kSub ? 1 : uint64_t{1} << (b / kSub - 1); }
+
+    /* Add up every slot and read off the percentiles, `tick_ns` nanoseconds per tick. */
+    Summary summary(double tick_ns) const {
+        uint64_t merged[kBuckets];
+        Summary  s;
+        unsigned last = 0;
+        for (unsigned b = 0; b < kBuckets; ++b) {
+            uint64_t n = 0;
+            for (const Slot& slot : slots_) n += slot.buckets[b].load(std::memory_order_relaxed);
+            merged[b] = n;
+            s.count += n;
+            if (n) last = b;
+        }
+        if (s.count == 0) return s;
+        auto value = [&](unsigned b) {
+            return (static_cast<double>(bucket_start(b)) + static_cast<double>(bucket_width(b) - 1) / 2) * tick_ns;
+        };
+        // Walk the merged buckets once, filling each percentile as its rank is reached
+        const double q[]    = {0.5, 0.9, 0.99, 0.999};
+        double*      out[]  = {&s.p50, &s.p90, &s.p99, &s.p999};
+        size_t       next   = 0;
+        uint64_t     seen   = 0;
+        for (unsigned b = 0; b <= last && next < 4; ++b) {
+            seen += merged[b];
+            while (next < 4 && static_cast<double>(seen) >= q[next] * static_cast<double>(s.count)) *out[next++] = value(b);
+        }
+        s.max = value(last);
+        return s;
+    }
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> buckets[kBuckets];
+    };
+    Slot slots_[kCounterShards];
+};
+
+}  // namespace latency
@@ -0,0 +1,207 @@
+/*
+ * line_reader.h
+ * -------------
+ * Buffered line reader shared by server, client and tester.
+ *
+ * The protocol is line based, and the old recv_line() helpers asked the kernel
+ * for one byte at a time, so a "Who's there?" reply cost 13 recv() calls.
+ * LineReader keeps a per-connection input buffer instead: it reads whatever
+ * the socket has in one call and hands out complete lines from the buffer.
+ * Bytes after the first '\n' (pipelined lines) stay buffered for the next call.
+ *
+ * Line rules are the same as before:
+ *  - '\r' is dropped anywhere in the line (CRLF -> LF normalization);
+ *  - a line longer than `max_line` bytes is cut after max_line + 1 bytes and
+ *    the remainder is returned as the next line.
+ *
+ * Usage (blocking socket):
+ *   LineReader in(fd, 4096);
+ *   std::string line;
+ *   while (in.read_line(line)) { ... }
+ *
+ * Usage (non-blocking socket, event loop):
+ *   while (in.fill() > 0) while (in.next_line(line)) { ... }
+ *
+ * Usage (completion-based I/O that delivers bytes itself):
+ *   in.feed(data, n); while (in.next_line(line)) { ... }
+ *
+ * The buffer is only held while it has something in it. A kChunk buffer is
+ * borrowed from a slab (slab.h) when bytes arrive and handed back once every
+ * line has been taken, or when a fill() finds nothing to read. An idle
+ * connection between lines therefore costs the reader's 32 bytes and no
+ * buffer. With a per-thread cache in the slab, borrowing the same chunk back
+ * on the next line costs about as much as keeping it.
+ */
+
+#pragma once
+
+#include "slab.h"
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+class LineReader {
+public:
+    static constexpr size_t kChunk = 4096;  // bytes asked from the kernel per recv()
+
+    LineReader(int fd, size_t max_line) : fd_(fd), max_line_(static_cast<uint32_t>(max_line)) {}
+    ~LineReader() { release(); }
+    LineReader(const LineReader&)            = delete;
+    LineReader& operator=(const LineReader&) = delete;
+
+    int  fd() const { return fd_; }
+    void reset(int fd) { fd_ = fd; begin_ = end_ = 0; release(); }
+
+    /* Bytes of buffer currently held: 0 between lines. */
+    size_t capacity() const { return cap_; }
+
+    /* Bytes received but not yet returned as a line. */
+    size_t buffered() const { return end_ - begin_; }
+
+    /* Would next_line() return a line without another fill()? (The client sent ahead.) */
+    bool has_line() const {
+        if (begin_ == end_) return false;
+        const char* p   = buf_ + begin_;
+        size_t      len = end_ - begin_;
+        if (std::memchr(p, '\n', len)) return true;
+        if (len <= max_line_) return false;
+        return len - static_cast<size_t>(std::count(p, p + len, '\r')) > max_line_;  // the length guard cuts one
+    }
+
+    /*
+     * Blocking read of exactly one line (without the '\n').
+     * Returns false on EOF/timeout/error, like the old recv_line().
+     */
+    bool read_line(std::string& line) {
+        std::string_view v;
+        if (!read_line(v)) return false;
+        line.assign(v.data(), v.size());
+        return true;
+    }
+
+    /* Same, but returns a view into the buffer, valid until the next read/fill. */
+    bool read_line(std::string_view& line) {
+        while (!next_line(line)) {
+            if (fill() <= 0) return false;
+        }
+        return true;
+    }
+
+    /*
+     * Pop one complete line from the buffer without touching the socket.
+     * Returns false if no full line (or over-long fragment) is buffered yet.
+     */
+    bool next_line(std::string& line) {
+        std::string_view v;
+        if (!next_line(v)) return false;
+        line.assign(v.data(), v.size());
+        return true;
+    }
+
+    /*
+     * Zero-copy variant: the view points into the buffer and stays valid until
+     * the next call or fill(). '\r' bytes are squeezed out in place.
+     */
+    bool next_line(std::string_view& line) {
+        if (begin_ == end_) { release(); return false; }  // every line taken: hand the buffer back
+        char*  p   = buf_ + begin_;
+        size_t len = end_ - begin_;
+
+        const void* nl  = std::memchr(p, '\n', len);
+        size_t      seg = nl ? static_cast<size_t>(static_cast<const char*>(nl) - p) : len;
+
+        // Fast path: whole line present, short enough, no '\r' inside
+        if (nl && seg <= max_line_ && !std::memchr(p, '\r', seg)) {
+            line    = std::string_view(p, seg);
+            begin_ += seg + 1;
+            return true;
+        }
+
+        // Slow path: drop '\r' and apply the length guard byte by byte
+        size_t w = 0;  // compacted length of the line so far
+        for (size_t i = 0; i < len; ++i) {
+            char ch = p[i];
+            if (ch == '\r') continue;
+            if (ch == '\n') { line = std::string_view(p, w); begin_ += i + 1; return true; }
+            p[w++] = ch;
+            if (w > max_line_) { line = std::string_view(p, w); begin_ += i + 1; return true; }  // safety guard
+        }
+        end_ = begin_ + w;  // incomplete; keep the (already '\r'-free) bytes for the next fill()
+        return false;
+    }
+
+    /*
+     * One recv() into whatever room the buffer has left. Returns the byte count,
+     * 0 on orderly shutdown, or -1 with errno set (EAGAIN on an empty
+     * non-blocking socket).
+     */
+    ssize_t fill() {
+        make_room(1);
+        ssize_t n;
+        do {
+            n = ::recv(fd_, buf_ + end_, cap_ - end_, 0);
+        } while (n < 0 && errno == EINTR);
+        if (n > 0) end_ += static_cast<uint32_t>(n);
+        else if (begin_ == end_) release();  // nothing came: don't sit on an empty buffer
+        return n;
+    }
+
+    /* Append bytes that were received some other way (io_uring provided buffers). */
+    void feed(const char* data, size_t n) {
+        make_room(n);
+        std::memcpy(buf_ + end_, data, n);
+        end_ += static_cast<uint32_t>(n);
+    }
+
+private:
+    struct alignas(16) Chunk {
+        char bytes[kChunk];
+    };
+
+    /*
+     * Ensure at least `want` free bytes after end_, sliding unread bytes to the
+     * front first. Only a line that fills the whole buffer grows it.
+     */
+    void make_room(size_t want) {
+        if (begin_ == end_) begin_ = end_ = 0;
+        if (cap_ - end_ >= want) return;
+        if (begin_ > 0) {
+            std::memmove(buf_, buf_ + begin_, end_ - begin_);
+            end_  -= begin_;
+            begin_ = 0;
+        }
+        if (cap_ - end_ >= want) return;
+        // A slab chunk when one is enough; a longer line (or a bigger feed) gets a heap buffer
+        size_t size = end_ + std::max(want, kChunk);
+        char*  grown = size == kChunk ? static_cast<char*>(Slab<Chunk>::get()) : new char[size];
+        if (end_) std::memcpy(grown, buf_, end_);
+        uint32_t kept = end_;
+        release();
+        buf_ = grown;
+        cap_ = static_cast<uint32_t>(size);
+        end_ = kept;
+    }
+
+    /* Give the buffer back (its bytes are gone or already copied). */
+    void release() {
+        if (!buf_) return;
+        if (cap_ == kChunk) Slab<Chunk>::put(buf_);
+        else delete[] buf_;
+        buf_ = nullptr;
+        cap_ = begin_ = end_ = 0;
+    }
+
+    int      fd_;
+    uint32_t max_line_;
+    char*    buf_   = nullptr;  // unread bytes live in [begin_, end_); null while empty
+    uint32_t cap_   = 0;
+    uint32_t begin_ = 0;
+    uint32_t end_   = 0;
+};
@@ -0,0 +1,158 @@
+/*
+ * out_queue.h
+ * -----------
+ * A session's pending output: the frames queued during one turn, gathered
+ * into a single sendmsg() when the server next waits for the client.
+ *
+ * Frames are not copied. Every frame the server sends is either a
+ * compile-time constant (session.h) or a pre-rendered line in a catalog
+ * snapshot (catalog.h), so the queue only records an iovec per frame, and
+ * frames that happen to be adjacent in memory (a joke's prompt and
+ * punchline, say) collapse into one. A turn such as punchline + "Would you
+ * like to listen to another?" becomes one system call and, with
+ * TCP_NODELAY on the socket, one segment, with nothing held back by Nagle.
+ *
+ * Lifetime rule: a queued frame must stay valid until it is sent. Catalog
+ * frames are covered by keep_alive(): adopt_catalog() hands it the snapshot
+ * it replaces while output from that snapshot is still pending.
+ *
+ * The iovecs live in blocks of kMaxIov, borrowed from a slab (slab.h) while
+ * output is pending and handed back as they drain. A session waiting for its
+ * client holds none, only the queue's 32 bytes. A turn needing more than one
+ * block (a long BATCH) chains several and goes out in several sendmsg() calls.
+ * All but the last carry MSG_MORE so the kernel still fills whole segments.
+ */
+
+#pragma once
+
+#include "slab.h"
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class OutQueue {
+public:
+    static constexpr size_t kMaxIov = 64;  // iovecs per sendmsg(), and per block
+
+    OutQueue() = default;
+    ~OutQueue() { clear(); }
+    OutQueue(const OutQueue&)            = delete;
+    OutQueue& operator=(const OutQueue&) = delete;
+
+    /* Queue `frame`; the bytes must outlive the send (see above). */
+    void append(std::string_view frame) {
+        if (frame.empty()) return;
+        bytes_ += frame.size();
+        if (last_ && last_->count > last_->head) {
+            iovec& prev = last_->iov[last_->count - 1];
+            if (static_cast<const char*>(prev.iov_base) + prev.iov_len == frame.data()) {
+                prev.iov_len += frame.size();  // contiguous with the previous frame
+                return;
+            }
+        }
+        if (!last_ || last_->count == kMaxIov) {
+            Block* b = new (Slab<Block>::get()) Block;
+            if (last_) last_->next = b;
+            else first_ = b;
+            last_ = b;
+        }
+        last_->iov[last_->count++] = {const_cast<char*>(frame.data()), frame.size()};
+    }
+
+    bool   empty() const { return bytes_ == 0; }
+    size_t size()  const { return bytes_; }  // bytes still to send
+
+    /* Drop everything queued (and whatever it kept alive), handing the blocks back. */
+    void clear() {
+        while (first_) pop_block();
+        last_  = nullptr;
+        bytes_ = 0;
+        pins_.reset();
+    }
+
+    /* Keep `owner` (the storage behind queued frames) alive until the queue drains. */
+    void keep_alive(std::shared_ptr<const void> owner) {
+        if (!pins_) pins_.reset(new std::vector<std::shared_ptr<const void>>);
+        pins_->push_back(std::move(owner));
+    }
+
+    /*
+     * The pending bytes of the first block as a message for sendmsg() or
+     * IORING_OP_SENDMSG (at most kMaxIov iovecs). It lives in that block, so
+     * it stays put while a send is in flight; valid until the next append(),
+     * consume() or clear(). Call only while something is pending.
+     */
+    const msghdr* message() {
+        Block& b         = *first_;
+        b.msg            = msghdr{};
+        b.msg.msg_iov    = b.iov + b.head;
+        b.msg.msg_iovlen = b.count - b.head;
+        return &b.msg;
+    }
+
+    /* Whether message() leaves iovecs for a later call (send it with MSG_MORE). */
+    bool more_than_one_message() const { return first_ != last_; }
+
+    /* Forget the first `n` pending bytes (they were sent). */
+    void consume(size_t n) {
+        bytes_ -= n;
+        if (bytes_ == 0) { clear(); return; }
+        while (n > 0) {
+            iovec& v = first_->iov[first_->head];
+            if (n < v.iov_len) {
+                v.iov_base = static_cast<char*>(v.iov_base) + n;
+                v.iov_len -= n;
+                return;
+            }
+            n -= v.iov_len;
+            if (++first_->head == first_->count) pop_block();  // not the last: bytes remain
+        }
+    }
+
+    /* One sendmsg() of what is pending. Returns bytes sent (and consumed) or -1 with errno. */
+    ssize_t send_some(int fd) {
+        int flags = MSG_NOSIGNAL | (more_than_one_message() ? MSG_MORE : 0);
+        ssize_t n = ::sendmsg(fd, message(), flags);
+        if (n > 0) consume(static_cast<size_t>(n));
+        return n;
+    }
+
+    /* Pending bytes as one string (tests and diagnostics). */
+    std::string str() const {
+        std::string out;
+        out.reserve(bytes_);
+        for (const Block* b = first_; b; b = b->next) {
+            for (uint32_t i = b->head; i < b->count; ++i) out.append(static_cast<const char*>(b->iov[i].iov_base), b->iov[i].iov_len);
+        }
+        return out;
+    }
+
+private:
+    struct Block {
+        msghdr   msg{};           // what message() last handed out
+        Block*   next  = nullptr;
+        uint32_t head  = 0;       // first iovec not fully sent
+        uint32_t count = 0;       // iovecs filled
+        iovec    iov[kMaxIov];
+    };
+
+    void pop_block() {
+        Block* b = first_;
+        first_   = b->next;
+        if (!first_) last_ = nullptr;
+        b->~Block();
+        Slab<Block>::put(b);
+    }
+
+    Block* first_ = nullptr;  // null while nothing is pending
+    Block* last_  = nullptr;
+    size_t bytes_ = 0;
+    std::unique_ptr<std::vector<std::shared_ptr<const void>>> pins_;  // snapshots replaced while their frames were queued
+};
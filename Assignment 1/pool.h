@@ -0,0 +1,150 @@
+/*
+ * pool.h
+ * ------
+ * Fixed-size worker pool with per-worker deques and work stealing, for the
+ * server's --mode=pool driver.
+ *
+ * A job is a plain function pointer plus argument (no allocation per job).
+ * Each worker owns a deque: jobs submitted from a worker go to the back of
+ * its own deque and it pops from the back (newest first, still warm in
+ * cache); jobs submitted from any other thread are dealt round-robin. A
+ * worker whose deque is empty steals the oldest job from the front of
+ * another's before it goes to sleep, so a burst that lands on one worker
+ * spreads over every idle one.
+ *
+ * The deques are short mutex-protected std::deques: the owner and a thief
+ * only meet when a steal actually happens. Sleeping workers are woken only
+ * when there are sleepers, so a busy pool submits without a syscall.
+ */
+
+#pragma once
+
+#include "counters.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class WorkerPool {
+public:
+    using Fn = void (*)(void*);
+
+    /* Start `workers` threads (at least one). */
+    explicit WorkerPool(unsigned workers) {
+        if (workers == 0) workers = 1;
+        for (unsigned i = 0; i < workers; ++i) queues_.emplace_back(new Queue);
+        for (unsigned i = 0; i < workers; ++i) threads_.emplace_back([this, i] { worker_main(i); });
+    }
+    ~WorkerPool() { stop(); }
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    /* Run fn(arg) on some worker. Callable from any thread, including a job. */
+    void submit(Fn fn, void* arg) {
+        int self = current_worker();
+        size_t q = self >= 0 && owner_ == this ? static_cast<size_t>(self)
+                                               : next_.fetch_add(1, std::memory_order_relaxed) % queues_.size();
+        {
+            std::lock_guard<std::mutex> lk(queues_[q]->m);
+            queues_[q]->jobs.push_back({fn, arg});
+        }
+        pending_.fetch_add(1);
+        if (sleepers_.load() > 0) {
+            std::lock_guard<std::mutex> lk(sleep_m_);
+            wake_.notify_one();
+        }
+    }
+
+    /* Run every job already submitted (and any they submit), then join the workers. */
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lk(sleep_m_);
+            if (stopping_ && threads_.empty()) return;
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        for (auto& t : threads_) t.join();
+        threads_.clear();
+    }
+
+    size_t   size()   const { return queues_.size(); }
+    uint64_t steals() const { return steals_.load(std::memory_order_relaxed); }
+
+    /* Index of the calling worker thread, or -1 outside any pool. */
+    static int current_worker() { return worker_index(); }
+
+private:
+    struct Job {
+        Fn    fn;
+        void* arg;
+    };
+    struct alignas(64) Queue {
+        std::mutex      m;
+        std::deque<Job> jobs;
+    };
+
+    static int& worker_index() {
+        thread_local int index = -1;
+        return index;
+    }
+
+    bool pop_local(size_t self, Job& out) {
+        Queue& q = *queues_[self];
+        std::lock_guard<std::mutex> lk(q.m);
+        if (q.jobs.empty()) return false;
+        out = q.jobs.back();
+        q.jobs.pop_back();
+        return true;
+    }
+
+    /* Take the oldest job of the first non-empty deque after ours. */
+    bool steal(size_t self, Job& out) {
+        for (size_t k = 1; k < queues_.size(); ++k) {
+            Queue& q = *queues_[(self + k) % queues_.size()];
+            std::lock_guard<std::mutex> lk(q.m);
+            if (q.jobs.empty()) continue;
+            out = q.jobs.front();
+            q.jobs.pop_front();
+            steals_.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+
+    void worker_main(size_t self) {
+        worker_index() = static_cast<int>(self);
+        owner_ = this;
+        set_counter_shard(self + 1);  // slot 0 stays with the thread that submits
+        while (true) {
+            Job job;
+            if (pop_local(self, job) || steal(self, job)) {
+                pending_.fetch_sub(1);
+                job.fn(job.arg);
+                continue;
+            }
+            std::unique_lock<std::mutex> lk(sleep_m_);
+            sleepers_.fetch_add(1);
+            wake_.wait(lk, [this] { return stopping_ || pending_.load() > 0; });
+            sleepers_.fetch_sub(1);
+            if (stopping_ && pending_.load() == 0) return;
+        }
+    }
+
+    static inline thread_local WorkerPool* owner_ = nullptr;  // pool the calling worker belongs to
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread>            threads_;
+    std::atomic<size_t>   next_{0};      // round-robin target for outside submissions
+    std::atomic<size_t>   pending_{0};   // submitted, not yet taken
+    std::atomic<unsigned> sleepers_{0};
+    std::atomic<uint64_t> steals_{0};
+    std::mutex              sleep_m_;
+    std::condition_variable wake_;
+    bool stopping_ = false;              // guarded by sleep_m_
+};
@@ -0,0 +1,132 @@
+/*
+ * reply_match.h
+ * -------------
+ * Comparing a client reply with the answer the server expects.
+ *
+ * The original iequals(a, b) was lower(trim(a)) == lower(trim(b)): up to four
+ * temporary strings for every reply, wrong answers included. Here the
+ * expected side is trimmed and lower-cased once, when the catalog is built,
+ * and the reply is compared in place:
+ *
+ *   - trim by narrowing a string_view (no copy);
+ *   - different lengths -> no match, before looking at a single letter;
+ *   - fold and compare 32 (AVX2) or 16 (SSE2) bytes per step, 8 bytes per
+ *     step with portable SWAR arithmetic elsewhere, and a byte loop for the
+ *     last few. A tail shorter than a full step reuses an overlapping block
+ *     instead of reading past the reply.
+ *
+ * Only ASCII 'A'..'Z' fold, exactly like tolower() in the "C" locale the
+ * server runs in. The vector width follows the compiler flags: SSE2 is part
+ * of every x86-64 build; AVX2 needs -mavx2 (or -march=native).
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/* Fold ASCII letters to lower case (the server runs in the "C" locale). */
+inline char ascii_lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+/* Strip the whitespace that replies are compared without. */
+inline std::string_view trim_view(std::string_view s) {
+    size_t i = s.find_first_not_of(" \t\r\n");
+    if (i == std::string_view::npos) return {};
+    size_t j = s.find_last_not_of(" \t\r\n");
+    return s.substr(i, j - i + 1);
+}
+
+namespace reply_match {
+
+/* Does lower(a[0..8)) equal b[0..8)? Branch-free folding of eight bytes at once. */
+inline bool equal8(const char* a, const char* b) {
+    uint64_t x, y;
+    std::memcpy(&x, a, 8);
+    std::memcpy(&y, b, 8);
+    const uint64_t ones = 0x0101010101010101ULL;
+    uint64_t low7  = x & (0x7f * ones);                 // no carries between bytes below
+    uint64_t ge_a  = low7 + (0x80 - 'A') * ones;        // high bit set where byte >= 'A'
+    uint64_t gt_z  = low7 + (0x7f - 'Z') * ones;        // high bit set where byte >  'Z'
+    uint64_t upper = (ge_a ^ gt_z) & ~x & (0x80 * ones); // in 'A'..'Z' and not a high byte
+    return (x | (upper >> 2)) == y;                     // 0x80 >> 2 == 0x20, the case bit
+}
+
+#if defined(__SSE2__)
+inline bool equal16(const char* a, const char* b) {
+    __m128i v     = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a));
+    __m128i e     = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b));
+    __m128i shift = _mm_add_epi8(v, _mm_set1_epi8(static_cast<char>(0x80 - 'A')));  // 'A' -> -128
+    __m128i upper = _mm_cmplt_epi8(shift, _mm_set1_epi8(static_cast<char>(0x80 - 'A' + 'Z' + 1)));
+    __m128i folded = _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(folded, e)) == 0xffff;
+}
+#endif
+
+#if defined(__AVX2__)
+inline bool equal32(const char* a, const char* b) {
+    __m256i v     = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a));
+    __m256i e     = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b));
+    __m256i shift = _mm256_add_epi8(v, _mm256_set1_epi8(static_cast<char>(0x80 - 'A')));
+    __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(static_cast<char>(0x80 - 'A' + 'Z' + 1)), shift);
+    __m256i folded = _mm256_or_si256(v, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+    return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(folded, e))) == 0xffffffffu;
+}
+#endif
+
+/*
+ * lower(a[0..n)) == b[0..n) using `Width`-byte blocks. The last block may
+ * overlap the previous one; re-checking a few bytes is cheaper than a loop.
+ */
+template <size_t Width, bool (*Equal)(const char*, const char*)>
+inline bool equal_blocks(const char* a, const char* b, size_t n) {
+    size_t i = 0;
+    for (; i + Width <= n; i += Width) {
+        if (!Equal(a + i, b + i)) return false;
+    }
+    return i == n || Equal(a + n - Width, b + n - Width);
+}
+
+/* lower(a[0..n)) == b[0..n), widest block first. */
+inline bool equal_folded(const char* a, const char* b, size_t n) {
+#if defined(__AVX2__)
+    if (n >= 32) return equal_blocks<32, equal32>(a, b, n);
+#endif
+#if defined(__SSE2__)
+    if (n >= 16) return equal_blocks<16, equal16>(a, b, n);
+#endif
+    if (n >= 8) return equal_blocks<8, equal8>(a, b, n);
+    for (size_t i = 0; i < n; ++i) {
+        if (ascii_lower(a[i]) != b[i]) return false;
+    }
+    return true;
+}
+
+}  // namespace reply_match
+
+/*
+ * Case-insensitive equality after trimming; spelling-sensitive (no fuzzy match).
+ * `expect` must already be trimmed and lower-case. Nothing is copied.
+ */
+inline bool reply_matches(std::string_view reply, std::string_view expect) {
+    reply = trim_view(reply);
+    if (reply.size() != expect.size()) return false;
+    return reply_match::equal_folded(reply.data(), expect.data(), reply.size());
+}
+
+/* Same contract, one byte at a time: the reference the vector paths are tested against. */
+inline bool reply_matches_scalar(std::string_view reply, std::string_view expect) {
+    reply = trim_view(reply);
+    if (reply.size() != expect.size()) return false;
+    for (size_t i = 0; i < reply.size(); ++i) {
+        if (ascii_lower(reply[i]) != expect[i]) return false;
+    }
+    return true;
+}
@@ -0,0 +1,326 @@
+/*
+ * selector.h
+ * ----------
+ * Uniformly random joke selection without replacement, per session.
+ *
+ * The old start_joke() rebuilt a vector of every untold index and probed a
+ * std::set for each one: O(N log K) time and a fresh allocation per joke.
+ * JokePicker instead keeps one bit per catalog row (N/8 bytes, allocated once
+ * per session) and picks by rejection sampling:
+ *
+ *   - draw r uniformly from [0, N); if r is untold, take it;
+ *   - after kTries misses (the session has heard most jokes), pick the k-th
+ *     untold row directly: find its 4096-row block by descending a Fenwick
+ *     tree of per-block untold counts, then popcount through at most 64
+ *     words of that block.
+ *
+ * Both branches are uniform over the untold rows, so their mix is too.
+ * Expected cost is O(1) while at least half the catalog is untold; the
+ * rank walk (log(N/4096) steps + 64 words) only runs with probability
+ * (told/N)^kTries.
+ *
+ * A catalog of up to 64 rows keeps its bits inside the picker itself (no
+ * allocation at all); larger ones get one heap block for bits and tree
+ * together, and catalogs of one block (up to 4096 rows) need no tree.
+ *
+ * For huge catalogs with many concurrent sessions even N/8 bytes per session
+ * adds up, so PermutationPicker (--select=feistel) offers a constant-memory
+ * alternative: a keyed pseudo-random bijection over [0, N), walked with a
+ * counter. A session stores a 64-bit key and two 32-bit counters (16 bytes)
+ * and still never repeats a joke. The order is pseudo-random rather than
+ * uniformly random, which is plenty for telling jokes.
+ *
+ * Sessions draw from Pcg32: 8 bytes of state where std::mt19937 kept 5 KB.
+ * SeedSource gives each one its seed: a splitmix64 walk from one seed taken
+ * at startup, so a connection costs no system call for entropy. The same
+ * startup seed (--seed) replays the same joke orders.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+enum class SelectMode : uint8_t { Bitset, Feistel };
+
+/* splitmix64 (Steele, Lea & Flood 2014): step by the golden gamma, then a well-mixed finalizer. */
+inline uint64_t splitmix64(uint64_t z) {
+    z += 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/*
+ * PCG32 (XSH-RR output on a 64-bit LCG, O'Neill 2014) on the default stream:
+ * one word of state, statistically far better than its size suggests, and a
+ * UniformRandomBitGenerator like std::mt19937.
+ */
+class Pcg32 {
+public:
+    using result_type = uint32_t;
+
+    Pcg32() { seed(0); }
+    explicit Pcg32(uint64_t s) { seed(s); }
+
+    void seed(uint64_t s) {
+        state_ = 0;
+        step();
+        state_ += s;
+        step();
+    }
+
+    uint32_t operator()() {
+        uint64_t old = state_;
+        step();
+        uint32_t xorshifted = static_cast<uint32_t>(((old >> 18) ^ old) >> 27);
+        uint32_t rot        = static_cast<uint32_t>(old >> 59);
+        return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+    }
+
+    static constexpr uint32_t min() { return 0; }
+    static constexpr uint32_t max() { return UINT32_MAX; }
+
+private:
+    void step() { state_ = state_ * 6364136223846793005ULL + 1442695040888963407ULL; }
+
+    uint64_t state_;
+};
+
+/*
+ * Session seeds: seed i is element i of the splitmix64 sequence that starts
+ * at `base`, so seeds are distinct and well mixed even for base 0 or
+ * neighbouring bases. Any thread may call next(); it costs one relaxed
+ * fetch_add.
+ */
+class SeedSource {
+public:
+    explicit SeedSource(uint64_t base = 0) : base_(base) {}
+
+    /* Start over from `base` (at startup, before any session). */
+    void reset(uint64_t base) {
+        base_ = base;
+        next_.store(0, std::memory_order_relaxed);
+    }
+
+    uint64_t base() const { return base_; }
+    uint64_t next() { return at(next_.fetch_add(1, std::memory_order_relaxed)); }
+    uint64_t at(uint64_t i) const { return splitmix64(base_ + i * 0x9e3779b97f4a7c15ULL); }
+
+private:
+    uint64_t              base_;
+    std::atomic<uint64_t> next_{0};
+};
+
+/*
+ * Unbiased integer in [0, n) from a 32-bit generator (Lemire's multiply-shift
+ * with rejection). n must be in [1, 2^32].
+ */
+template <class Rng>
+inline uint32_t bounded_rand(Rng& rng, uint64_t n) {
+    uint64_t m = static_cast<uint64_t>(static_cast<uint32_t>(rng())) * n;
+    uint32_t low = static_cast<uint32_t>(m);
+    if (low < n) {
+        uint32_t threshold = static_cast<uint32_t>((0x100000000ULL - n) % n);
+        while (low < threshold) {
+            m   = static_cast<uint64_t>(static_cast<uint32_t>(rng())) * n;
+            low = static_cast<uint32_t>(m);
+        }
+    }
+    return static_cast<uint32_t>(m >> 32);
+}
+
+class JokePicker {
+public:
+    static constexpr int    kTries      = 8;   // rejection attempts before the rank walk
+    static constexpr size_t kBlockWords = 64;  // words per summary block
+    static constexpr size_t kBlockRows  = kBlockWords * 64;
+
+    /* Forget everything told and track a catalog of `n` rows. Reuses storage of the same size. */
+    void reset(size_t n) {
+        size_t words  = (n + 63) / 64;
+        size_t blocks = (words + kBlockWords - 1) / kBlockWords;
+        if (heap_words(n) != heap_words(n_)) heap_.reset(heap_words(n) ? new uint64_t[heap_words(n)] : nullptr);
+        n_       = static_cast<uint32_t>(n);
+        count_   = 0;
+        blocks_  = static_cast<uint32_t>(blocks);
+        inline_  = 0;
+        if (heap_) std::fill_n(heap_.get(), words, uint64_t{0});
+
+        // Fenwick tree (1-based) over per-block untold counts, built in O(blocks)
+        top_bit_ = 1;
+        if (blocks < 2) return;  // one block: its untold count is remaining()
+        uint32_t* tree = untold();
+        std::fill_n(tree, blocks + 1, 0u);
+        for (size_t b = 1; b <= blocks; ++b) {
+            tree[b] += static_cast<uint32_t>(std::min(n - (b - 1) * kBlockRows, kBlockRows));
+            size_t parent = b + (b & (~b + 1));
+            if (parent <= blocks) tree[parent] += tree[b];
+        }
+        while (top_bit_ * 2 <= blocks) top_bit_ *= 2;
+    }
+
+    size_t size()      const { return n_; }
+    size_t told()      const { return count_; }
+    size_t remaining() const { return n_ - count_; }
+    bool   was_told(size_t i) const { return (words()[i >> 6] >> (i & 63)) & 1; }
+
+    /* Record row i as told (used when carrying history over to a new catalog). */
+    void set_told(size_t i) {
+        if (!was_told(i)) mark(i);
+    }
+
+    /* Call f(i) for every told row, in index order. */
+    template <class F>
+    void for_each_told(F f) const {
+        const uint64_t* bits = words();
+        for (size_t w = 0; w < word_count(); ++w) {
+            for (uint64_t b = bits[w]; b; b &= b - 1) {
+                f(w * 64 + static_cast<size_t>(__builtin_ctzll(b)));
+            }
+        }
+    }
+
+    /*
+     * Choose a random untold row of a catalog with `n` rows and mark it told.
+     * Returns false once every row has been told.
+     */
+    template <class Rng>
+    bool pick(Rng& rng, size_t n, size_t& out) {
+        if (n != n_) reset(n);
+        if (count_ == n_) return false;
+
+        for (int t = 0; t < kTries; ++t) {
+            size_t r = bounded_rand(rng, n_);
+            if (!was_told(r)) { mark(r); out = r; return true; }
+        }
+
+        // Mostly told: take the k-th untold row. First its block...
+        size_t k = bounded_rand(rng, remaining());
+        size_t b = 0;  // ends as the 0-based block holding the k-th untold row
+        if (blocks_ > 1) {
+            const uint32_t* tree = untold();
+            for (size_t step = top_bit_; step; step >>= 1) {
+                if (b + step <= blocks_ && tree[b + step] <= k) {
+                    b += step;
+                    k -= tree[b];
+                }
+            }
+        }
+
+        // ...then the word and bit inside it
+        uint64_t* bits  = words();
+        size_t    nword = word_count();
+        for (size_t w = b * kBlockWords; w < nword; ++w) {
+            uint64_t free = ~bits[w];
+            if (w == nword - 1 && (n_ & 63)) free &= (uint64_t{1} << (n_ & 63)) - 1;
+            size_t c = static_cast<size_t>(__builtin_popcountll(free));
+            if (k >= c) { k -= c; continue; }
+            while (k--) free &= free - 1;  // drop the k lowest untold bits
+            out = w * 64 + static_cast<size_t>(__builtin_ctzll(free));
+            mark(out);
+            return true;
+        }
+        return false;  // unreachable while the counts are consistent
+    }
+
+private:
+    /* 64-bit words of heap a catalog of `n` rows needs: none up to 64 rows, else bits then tree. */
+    static size_t heap_words(size_t n) {
+        if (n <= 64) return 0;
+        size_t words  = (n + 63) / 64;
+        size_t blocks = (words + kBlockWords - 1) / kBlockWords;
+        return words + (blocks > 1 ? (blocks + 2) / 2 : 0);  // blocks + 1 uint32 counts
+    }
+
+    size_t          word_count() const { return (n_ + 63) / 64; }
+    uint64_t*       words()       { return heap_ ? heap_.get() : &inline_; }
+    const uint64_t* words() const { return heap_ ? heap_.get() : &inline_; }
+    uint32_t*       untold()      { return reinterpret_cast<uint32_t*>(heap_.get() + word_count()); }
+
+    void mark(size_t i) {
+        words()[i >> 6] |= uint64_t{1} << (i & 63);
+        if (blocks_ > 1) {
+            uint32_t* tree = untold();
+            for (size_t b = i / kBlockRows + 1; b <= blocks_; b += b & (~b + 1)) --tree[b];
+        }
+        ++count_;
+    }
+
+    std::unique_ptr<uint64_t[]> heap_;  // bits, then the Fenwick tree of untold rows per block; null up to 64 rows
+    uint64_t inline_  = 0;              // bit i set -> row i already told (catalogs of up to 64 rows)
+    uint32_t n_       = 0;
+    uint32_t count_   = 0;
+    uint32_t blocks_  = 0;              // summary blocks; the tree exists only for two or more
+    uint32_t top_bit_ = 1;              // highest power of two <= blocks_
+};
+
+/*
+ * Counter-mode walk over a keyed Feistel permutation of [0, N).
+ *
+ * The Feistel network permutes the smallest even-bit-width domain 2^(2h) >= N
+ * (so at most 4N values); values >= N are cycle-walked (re-encrypted until
+ * they land in range), which keeps the map a bijection on [0, N). Counter i
+ * therefore yields a distinct row for every i < N, after about 4 rounds of
+ * hashing on average.
+ */
+class PermutationPicker {
+public:
+    static constexpr int kRounds = 4;
+
+    /* Start a fresh walk over `n` rows under `key`. */
+    void reset(size_t n, uint64_t key) {
+        key_  = key;
+        n_    = static_cast<uint32_t>(n);
+        next_ = 0;
+    }
+
+    size_t size()      const { return n_; }
+    size_t told()      const { return next_; }
+    size_t remaining() const { return n_ - next_; }
+
+    /*
+     * Next row of this session's permutation of a catalog with `n` rows.
+     * The key is drawn from `rng` the first time (or when n changes).
+     * Returns false once all n rows have been handed out.
+     */
+    template <class Rng>
+    bool pick(Rng& rng, size_t n, size_t& out) {
+        if (n != n_) {
+            uint64_t hi = static_cast<uint32_t>(rng());
+            reset(n, (hi << 32) | static_cast<uint32_t>(rng()));
+        }
+        if (next_ >= n_) return false;
+
+        // Half width h with 2^(2h) >= n; recomputed rather than stored to stay at 16 bytes
+        int bits = n_ > 1 ? 64 - __builtin_clzll(n_ - 1) : 1;
+        int half = (bits + 1) / 2;
+
+        uint64_t x = encrypt(next_++, half);
+        while (x >= n_) x = encrypt(x, half);  // cycle-walk back into [0, n)
+        out = static_cast<size_t>(x);
+        return true;
+    }
+
+private:
+    /* One bijective pass over [0, 2^(2*half)). */
+    uint64_t encrypt(uint64_t x, int half) const {
+        const uint64_t mask = (uint64_t{1} << half) - 1;
+        uint64_t l = x >> half;
+        uint64_t r = x & mask;
+        for (int round = 0; round < kRounds; ++round) {
+            uint64_t f = splitmix64(key_ ^ (static_cast<uint64_t>(round) << 56) ^ r) & mask;
+            uint64_t t = l ^ f;
+            l = r;
+            r = t;
+        }
+        return (l << half) | r;
+    }
+
+    uint64_t key_  = 0;
+    uint32_t n_    = 0;
+    uint32_t next_ = 0;
+};
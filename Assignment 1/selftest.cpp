@@ -0,0 +1,1416 @@
+/*
+ * selftest.cpp
+ * ------------
+ * In-process checks for the server building blocks (no sockets, no server
+ * process; the end-to-end protocol checks live in tester.cpp).
+ *
+ * Checks:
+ *  1) Protocol frames: a scripted conversation through the session state
+ *     machine produces exactly the expected bytes; "PIPELINE" is only
+ *     honoured as the first line; "BATCH <n>" tells n jokes at once.
+ *  2) Zero allocation: once warmed up, replying to client lines and picking
+ *     the next joke perform no heap allocation (global operator new is counted).
+ *  3) Joke selection: every row exactly once, uniformly, then exhaustion;
+ *     the Feistel permutation never repeats a row for any catalog size;
+ *     session seeds are distinct, and a startup seed replays every
+ *     session's joke order.
+ *  4) Catalog reload: a session moves to a newer snapshot at its next joke,
+ *     keeps the old one alive meanwhile, and never repeats a joke by row id.
+ *     A reader racing publish() never acquires a snapshot older than the
+ *     version it saw.
+ *  5) Compiled catalog: write + mmap round-trips every frame; bad files are rejected.
+ *  6) Reply matcher: the in-place (SIMD) matcher agrees with the original
+ *     lower(trim(a)) == lower(trim(b)) on every 0-2 byte reply, on every
+ *     single-byte edit of replies up to 80 bytes, and on random inputs.
+ *  7) Sharded counter: concurrent updates from many slots sum exactly; a
+ *     sharded limit never admits more holders than it has permits, finds the
+ *     last permits wherever they are cached, and gets every one back.
+ *  8) io_uring driver: a provided-buffer recv and a send round-trip over a
+ *     socketpair, and the bytes feed a LineReader (skipped if io_uring is unavailable).
+ *     Asking for more slots than the queue holds flushes it instead of reusing
+ *     a slot, and completion handlers may submit again.
+ *  9) Database loader: the range-parallel load equals the single-threaded one,
+ *     row for row, across rowid gaps, and renders odd setups like add() always did.
+ * 10) Coroutine sessions: tell_jokes() over a socketpair sends exactly the bytes
+ *     the state machine queues for the same script, and every frame goes back
+ *     to the pool.
+ * 11) Worker pool: every job runs exactly once, and jobs piled onto one busy
+ *     worker's deque are stolen and run by the others.
+ * 12) Output queue: adjacent frames share an iovec, partial sends resume
+ *     mid-frame, a turn longer than one sendmsg() arrives whole and in order,
+ *     and a replaced catalog stays alive until its queued frames are sent.
+ * 13) Backpressure: a coroutine connection holds output back for buffered
+ *     lines only up to its budget, a client that stops reading shows up in
+ *     the stall gauges, and the send deadline fails the waiting write.
+ * 14) Deadlines: the timer wheel fires every timer at the first advance()
+ *     at or past its time (never early, across every level and past the
+ *     horizon, with handlers re-arming and cancelling), a million timers arm
+ *     and cancel in O(1), and a silent client hits its read deadline or its
+ *     lifetime limit.
+ * 15) Per-address limits: the connection-rate bucket allows exactly its burst
+ *     and then its rate, the connection cap holds under concurrent admits and
+ *     releases, idle addresses give their slots to new ones, and a full table
+ *     admits rather than refuses.
+ * 16) Compact sessions: an idle session fits in 256 bytes, its reader holds
+ *     no buffer between lines (and still joins lines split across reads or
+ *     longer than a chunk), and the slab never hands one object out twice,
+ *     reuses what comes back, and takes objects freed on other threads.
+ * 17) Async log: records render like the stream output they replace, each
+ *     thread's lines come out complete and in order, lines from different
+ *     threads come out in the order they were logged, levels filter, threads
+ *     that come and go reuse drained rings, and a stalled output drops (and
+ *     reports) lines instead of blocking the logger.
+ * 18) Protocol counters: jokes told (batched ones included), both kinds of
+ *     correction and Y/N re-prompts count exactly once each, summed across
+ *     sessions on several threads.
+ * 19) Latency histograms: every value falls in a bucket that contains it and
+ *     is at most 1/32 of it wide, percentiles merged from several threads'
+ *     slots land within that precision, and a session records each protocol
+ *     step once per line, prompt and joke.
+ *
+ * Build & run:
+ *   make check
+ */
+
+#include "async_log.h"
+#include "catalog_db.h"
+#include "counters.h"
+#include "ip_limiter.h"
+#include "latency.h"
+#include "pool.h"
+#include "session.h"
+#include "slab.h"
+#include "uring.h"
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <random>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// ------------------------- Allocation counting -------------------------
+
+static atomic<long> allocations{0};
+
+// GCC cannot see that these two replacements pair up and warns at inlined call sites
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void* operator new(size_t n) {
+    allocations.fetch_add(1, memory_order_relaxed);
+    if (void* p = malloc(n ? n : 1)) return p;
+    throw bad_alloc();
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+// ------------------------------- Harness -------------------------------
+
+static int failures = 0;
+
+#define CHECK(cond)                                                          \
+    do {                                                                     \
+        if (!(cond)) {                                                       \
+            cerr << "  FAILED " << __FILE__ << ":" << __LINE__ << ": " #cond "\n"; \
+            ++failures;                                                      \
+        }                                                                    \
+    } while (0)
+
+static Catalog make_catalog() {
+    Catalog c;
+    c.add(1, "Harry", "Harry up and open the Chamber of Secrets before I get caught!");
+    c.add(2, "Luna", "Luna-tic says the door is enchanted.");
+    c.add(4, " Dobby ", "Dobby has no master, but he has a key!");
+    return c;
+}
+
+/* Feed one client line and return (then clear) what the server queued. */
+static string reply(ClientSession& s, string_view line) {
+    s.outbuf.clear();
+    on_client_line(&s, line);
+    return s.outbuf.str();
+}
+
+/* The original string-building comparison, kept as the reference. */
+static string ref_trim(const string& s) {
+    size_t i = s.find_first_not_of(" \t\r\n");
+    if (i == string::npos) return "";
+    size_t j = s.find_last_not_of(" \t\r\n");
+    return s.substr(i, j - i + 1);
+}
+static string ref_lower(string s) {
+    for (char& c : s) c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+    return s;
+}
+static bool ref_iequals(const string& a, const string& b) { return ref_lower(ref_trim(a)) == ref_lower(ref_trim(b)); }
+
+// -------------------------------- Checks -------------------------------
+
+static void test_frames() {
+    cout << "[TEST] protocol frames\n";
+    Catalog jokes = make_catalog();
+    ClientSession s;
+    s.catalog = &jokes;
+    s.rng.seed(1);
+
+    start_joke(&s);
+    CHECK(s.outbuf.str() == "Knock knock! <input>\n");
+    CHECK(s.state == SessionState::AwaitWhosThere);
+    Joke jk = jokes[s.joke];
+
+    CHECK(reply(s, "Who there?") ==
+          "You are supposed to say, \"Who's there?\". Let's try again.\nKnock knock! <input>\n");
+    CHECK(reply(s, "  wHO'S THERE?\t") == string(jk.setup) + " <input>\n");
+
+    string wrong = reply(s, "nope");
+    CHECK(wrong.rfind("You are supposed to say, \"" + string(jk.setup) + " who?\". Let's try again.\n", 0) == 0);
+    CHECK(s.state == SessionState::AwaitWhosThere);  // restarted with a fresh joke
+    jk = jokes[s.joke];
+
+    reply(s, "who's there?");
+    CHECK(reply(s, string(jk.setup) + " WHO?") == string(jk.punchline) +
+          "Would you like to listen to another? (Y/N) <input>\n");
+    CHECK(reply(s, "maybe") == "Please reply with Y or N.\nWould you like to listen to another? (Y/N) <input>\n");
+    CHECK(reply(s, "yes") == "Knock knock! <input>\n");
+
+    // Third and last joke, then the catalog is exhausted
+    jk = jokes[s.joke];
+    reply(s, "who's there?");
+    reply(s, string(jk.setup) + " who?");
+    CHECK(reply(s, "y") == "I have no more jokes to tell.\n");
+    CHECK(s.state == SessionState::Closing);
+
+    // Pipelining is asked for with the very first line, and only there
+    ClientSession p;
+    p.catalog = &jokes;
+    p.rng.seed(1);
+    start_joke(&p);
+    CHECK(reply(p, " Pipeline ") == "Pipelining on.\n");
+    CHECK(p.state == SessionState::AwaitWhosThere);
+    CHECK(reply(p, "PIPELINE") ==
+          "You are supposed to say, \"Who's there?\". Let's try again.\nKnock knock! <input>\n");
+
+    // "BATCH <n>" at the Y/N prompt: setup and punchline lines back to back, then Y/N once
+    ClientSession b;
+    b.catalog = &jokes;
+    b.rng.seed(3);
+    start_joke(&b);
+    reply(b, "who's there?");
+    reply(b, string(jokes[b.joke].setup) + " who?");
+    const string yes_no = "Please reply with Y or N.\nWould you like to listen to another? (Y/N) <input>\n";
+    for (const char* bad : {"batch", "batch 0", "batch x", "batch 1001", "batch -1", "batchx 1"}) {
+        CHECK(reply(b, bad) == yes_no);
+    }
+    string one = reply(b, " Batch 1 ");
+    jk = jokes[b.joke];
+    CHECK(one == string(jk.setup) + "\n" + string(jk.punchline) + "Would you like to listen to another? (Y/N) <input>\n");
+    CHECK(b.state == SessionState::AwaitAnother);
+    string rest = reply(b, "BATCH 5");  // one joke left
+    jk = jokes[b.joke];
+    CHECK(rest == string(jk.setup) + "\n" + string(jk.punchline) + "I have no more jokes to tell.\n");
+    CHECK(b.state == SessionState::Closing);
+    CHECK(b.told_jokes.told() == 3);
+}
+
+static void test_zero_alloc() {
+    cout << "[TEST] zero allocations while replying and picking jokes\n";
+    Catalog jokes = make_catalog();
+    ClientSession s;
+    s.catalog = &jokes;
+    s.rng.seed(2);
+
+    // Replies for every joke, rendered up front so the loop itself owns no strings
+    vector<string> who;
+    for (size_t i = 0; i < jokes.size(); ++i) who.push_back(string(jokes[i].setup) + " Who?");
+
+    // One round: every reply path, across the whole catalog, until exhausted
+    auto round = [&](long& counted) {
+        long before = allocations.load();
+        s.told_jokes.reset(jokes.size());
+        s.outbuf.clear();
+        start_joke(&s);
+        while (s.state != SessionState::Closing) {
+            on_client_line(&s, "who is there");   // wrong first reply
+            on_client_line(&s, "Who's there?");
+            on_client_line(&s, who[s.joke]);
+            on_client_line(&s, "perhaps");        // invalid Y/N
+            s.outbuf.clear();                     // the driver flushed this turn
+            on_client_line(&s, "Y");              // next joke, or "no more jokes"
+        }
+        counted += allocations.load() - before;
+    };
+
+    long warmup = 0, counted = 0;
+    round(warmup);  // grows outbuf to its working size
+    for (int i = 0; i < 1000; ++i) round(counted);
+    CHECK(counted == 0);
+    if (counted) cerr << "  " << counted << " allocations in steady state\n";
+}
+
+static void test_selection() {
+    cout << "[TEST] joke selection without replacement\n";
+    Pcg32 rng(3);
+    JokePicker picker;
+
+    // Every row exactly once, then exhausted (exercises both rejection and scan), for
+    // bits kept inline, one heap block without a tree, and several blocks with one
+    size_t idx = 0;
+    for (size_t n : {64UL, 1000UL, 10000UL}) {
+        vector<int> seen(n, 0);
+        for (size_t i = 0; i < n; ++i) {
+            CHECK(picker.pick(rng, n, idx));
+            CHECK(idx < n);
+            if (idx < n) ++seen[idx];
+        }
+        size_t once = 0;
+        for (int c : seen) once += c == 1;
+        CHECK(once == n);
+        CHECK(!picker.pick(rng, n, idx));
+    }
+
+    // Last pick of a nearly-told catalog is uniform over the untold rows
+    const size_t m = 10, trials = 100000;
+    vector<size_t> hist(m, 0);
+    for (size_t t = 0; t < trials; ++t) {
+        picker.reset(m);
+        for (size_t i = 0; i < m - 4; ++i) picker.pick(rng, m, idx);
+        picker.pick(rng, m, idx);
+        ++hist[idx];
+    }
+    for (size_t c : hist) CHECK(c > trials / m * 8 / 10 && c < trials / m * 12 / 10);
+
+    // Feistel mode: a bijection on [0, n) for odd, even and power-of-two sizes
+    for (size_t sz : {1UL, 2UL, 3UL, 5UL, 64UL, 1000UL, 4097UL, 65536UL}) {
+        PermutationPicker perm;
+        vector<char> hit(sz, 0);
+        size_t distinct = 0;
+        while (perm.pick(rng, sz, idx)) {
+            CHECK(idx < sz);
+            if (idx < sz && !hit[idx]) { hit[idx] = 1; ++distinct; }
+        }
+        CHECK(distinct == sz);
+        CHECK(perm.told() == sz);
+    }
+    CHECK(sizeof(PermutationPicker) == 16);
+
+    // Seeds: distinct across sessions and neighbouring startup seeds; the same startup seed, the same orders
+    SeedSource a(7), b(8);
+    set<uint64_t> seeds;
+    for (int i = 0; i < 10000; ++i) { seeds.insert(a.next()); seeds.insert(b.next()); }
+    CHECK(seeds.size() == 20000);
+    auto order = [](uint64_t seed, SelectMode mode) {
+        Catalog jokes;
+        for (int i = 1; i <= 50; ++i) jokes.add(i, "S" + to_string(i), "P");
+        ClientSession s;
+        s.catalog     = &jokes;
+        s.select_mode = mode;
+        s.rng.seed(seed);
+        vector<size_t> told;
+        for (size_t j; pick_joke(&s, j);) told.push_back(j);
+        return told;
+    };
+    SeedSource replay(12345);
+    for (uint64_t i = 0; i < 3; ++i) {
+        uint64_t seed = replay.next();
+        CHECK(seed == SeedSource(12345).at(i));
+        for (SelectMode mode : {SelectMode::Bitset, SelectMode::Feistel}) {
+            vector<size_t> first = order(seed, mode);
+            CHECK(first.size() == 50 && first == order(seed, mode));
+            CHECK(first != order(replay.at(i + 1), mode));
+        }
+    }
+}
+
+static void test_reload() {
+    cout << "[TEST] catalog snapshots and reload\n";
+    CatalogStore store;
+    auto v1 = make_shared<Catalog>(make_catalog());
+    store.publish(v1);
+
+    ClientSession s;
+    s.store = &store;
+    s.rng.seed(4);
+    adopt_catalog(&s, store.acquire());
+
+    // Tell two jokes from version 1; remember them by row id
+    set<int64_t> heard;
+    for (int i = 0; i < 2; ++i) {
+        start_joke(&s);
+        heard.insert((*s.catalog)[s.joke].id);
+        reply(s, "who's there?");
+        reply(s, string((*s.catalog)[s.joke].setup) + " who?");
+    }
+    CHECK(s.catalog->version() == 1);
+
+    // Version 2: rows reordered by a new one in front, row 2 deleted, two new rows
+    auto v2 = make_shared<Catalog>();
+    v2->add(0, "Hedwig", "Hedwig-et out of here, the owl post is late!");
+    v2->add(1, "Harry", "Harry up and open the Chamber of Secrets before I get caught!");
+    v2->add(4, " Dobby ", "Dobby has no master, but he has a key!");
+    v2->add(7, "Nox", "Nox on the door again and I'll hex you.");
+    weak_ptr<const Catalog> old = v1;
+    v1.reset();
+    store.publish(v2);
+    CHECK(store.version() == 2);
+    CHECK(!old.expired());  // still pinned by the session
+
+    // Next joke switches over; everything left is new to this client
+    reply(s, "y");
+    CHECK(s.catalog == v2.get());
+    CHECK(old.expired());
+    while (s.state != SessionState::Closing) {
+        int64_t id = (*s.catalog)[s.joke].id;
+        CHECK(heard.insert(id).second);
+        reply(s, "who's there?");
+        reply(s, string((*s.catalog)[s.joke].setup) + " who?");
+        reply(s, "y");
+    }
+    // Exhausted only once every row of version 2 was heard, each exactly once
+    for (int64_t id : {0, 1, 4, 7}) CHECK(heard.count(id) == 1);
+
+    // A reader racing the publisher sees whole snapshots, never older than version()
+    atomic<bool> done{false};
+    bool         ordered = true;
+    thread reader([&] {
+        while (!done.load()) {
+            uint64_t seen = store.version();
+            ordered = ordered && store.acquire()->version() >= seen;
+        }
+    });
+    for (int i = 0; i < 1000; ++i) store.publish(make_shared<Catalog>(make_catalog()));
+    done.store(true);
+    reader.join();
+    CHECK(ordered);
+    CHECK(store.version() == 1002 && store.acquire()->version() == 1002);
+}
+
+static void test_compiled_catalog() {
+    cout << "[TEST] compiled catalog file\n";
+    const string path = "/tmp/kk_selftest.kkc";
+    Catalog built = make_catalog();
+    string err;
+    CHECK(built.write_file(path, err));
+
+    Catalog mapped;
+    CHECK(Catalog::map_file(path, mapped, err));
+    CHECK(mapped.mapped());
+    CHECK(mapped.size() == built.size());
+    for (size_t i = 0; i < built.size() && i < mapped.size(); ++i) {
+        Joke a = built[i], b = mapped[i];
+        CHECK(a.id == b.id && a.setup == b.setup && a.prompt == b.prompt && a.punchline == b.punchline &&
+              a.expect == b.expect && a.correction == b.correction);
+    }
+    CHECK(mapped.find(4) == 2);
+    CHECK(mapped.find(3) == mapped.size());
+
+    // Moving a mapped catalog keeps the views valid
+    Catalog moved = std::move(mapped);
+    CHECK(moved.size() == built.size() && moved[0].prompt == "Harry <input>\n");
+
+    // Truncated file
+    FILE* f = fopen(path.c_str(), "r+b");
+    if (f) { CHECK(ftruncate(fileno(f), sizeof(Catalog::FileHeader) + 8) == 0); fclose(f); }
+    Catalog broken;
+    CHECK(!Catalog::map_file(path, broken, err));
+    CHECK(!err.empty());
+    remove(path.c_str());
+}
+
+static void test_matcher() {
+    cout << "[TEST] reply matcher equals the original iequals\n";
+    long mismatches = 0;
+    auto same = [&](const string& reply, const string& answer) {
+        string expect = ref_lower(ref_trim(answer));  // what the catalog pre-renders
+        bool want = ref_iequals(reply, answer);
+        if (reply_matches(reply, expect) != want || reply_matches_scalar(reply, expect) != want) {
+            if (++mismatches <= 5) cerr << "  mismatch on reply \"" << reply << "\" vs \"" << answer << "\"\n";
+        }
+    };
+
+    // Exhaustive: every reply of 0, 1 and 2 bytes against short answers
+    const vector<string> answers = {"", "y", "Y", "no", "N ", "a@", "[`", "{z", " Z\t"};
+    for (const auto& ans : answers) {
+        same("", ans);
+        for (int a = 0; a < 256; ++a) {
+            same(string(1, static_cast<char>(a)), ans);
+            for (int b = 0; b < 256; ++b) same(string{static_cast<char>(a), static_cast<char>(b)}, ans);
+        }
+    }
+
+    // Every length across the 8/16/32-byte block edges, every position, every byte value
+    mt19937 rng(5);
+    const string letters = "AbCdEfGhIjKlMnOpQrStUvWxYz@[`{'? 0123456789";
+    for (size_t len = 1; len <= 80; ++len) {
+        string answer;
+        for (size_t i = 0; i < len; ++i) answer += letters[rng() % letters.size()];
+        answer.front() = 'K';  // keep the edit positions inside the trimmed text
+        answer.back()  = 'k';
+        for (size_t pos = 0; pos < len; ++pos) {
+            for (int c = 0; c < 256; ++c) {
+                string reply = answer;
+                reply[pos] = static_cast<char>(c);
+                same(reply, answer);
+            }
+        }
+        same("  \t" + answer + "\r\n", answer);
+    }
+
+    // Random pairs: mostly case variants of each other with random padding
+    const string pad = " \t\r\n";
+    for (int t = 0; t < 200000; ++t) {
+        size_t len = rng() % 70;
+        string answer, reply;
+        for (size_t i = 0; i < len; ++i) answer += static_cast<char>(rng() % 4 ? letters[rng() % letters.size()] : rng() % 256);
+        for (char c : answer) reply += rng() % 2 ? static_cast<char>(toupper(static_cast<unsigned char>(c))) : c;
+        if (rng() % 8 == 0 && !reply.empty()) reply[rng() % reply.size()] ^= static_cast<char>(1 << (rng() % 8));
+        for (size_t k = rng() % 3; k > 0; --k) reply.insert(reply.begin(), pad[rng() % pad.size()]);
+        for (size_t k = rng() % 3; k > 0; --k) reply += pad[rng() % pad.size()];
+        same(reply, answer);
+    }
+
+    CHECK(mismatches == 0);
+    if (mismatches) cerr << "  " << mismatches << " mismatches\n";
+}
+
+static void test_counter() {
+    cout << "[TEST] sharded counter\n";
+    ShardedCounter c;
+    vector<thread> ths;
+    for (size_t t = 0; t < 8; ++t) {
+        ths.emplace_back([&c, t] {
+            set_counter_shard(t * 9);  // wraps past kCounterShards for some threads
+            for (int i = 0; i < 100000; ++i) c.inc();
+            for (int i = 0; i < 40000; ++i) c.dec();
+        });
+    }
+    for (auto& th : ths) th.join();
+    CHECK(c.load() == 8 * 60000);
+    CHECK(counter_shard() == 0);  // this thread never picked a slot
+    c.add(-5);
+    CHECK(c.load() == 8 * 60000 - 5);
+
+    // A sharded limit never has more holders than permits, and every permit comes back
+    ShardedLimit limit;
+    limit.set_limit(20);
+    atomic<int> holders{0}, most{0}, refused{0};
+    ths.clear();
+    for (size_t t = 0; t < 8; ++t) {
+        ths.emplace_back([&, t] {
+            set_counter_shard(t * 9);
+            for (int i = 0; i < 20000; ++i) {
+                if (!limit.acquire()) { refused.fetch_add(1); continue; }
+                int h = holders.fetch_add(1) + 1;
+                for (int seen = most.load(); h > seen && !most.compare_exchange_weak(seen, h);) {}
+                holders.fetch_sub(1);
+                limit.release();
+            }
+        });
+    }
+    for (auto& th : ths) th.join();
+    CHECK(most.load() <= 20);
+    CHECK(limit.available() == 20);
+    // Taken from many slots, each caching a batch: the last permits are found in the others' caches
+    vector<int> took;
+    for (size_t t = 0; t < 25; ++t) {
+        set_counter_shard(t * 3);
+        took.push_back(limit.acquire());
+    }
+    set_counter_shard(0);
+    CHECK(count(took.begin(), took.end(), 1) == 20 && limit.available() == 0);
+    for (int i = 0; i < 20; ++i) limit.release();
+    CHECK(limit.available() == 20 && limit.acquire());
+    ShardedLimit none;  // 0: no limit
+    for (int i = 0; i < 1000; ++i) CHECK(none.acquire());
+}
+
+static void test_uring() {
+    cout << "[TEST] io_uring driver\n";
+    IoUring ring;
+    string err;
+    if (!ring.open(64, 3, 4, 64, err)) {
+        cout << "  skipped: " << err << "\n";
+        return;
+    }
+    int sv[2];
+    CHECK(::socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+    // Several rounds so buffers must come back through recycle()
+    LineReader in(-1, 4096);
+    string_view line;
+    for (int round = 0; round < 10; ++round) {
+        string msg = "Line " + to_string(round) + "\r\n";
+        io_uring_sqe* s = ring.sqe();
+        s->opcode    = IORING_OP_SEND;
+        s->fd        = sv[0];
+        s->addr      = reinterpret_cast<uint64_t>(msg.data());
+        s->len       = static_cast<uint32_t>(msg.size());
+        s->user_data = 1;
+        s = ring.sqe();
+        s->opcode    = IORING_OP_RECV;
+        s->fd        = sv[1];
+        s->flags     = IOSQE_BUFFER_SELECT;
+        s->buf_group = ring.buffer_group();
+        s->user_data = 2;
+
+        int seen = 0;
+        while (seen < 2) {
+            CHECK(ring.submit(1) >= 0);
+            ring.drain([&](const io_uring_cqe& c) {
+                ++seen;
+                CHECK(c.res == static_cast<int>(msg.size()));
+                if (c.user_data == 2 && c.res > 0 && (c.flags & IORING_CQE_F_BUFFER)) {
+                    unsigned bid = c.flags >> IORING_CQE_BUFFER_SHIFT;
+                    in.feed(ring.buffer(bid), static_cast<size_t>(c.res));
+                    ring.recycle(bid);
+                }
+            });
+        }
+        CHECK(in.next_line(line) && line == "Line " + to_string(round));
+    }
+    ::close(sv[0]);
+    ::close(sv[1]);
+
+    // Three queues' worth of NOPs: a full queue is flushed, never overwritten. Each
+    // completion queues a follow-up from inside drain(), which may flush too.
+    const unsigned kNops = 3 * 64;
+    vector<int> done(2 * kNops, 0);
+    for (unsigned i = 0; i < kNops; ++i) {
+        io_uring_sqe* s = ring.sqe();
+        CHECK(s != nullptr);
+        if (!s) return;
+        s->opcode    = IORING_OP_NOP;
+        s->user_data = i;
+    }
+    unsigned seen = 0;
+    while (seen < 2 * kNops) {
+        CHECK(ring.submit(1) >= 0);
+        seen += ring.drain([&](const io_uring_cqe& c) {
+            ++done[c.user_data];
+            if (c.user_data >= kNops) return;
+            io_uring_sqe* s = ring.sqe();
+            CHECK(s != nullptr);
+            if (!s) return;
+            s->opcode    = IORING_OP_NOP;
+            s->user_data = c.user_data + kNops;
+        });
+    }
+    CHECK(count(done.begin(), done.end(), 1) == static_cast<ptrdiff_t>(2 * kNops));
+}
+
+static void test_db_loader() {
+    cout << "[TEST] parallel database loader\n";
+    const string path = "/tmp/kk_selftest.db";
+    remove(path.c_str());
+    sqlite3* db = nullptr;
+    CHECK(sqlite3_open(path.c_str(), &db) == SQLITE_OK);
+    sqlite3_exec(db, "PRAGMA journal_mode=OFF; PRAGMA synchronous=OFF;"
+                     "CREATE TABLE jokes (id INTEGER PRIMARY KEY, setup TEXT, punchline TEXT); BEGIN;",
+                 nullptr, nullptr, nullptr);
+    sqlite3_stmt* st = nullptr;
+    sqlite3_prepare_v2(db, "INSERT INTO jokes (id, setup, punchline) VALUES (?, ?, ?);", -1, &st, nullptr);
+    const size_t rows = static_cast<size_t>(kParallelLoadMinRows) + 1000;
+    for (size_t i = 0; i < rows; ++i) {
+        string setup = "Setup" + to_string(i), punch = "Punch " + to_string(i);
+        if (i % 7 == 0) setup = "  Mixed CASE " + to_string(i) + " ";
+        if (i % 1000 == 3) setup = "   ";
+        sqlite3_bind_int64(st, 1, static_cast<int64_t>(i * 3 + (i % 3)));  // gaps of varying size
+        sqlite3_bind_text(st, 2, setup.data(), static_cast<int>(setup.size()), SQLITE_TRANSIENT);
+        if (i % 1000 == 5) sqlite3_bind_null(st, 3);
+        else sqlite3_bind_text(st, 3, punch.data(), static_cast<int>(punch.size()), SQLITE_TRANSIENT);
+        sqlite3_step(st);
+        sqlite3_reset(st);
+    }
+    sqlite3_finalize(st);
+    sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
+    sqlite3_close(db);
+
+    Catalog one, four;
+    CHECK(load_jokes_from_db(path, one, 1));
+    CHECK(load_jokes_from_db(path, four, 4));
+    CHECK(one.size() == rows && four.size() == rows);
+    CHECK(one.heap_size() == four.heap_size());
+    bool same = one.size() == four.size();
+    for (size_t i = 0; same && i < one.size(); ++i) {
+        Joke a = one[i], b = four[i];
+        same = a.id == b.id && a.prompt == b.prompt && a.punchline == b.punchline &&
+               a.expect == b.expect && a.correction == b.correction;
+    }
+    CHECK(same);
+    CHECK(four.find(four.id(rows / 2)) == rows / 2);  // merged pieces stay sorted by id
+
+    // Rendering matches the old string-built frames: expect = lower(trim(setup + " who?"))
+    for (size_t i : {0UL, 3UL, 5UL, 7UL}) {
+        Joke jk = four[i];
+        string want = string(jk.setup) + " who?";
+        want = string(trim_view(want));
+        for (char& c : want) c = ascii_lower(c);
+        CHECK(jk.expect == want);
+        CHECK(jk.correction == "You are supposed to say, \"" + string(jk.setup) + " who?\". Let's try again.\n");
+    }
+    CHECK(four[3].expect == "who?");
+    CHECK(four[5].punchline == "\n");
+
+    Catalog missing;
+    CHECK(!load_jokes_from_db("/nonexistent/kk.db", missing, 2));
+    remove(path.c_str());
+}
+
+/* Run tell_jokes() on one end of a socketpair against `script`; return what it sent. */
+static string coro_transcript(const Catalog& jokes, uint32_t seed, const string& script) {
+    int sv[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) != 0) return "socketpair failed";
+
+    ClientSession s;
+    s.catalog = &jokes;
+    s.rng.seed(seed);
+    s.in.reset(sv[0]);
+
+    coro::EventLoop loop;
+    bool done = false;
+    auto session = [&]() -> coro::Detached {
+        coro::Conn conn(loop, sv[0], s.in, s.outbuf);
+        co_await tell_jokes(conn, &s);
+        co_await conn.flush();
+        done = true;
+    };
+    session();  // sends "Knock knock!" and suspends: nothing to read yet
+    CHECK(!done);
+
+    [[maybe_unused]] ssize_t wn = ::write(sv[1], script.data(), script.size());
+    ::shutdown(sv[1], SHUT_WR);
+    loop.run([&] { return done; });
+
+    string out;
+    char buf[4096];
+    ssize_t n;
+    while ((n = ::read(sv[1], buf, sizeof(buf))) > 0) out.append(buf, static_cast<size_t>(n));
+    ::close(sv[0]);
+    ::close(sv[1]);
+    return out;
+}
+
+/* The state machine's bytes for the same script. */
+static string state_machine_transcript(const Catalog& jokes, uint32_t seed, const string& script) {
+    ClientSession s;
+    s.catalog = &jokes;
+    s.rng.seed(seed);
+    start_joke(&s);
+    string out = s.outbuf.str();
+    size_t pos = 0;
+    while (s.state != SessionState::Closing && pos < script.size()) {
+        size_t nl = script.find('\n', pos);
+        string_view line(script.data() + pos, nl - pos);
+        pos = nl + 1;
+        out += reply(s, line);
+    }
+    return out;
+}
+
+static void test_coro() {
+    cout << "[TEST] coroutine sessions\n";
+    Catalog jokes;  // one setup for every joke, so a fixed script fits any draw order
+    jokes.add(1, "Tank", "You're welcome!");
+    jokes.add(2, "Tank", "Tank goodness it's Friday.");
+    jokes.add(3, "Tank", "Tanks for nothing.");
+
+    const string exhaust =
+        "who there?\nwho's there?\nnope\n"                   // wrong, right, wrong setup -> fresh joke
+        "who's there?\ntank who?\nmaybe\ny\n"                // Y/N retry
+        "WHO'S THERE?\n Tank WHO? \nyes\n"
+        "who's there?\ntank who?\ny\n"                       // no jokes left
+        "ignored\n";
+    const string decline = "who's there?\ntank who?\nN\nignored\n";
+    const string hangup  = "who's there?\n";                  // EOF mid-joke
+    const string pipelined = "PIPELINE\n" + exhaust;
+    const string batch     = "who's there?\ntank who?\nbatch 1\nbatch 9\n";
+
+    for (uint32_t seed : {1u, 2u, 3u}) {
+        for (const string* script : {&exhaust, &decline, &hangup, &pipelined, &batch}) {
+            CHECK(coro_transcript(jokes, seed, *script) == state_machine_transcript(jokes, seed, *script));
+        }
+    }
+    CHECK(coro_transcript(jokes, 1, exhaust).find("I have no more jokes to tell.\n") != string::npos);
+
+    // has_line() decides whether a driver may hold its output back; it must agree with next_line()
+    LineReader lr(-1, 4);
+    string_view v;
+    CHECK(!lr.has_line());
+    lr.feed("ab\r\r\r", 5);
+    CHECK(!lr.has_line());  // '\r' does not count toward the length guard
+    lr.feed("cde", 3);
+    CHECK(lr.has_line() && lr.next_line(v) && v == "abcde");
+    lr.feed("x\ny", 3);
+    CHECK(lr.has_line() && lr.next_line(v) && v == "x");
+    CHECK(!lr.has_line() && !lr.next_line(v));
+    CHECK(coro::FramePool::live() == 0);
+}
+
+struct PoolCounts {
+    WorkerPool*         pool = nullptr;
+    vector<atomic<int>> runs = vector<atomic<int>>(11000);  // per job id: how often it ran
+    atomic<int>         done{0};
+    atomic<bool>        children_stolen{false};
+};
+
+static PoolCounts* pool_counts = nullptr;
+
+static void count_job(void* arg) {
+    pool_counts->runs[reinterpret_cast<uintptr_t>(arg)].fetch_add(1);
+    pool_counts->done.fetch_add(1);
+}
+
+/* Piles 1000 jobs onto its own deque, then waits without popping: only thieves can run them. */
+static void parent_job(void*) {
+    for (uintptr_t i = 10000; i < 11000; ++i) pool_counts->pool->submit(count_job, reinterpret_cast<void*>(i));
+    auto children_done = [] {
+        for (size_t i = 10000; i < 11000; ++i) {
+            if (pool_counts->runs[i].load() == 0) return false;
+        }
+        return true;
+    };
+    auto deadline = chrono::steady_clock::now() + chrono::seconds(10);
+    while (!children_done() && chrono::steady_clock::now() < deadline) this_thread::yield();
+    pool_counts->children_stolen = children_done();
+}
+
+static void test_pool() {
+    cout << "[TEST] work-stealing pool\n";
+    PoolCounts counts;
+    pool_counts = &counts;
+    {
+        WorkerPool pool(4);
+        counts.pool = &pool;
+        CHECK(pool.size() == 4);
+        for (uintptr_t i = 0; i < 10000; ++i) pool.submit(count_job, reinterpret_cast<void*>(i));
+        pool.submit(parent_job, nullptr);
+        pool.stop();  // drains everything submitted, then joins
+        CHECK(counts.children_stolen.load());
+        CHECK(pool.steals() >= 1000);
+    }
+    bool once = true;
+    for (size_t i = 0; i < 11000; ++i) once = once && counts.runs[i].load() == 1;
+    CHECK(once);
+    CHECK(counts.done.load() == 11000);
+    CHECK(WorkerPool::current_worker() == -1);
+}
+
+static void test_out_queue() {
+    cout << "[TEST] output queue\n";
+    OutQueue q;
+    const string text = "Knock knock! <input>\nWho's there?\n";
+    q.append(string_view(text).substr(0, 21));
+    q.append(string_view(text).substr(21));  // contiguous: merges into one iovec
+    q.append(kNewline);
+    CHECK(q.size() == text.size() + 1);
+    CHECK(q.message()->msg_iovlen == 2);
+    CHECK(q.str() == text + "\n");
+    q.consume(5);                             // partial send, mid-frame
+    CHECK(q.str() == text.substr(5) + "\n");
+    q.consume(q.size());
+    CHECK(q.empty() && q.str().empty());
+
+    // A turn of many separate frames goes out over several sendmsg() calls
+    int sv[2];
+    CHECK(::socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    vector<string> frames;
+    for (size_t i = 0; i < 3 * OutQueue::kMaxIov + 7; ++i) frames.push_back("frame " + to_string(i) + "\n");
+    string expect;
+    for (const string& f : frames) { q.append(f); expect += f; }
+    CHECK(q.more_than_one_message());
+    int calls = 0;
+    while (!q.empty() && q.send_some(sv[0]) > 0) ++calls;
+    CHECK(q.empty());
+    CHECK(calls >= 4);
+    ::shutdown(sv[0], SHUT_WR);
+    string got;
+    char buf[4096];
+    ssize_t n;
+    while ((n = ::read(sv[1], buf, sizeof(buf))) > 0) got.append(buf, static_cast<size_t>(n));
+    CHECK(got == expect);
+    ::close(sv[0]);
+    ::close(sv[1]);
+
+    // A session whose catalog is replaced mid-turn keeps the old frames valid
+    auto old_snap = make_shared<Catalog>(make_catalog());
+    weak_ptr<Catalog> watch = old_snap;
+    ClientSession s;
+    s.rng.seed(5);
+    adopt_catalog(&s, std::move(old_snap));
+    start_joke(&s);
+    on_client_line(&s, "Who's there?");       // queues the setup line from the snapshot
+    string pending = s.outbuf.str();
+    adopt_catalog(&s, make_shared<Catalog>(make_catalog()));
+    CHECK(!watch.expired());
+    CHECK(s.outbuf.str() == pending);
+    s.outbuf.clear();
+    CHECK(watch.expired());
+}
+
+static int64_t stall_gauge[2] = {0, 0};  // sessions, bytes, as reported by the loop's stall hook
+
+static void test_backpressure() {
+    cout << "[TEST] output budget and slow-reader eviction\n";
+    static const string frame(1000, 'x');
+
+    // Lines sent ahead are answered in one write, but never more than the budget at once
+    {
+        int sv[2];
+        CHECK(::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == 0);
+        LineReader in(sv[0], 4096);
+        OutQueue   out;
+        coro::EventLoop loop;
+        const string ahead = "one\ntwo\n";
+        [[maybe_unused]] ssize_t wn = ::write(sv[1], ahead.data(), ahead.size());
+        in.fill();
+        size_t seen_first = 0, seen_second = 0;
+        auto session = [&]() -> coro::Detached {
+            coro::Conn conn(loop, sv[0], in, out, 1500);
+            string_view line;
+            co_await conn.write(string_view(frame).substr(0, 100));
+            co_await conn.read_line(line);   // "two" is buffered: keep queueing
+            seen_first = out.size();
+            co_await conn.write(frame);      // 1100 bytes
+            co_await conn.read_line(line);
+            co_await conn.write(frame);      // 2100 >= 1500: sent right away
+            seen_second = out.size();
+        };
+        session();
+        CHECK(seen_first == 100);
+        CHECK(seen_second == 0);
+        char buf[4096];
+        CHECK(::read(sv[1], buf, sizeof(buf)) == 2100);
+        ::close(sv[0]);
+        ::close(sv[1]);
+    }
+
+    // A client that reads nothing stalls the flush until the send deadline fails it
+    {
+        int sv[2];
+        CHECK(::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == 0);
+        int small = 4096;
+        ::setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &small, sizeof(small));
+        int64_t start = coro::clock_ms();  // before the loop reads its clock
+        LineReader in(sv[0], 4096);
+        OutQueue   out;
+        coro::EventLoop loop;
+        loop.set_stall_hook([](int64_t sessions, int64_t bytes) {
+            stall_gauge[0] += sessions;
+            stall_gauge[1] += bytes;
+        });
+        bool failed = false, done = false;
+        coro::Conn::Expired why = coro::Conn::Expired::No;
+        auto session = [&]() -> coro::Detached {
+            coro::Conn conn(loop, sv[0], in, out, 8 * 1024);
+            conn.set_deadlines(0, 50, 0);
+            for (int i = 0; i < 10000 && !failed; ++i) failed = !co_await conn.write(frame);
+            why  = conn.expired();
+            done = true;
+        };
+        session();  // runs until the socket is full
+        CHECK(!done);
+        CHECK(stall_gauge[0] == 1 && stall_gauge[1] > 0);
+        loop.run([&] { return done; });
+        CHECK(failed && why == coro::Conn::Expired::Send);
+        CHECK(coro::clock_ms() - start >= 50);
+        CHECK(stall_gauge[0] == 0 && stall_gauge[1] == 0);
+        CHECK(out.size() > 0);  // the unsent rest stays queued
+        ::close(sv[0]);
+        ::close(sv[1]);
+    }
+}
+
+/* Run one read_line() on a silent client under the given deadlines; return why it gave up. */
+static coro::Conn::Expired silent_client(int64_t read_ms, int64_t lifetime_ms) {
+    int sv[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) != 0) return coro::Conn::Expired::No;
+    LineReader in(sv[0], 4096);
+    OutQueue   out;
+    coro::EventLoop loop;
+    bool got = true, done = false;
+    coro::Conn::Expired why = coro::Conn::Expired::No;
+    auto session = [&]() -> coro::Detached {
+        coro::Conn conn(loop, sv[0], in, out);
+        conn.set_deadlines(read_ms, 0, lifetime_ms ? coro::clock_ms() + lifetime_ms : 0);
+        string_view line;
+        got  = co_await conn.read_line(line);
+        why  = conn.expired();
+        done = true;
+    };
+    session();
+    loop.run([&] { return done; });
+    CHECK(!got);
+    ::close(sv[0]);
+    ::close(sv[1]);
+    return why;
+}
+
+static void test_deadlines() {
+    cout << "[TEST] timer wheel and deadlines\n";
+
+    // Against a reference: every timer fires at the first advance() at or past its time, never before
+    {
+        TimerWheel wheel(1000);
+        mt19937_64 rng(7);
+        const size_t n = 5000;
+        vector<TimerWheel::Timer> timers(n);
+        vector<uint64_t> due(n, 0);     // 0: not armed
+        vector<uint64_t> fired_at(n, 0);
+        uint64_t now = 1000;
+        size_t   early = 0, late = 0, spurious = 0;
+        for (size_t i = 0; i < n; ++i) timers[i].owner = reinterpret_cast<void*>(i);
+        for (int round = 0; round < 4000; ++round) {
+            for (int k = 0; k < 8; ++k) {
+                size_t i = rng() % n;
+                uint64_t spans[] = {1, 300, 70000, 5000000, 1ULL << 33};  // every level, and past the horizon
+                uint64_t at = now + 1 + rng() % spans[rng() % 5];
+                if (rng() % 4 == 0) { wheel.cancel(timers[i]); due[i] = 0; }
+                else { wheel.arm(timers[i], at); due[i] = at; }
+            }
+            // A mix of small steps, jumps across many slots, and sleeping exactly until next_event()
+            uint64_t next = wheel.next_event();
+            uint64_t step = rng() % 200 == 0 ? rng() % (1ULL << 34)
+                          : rng() % 3 == 0 ? rng() % 5 : rng() % 3 == 0 ? rng() % 100000 : 0;
+            uint64_t to   = step ? now + step : (next == TimerWheel::kNever ? now + 1 : max(next, now));
+            for (size_t i = 0; i < n; ++i) {
+                if (due[i] && due[i] < next) ++early;  // next_event() must not be later than any expiry
+            }
+            wheel.advance(to, [&](TimerWheel::Timer& t) {
+                size_t i = reinterpret_cast<size_t>(t.owner);
+                if (!due[i]) ++spurious;
+                else if (due[i] > to) ++early;
+                else if (due[i] <= now) ++late;
+                due[i] = 0;
+                fired_at[i] = to;
+                if (i % 7 == 0) { wheel.arm(timers[i], to + 10); due[i] = to + 10; }  // re-arm from the handler
+                if (i % 5 == 0) { size_t j = (i + 1) % n; wheel.cancel(timers[j]); due[j] = 0; }
+            });
+            now = to;
+            for (size_t i = 0; i < n; ++i) {
+                if (due[i] && due[i] <= now) ++late;  // should have fired
+                if (due[i] && due[i] <= now) due[i] = 0;
+            }
+        }
+        size_t armed = 0;
+        for (size_t i = 0; i < n; ++i) armed += due[i] != 0;
+        CHECK(early == 0 && late == 0 && spurious == 0);
+        CHECK(wheel.size() == armed);
+        for (auto& t : timers) wheel.cancel(t);
+        CHECK(wheel.size() == 0 && wheel.next_event() == TimerWheel::kNever && wheel.timeout(now) == -1);
+    }
+
+    // A million timers: arming and cancelling stay cheap, and nothing is walked while time passes
+    {
+        TimerWheel wheel(0);
+        vector<TimerWheel::Timer> timers(1000000);
+        auto t0 = chrono::steady_clock::now();
+        for (size_t i = 0; i < timers.size(); ++i) wheel.arm(timers[i], 60000 + i % 4096);
+        for (size_t i = 0; i < timers.size(); i += 2) wheel.cancel(timers[i]);
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+        CHECK(wheel.size() == 500000);
+        CHECK(wheel.next_event() <= 60000 + 1);
+        size_t fired = 0;
+        wheel.advance(59999, [&](TimerWheel::Timer&) { ++fired; });
+        CHECK(fired == 0);
+        wheel.advance(70000, [&](TimerWheel::Timer&) { ++fired; });
+        CHECK(fired == 500000 && wheel.size() == 0);
+        cout << "  1M arms + 500k cancels: " << ms << " ms\n";
+    }
+
+    // Coroutine waits give up at their deadline, and say which one
+    CHECK(silent_client(30, 0) == coro::Conn::Expired::Read);
+    CHECK(silent_client(60000, 30) == coro::Conn::Expired::Lifetime);
+}
+
+static void test_ip_limiter() {
+    cout << "[TEST] per-address limits\n";
+    using V = IpLimiter::Verdict;
+    const uint32_t a = 0x0a000001, b = 0x0a000002;
+
+    // 10 per second in bursts of 3: three at once, then one every 100 ms; addresses don't share a bucket
+    {
+        IpLimiter lim;
+        lim.configure(10, 3, 0, 1000);
+        int64_t t = 5000000;
+        for (int i = 0; i < 3; ++i) CHECK(lim.admit(a, t) == V::Ok);
+        CHECK(lim.admit(a, t) == V::TooFast);
+        CHECK(lim.admit(b, t) == V::Ok);
+        CHECK(lim.admit(a, t + 99999) == V::TooFast);
+        CHECK(lim.admit(a, t + 100000) == V::Ok);
+        CHECK(lim.admit(a, t + 100000) == V::TooFast);
+        CHECK(lim.admit(a, t + 400000) == V::Ok);  // refilled three tokens, at most the burst
+        CHECK(lim.admit(a, t + 400000) == V::Ok);
+        CHECK(lim.admit(a, t + 400000) == V::Ok);
+        CHECK(lim.admit(a, t + 400000) == V::TooFast);
+        CHECK(lim.admit(0, t) == V::Ok);  // no address, no limit
+    }
+
+    // At most 3 open per address, however the admits and releases interleave across threads
+    {
+        IpLimiter lim;
+        lim.configure(0, 0, 3, 1000);
+        atomic<int> open[4] = {}, most{0};
+        vector<thread> ths;
+        for (int t = 0; t < 8; ++t) {
+            ths.emplace_back([&, t] {
+                for (int i = 0; i < 20000; ++i) {
+                    int k = (i + t) % 4;
+                    if (lim.admit(0x0a000100 + k, 0) != V::Ok) continue;
+                    int n = open[k].fetch_add(1) + 1;
+                    for (int seen = most.load(); n > seen && !most.compare_exchange_weak(seen, n);) {}
+                    open[k].fetch_sub(1);
+                    lim.release(0x0a000100 + k);
+                }
+            });
+        }
+        for (auto& th : ths) th.join();
+        CHECK(most.load() <= 3);
+        for (uint32_t k = 0; k < 4; ++k) {  // every count came back to zero
+            for (int i = 0; i < 3; ++i) CHECK(lim.admit(0x0a000100 + k, 0) == V::Ok);
+            CHECK(lim.admit(0x0a000100 + k, 0) == V::TooMany);
+        }
+    }
+
+    // Lazy expiry: addresses that left make room for new ones; a table of live ones fails open
+    {
+        IpLimiter lim;
+        lim.configure(1, 1, 2, 1);  // the smallest table: 16 shards of 64 slots
+        int64_t t = 1000000;
+        for (uint32_t ip = 1; ip <= 20000; ++ip) {
+            CHECK(lim.admit(ip, t) == V::Ok);
+            lim.release(ip);
+            t += 1000000;  // each bucket is full again by the next address
+        }
+        CHECK(lim.tracked() <= 16 * 64);
+        CHECK(lim.admit(20000, t) == V::Ok && lim.admit(20000, t) == V::TooFast);  // still tracked
+        size_t refused = 0;
+        for (uint32_t ip = 100000; ip < 110000; ++ip) refused += lim.admit(ip, t) != V::Ok;  // never released
+        CHECK(refused == 0);
+        CHECK(lim.tracked() == 16 * 64);
+    }
+}
+
+static void test_compact_session() {
+    cout << "[TEST] compact idle sessions\n";
+    // Resident per idle session: the session plus its slot in the reactor's fd table
+    CHECK(sizeof(ClientSession) + sizeof(unique_ptr<ClientSession>) < 256);
+    CHECK(sizeof(Pcg32) == 8 && sizeof(JokePicker) == 32 && sizeof(OutQueue) == 32 && sizeof(LineReader) == 32);
+
+    // The reader holds a buffer only while bytes are waiting in it
+    int sv[2];
+    CHECK(::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == 0);
+    LineReader in(sv[0], 8192);
+    string_view line;
+    CHECK(in.capacity() == 0 && in.fill() < 0 && errno == EAGAIN && in.capacity() == 0);
+    CHECK(::write(sv[1], "Who's th", 8) == 8);
+    CHECK(in.fill() == 8 && !in.next_line(line) && in.capacity() == LineReader::kChunk);  // half a line: kept
+    CHECK(::write(sv[1], "ere?\nN\n", 7) == 7);
+    CHECK(in.fill() == 7 && in.next_line(line) && line == "Who's there?");
+    CHECK(in.next_line(line) && line == "N");
+    CHECK(!in.next_line(line) && in.capacity() == 0);
+    // A line trickling in a byte at a time stays in its one chunk (no allocation per read)
+    long before = allocations.load();
+    bool one_chunk = true;
+    for (char c : string_view("Who's there?\n")) {
+        CHECK(::write(sv[1], &c, 1) == 1);
+        one_chunk &= in.fill() == 1 && in.capacity() == LineReader::kChunk;
+    }
+    CHECK(one_chunk && allocations.load() == before);
+    CHECK(in.next_line(line) && line == "Who's there?");
+    CHECK(!in.next_line(line) && in.capacity() == 0);
+    string longer(6000, 'x');  // more than a chunk: a heap buffer, then back to nothing
+    in.feed(longer.data(), longer.size());
+    in.feed("\n", 1);
+    CHECK(in.capacity() > LineReader::kChunk && in.next_line(line) && line == longer);
+    CHECK(!in.next_line(line) && in.capacity() == 0);
+    ::close(sv[0]);
+    ::close(sv[1]);
+
+    // A session that answered and waits again keeps no buffers (nothing left to allocate into)
+    auto snap = make_shared<Catalog>(make_catalog());
+    auto* s = new ClientSession();
+    s->rng.seed(6);
+    adopt_catalog(s, snap);
+    start_joke(s);
+    s->in.feed("Who's there?\n", 13);
+    while (s->in.next_line(line)) on_client_line(s, line);
+    CHECK(s->outbuf.size() > 0);
+    s->outbuf.consume(s->outbuf.size());
+    CHECK(s->outbuf.empty() && s->in.capacity() == 0 && s->state == SessionState::AwaitSetupWho);
+    delete s;
+
+    // The slab: distinct objects, LIFO reuse, objects freed on other threads come back
+    struct alignas(8) Obj { char bytes[48]; };
+    void* a = Slab<Obj>::get();
+    Slab<Obj>::put(a);
+    CHECK(Slab<Obj>::get() == a);
+    Slab<Obj>::put(a);
+    vector<void*> mine(5000);
+    for (auto& p : mine) p = Slab<Obj>::get();
+    set<void*> distinct(mine.begin(), mine.end());
+    CHECK(distinct.size() == mine.size());
+    size_t carved = Slab<Obj>::reserved();
+    CHECK(carved >= mine.size() && carved < mine.size() + 2 * 65536 / sizeof(Obj));
+    thread([&] { for (void* p : mine) Slab<Obj>::put(p); }).join();  // its cache goes back at thread exit
+    for (auto& p : mine) p = Slab<Obj>::get();
+    CHECK(Slab<Obj>::reserved() == carved);  // all reused, nothing new carved
+    for (void* p : mine) Slab<Obj>::put(p);
+}
+
+/* Everything written to `fd` until the writer closes it, read on a thread of its own. */
+struct Drain {
+    explicit Drain(int fd) : t([this, fd] {
+        char buf[65536];
+        ssize_t n;
+        while ((n = ::read(fd, buf, sizeof(buf))) > 0) text.append(buf, static_cast<size_t>(n));
+        ::close(fd);
+    }) {}
+    string text;
+    thread t;
+};
+
+static void test_async_log() {
+    cout << "[TEST] asynchronous log\n";
+    string out;
+    sockaddr_in a{};
+    a.sin_addr.s_addr = htonl(0x0a000102);
+    a.sin_port        = htons(54321);
+    uint64_t args[] = {AsyncLog::addr(a), static_cast<uint64_t>(int64_t{-7}), 42, EPIPE,
+                       reinterpret_cast<uintptr_t>("accept4")};
+    AsyncLog::render(out, "from %a: %d%% %u %e %s %q\n", args, 5);
+    CHECK(out == string("from 10.0.1.2:54321: -7% 42 ") + strerror(EPIPE) + " accept4 %q\n");
+
+    // Lines from four threads: all of them, each thread's in order; then one after a join comes last
+    {
+        int p[2];
+        CHECK(::pipe(p) == 0);
+        Drain drain(p[0]);
+        AsyncLog log;
+        log.start(p[1], p[1]);
+        vector<thread> ths;
+        for (unsigned t = 0; t < 4; ++t) {
+            ths.emplace_back([&log, t] {
+                for (unsigned i = 0; i < 1000; ++i) log.write(LogLevel::Info, "t%u %u\n", t, i);
+            });
+        }
+        for (auto& th : ths) th.join();
+        log.text(LogLevel::Info, "last\n");
+        log.set_level(LogLevel::Warn);
+        log.write(LogLevel::Info, "filtered\n");
+        log.write(LogLevel::Warn, "warned\n");
+        log.stop();
+        ::close(p[1]);
+        drain.t.join();
+
+        unsigned next[4] = {}, lines = 0;
+        bool in_order = true;
+        for (size_t at = 0, nl; (nl = drain.text.find('\n', at)) != string::npos; at = nl + 1, ++lines) {
+            unsigned t, i;
+            if (sscanf(drain.text.c_str() + at, "t%u %u", &t, &i) != 2) continue;
+            in_order &= t < 4 && i == next[t]++;
+        }
+        CHECK(in_order && next[0] == 1000 && next[1] == 1000 && next[2] == 1000 && next[3] == 1000);
+        CHECK(lines == 4002 && log.dropped() == 0);
+        CHECK(drain.text.size() > 13 && drain.text.compare(drain.text.size() - 12, 12, "last\nwarned\n") == 0);
+    }
+
+    // A thread per line, one after another (like --mode=threads): they reuse drained rings
+    {
+        int p[2];
+        CHECK(::pipe(p) == 0);
+        Drain drain(p[0]);
+        AsyncLog log;
+        log.start(p[1], p[1]);
+        for (unsigned t = 0; t < 200; ++t) {
+            thread([&log, t] { log.write(LogLevel::Info, "thread %u\n", t); }).join();
+            this_thread::sleep_for(chrono::milliseconds(1));  // let the flusher drain the ring
+        }
+        size_t rings = log.rings();
+        log.stop();
+        ::close(p[1]);
+        drain.t.join();
+        CHECK(rings < 2 * AsyncLog::kSpareRings);
+        CHECK(count(drain.text.begin(), drain.text.end(), '\n') == 200);
+    }
+
+    // Nobody reads the output: the flusher blocks in writev, the logging thread does not
+    {
+        int p[2];
+        CHECK(::pipe(p) == 0);
+        AsyncLog log;
+        log.start(p[1], p[1]);
+        const unsigned total = 100000;
+        auto t0 = chrono::steady_clock::now();
+        for (unsigned i = 0; i < total; ++i) log.write(LogLevel::Info, "line %u of a log nobody is reading yet\n", i);
+        CHECK(chrono::steady_clock::now() - t0 < chrono::seconds(2));
+        uint64_t dropped = log.dropped();
+        CHECK(dropped > 0);
+
+        Drain drain(p[0]);
+        log.stop();
+        ::close(p[1]);
+        drain.t.join();
+        unsigned lines = 0, reported = 0, last = 0;
+        bool in_order = true;
+        for (size_t at = 0, nl; (nl = drain.text.find('\n', at)) != string::npos; at = nl + 1) {
+            unsigned v;
+            if (sscanf(drain.text.c_str() + at, "line %u", &v) == 1) {
+                in_order &= lines == 0 || v > last;
+                last = v;
+                ++lines;
+            } else if (sscanf(drain.text.c_str() + at, "Log: %u messages dropped", &v) == 1) {
+                reported += v;
+            }
+        }
+        CHECK(in_order && reported == dropped && lines + dropped == total);
+    }
+}
+
+static void test_protocol_counters() {
+    cout << "[TEST] protocol counters\n";
+    Catalog jokes = make_catalog();
+    ProtocolCounters& pc = protocol_counters;
+    int64_t told0 = pc.jokes_told.load(), who0 = pc.whos_there_fixes.load();
+    int64_t setup0 = pc.setup_who_fixes.load(), yn0 = pc.yes_no_reprompts.load();
+
+    // Per session: 1 wrong "Who's there?", 1 wrong "<setup> who?", 2 bad Y/N replies, 2 jokes (1 of them batched)
+    const int kThreads = 4, kSessions = 50;
+    vector<thread> threads;
+    for (int t = 0; t < kThreads; ++t) {
+        threads.emplace_back([&, t] {
+            set_counter_shard(static_cast<unsigned>(t + 1));
+            for (int i = 0; i < kSessions; ++i) {
+                ClientSession s;
+                s.catalog = &jokes;
+                s.rng.seed(static_cast<uint64_t>(t * kSessions + i));
+                start_joke(&s);
+                reply(s, "who?");
+                reply(s, "who's there?");
+                reply(s, "nope");
+                reply(s, "who's there?");
+                reply(s, string(jokes[s.joke].setup) + " who?");
+                reply(s, "maybe");
+                reply(s, "batch 0");
+                reply(s, "batch 1");
+            }
+        });
+    }
+    for (auto& th : threads) th.join();
+    const int64_t n = kThreads * kSessions;
+    CHECK(pc.jokes_told.load() - told0 == 2 * n);
+    CHECK(pc.whos_there_fixes.load() - who0 == n);
+    CHECK(pc.setup_who_fixes.load() - setup0 == n);
+    CHECK(pc.yes_no_reprompts.load() - yn0 == 2 * n);
+}
+
+static void test_latency() {
+    cout << "[TEST] latency histograms\n";
+    using latency::Histogram;
+    // Buckets: contiguous, and each holds its values at 1/32 precision
+    bool contained = true, narrow = true;
+    for (unsigned b = 1; b < Histogram::kBuckets; ++b) {
+        contained &= Histogram::bucket_start(b) == Histogram::bucket_start(b - 1) + Histogram::bucket_width(b - 1);
+    }
+    std::mt19937_64 rng(7);
+    for (int i = 0; i < 200000; ++i) {
+        uint64_t v = rng() >> (rng() % 64);
+        if (v >> Histogram::kMaxBits) continue;
+        unsigned b = Histogram::bucket(v);
+        contained &= Histogram::bucket_start(b) <= v && v < Histogram::bucket_start(b) + Histogram::bucket_width(b);
+        narrow &= Histogram::bucket_width(b) == 1 || Histogram::bucket_width(b) * Histogram::kSub <= v;
+    }
+    CHECK(contained && narrow);
+    CHECK(Histogram::bucket(uint64_t{1} << 60) == Histogram::kBuckets - 1);
+
+    // Values 1..100000 spread over four threads' slots: the merged percentiles are the true ones within 1/32
+    static Histogram h;
+    CHECK(h.summary(1.0).count == 0);
+    vector<thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([t] {
+            set_counter_shard(static_cast<unsigned>(t + 1));
+            for (uint64_t v = static_cast<uint64_t>(t) + 1; v <= 100000; v += 4) h.record(v);
+        });
+    }
+    for (auto& th : threads) th.join();
+    latency::Summary sum = h.summary(1.0);
+    auto near = [](double got, double want) { return got >= want * (1 - 1.0 / 32) && got <= want * (1 + 1.0 / 32); };
+    CHECK(sum.count == 100000);
+    CHECK(near(sum.p50, 50000) && near(sum.p90, 90000) && near(sum.p99, 99000) && near(sum.p999, 99900));
+    CHECK(near(sum.max, 100000));
+    CHECK(h.summary(2.0).p50 == 2 * sum.p50);
+
+    // A session's 32-bit stamps measure across a wrap, to within one unit
+    const uint64_t unit = uint64_t{1} << latency::kStampShift;
+    const uint64_t wrap = uint64_t{1} << (32 + latency::kStampShift);
+    for (uint64_t from : {uint64_t{0}, wrap - 5 * unit - 3, 7 * wrap + 12345}) {
+        uint64_t d = latency::since(latency::stamp(from), from + 1000000);
+        CHECK(d <= 1000000 + unit && d + unit >= 1000000);
+    }
+
+    // A session times each step: one think and one reply per line, one joke per punchline, one first prompt
+    Catalog jokes = make_catalog();
+    ProtocolLatency& pl = protocol_latency;
+    uint64_t first0 = pl.first_knock.summary(1).count, think0 = pl.think.summary(1).count;
+    uint64_t reply0 = pl.reply.summary(1).count, joke0 = pl.joke.summary(1).count;
+    ClientSession s;
+    s.catalog = &jokes;
+    s.rng.seed(5);
+    start_joke(&s);
+    reply(s, "who's there?");
+    reply(s, string(jokes[s.joke].setup) + " who?");
+    reply(s, "y");
+    reply(s, "who's there?");
+    reply(s, "nope");
+    CHECK(pl.first_knock.summary(1).count - first0 == 1);
+    CHECK(pl.think.summary(1).count - think0 == 5);
+    CHECK(pl.reply.summary(1).count - reply0 == 5);
+    CHECK(pl.joke.summary(1).count - joke0 == 1);
+    uint64_t now = latency::now();
+    CHECK(latency::since(s.joke_at, now) >= latency::since(s.step_at, now));  // the last answer came after the knock
+}
+
+// --------------------------------- Main --------------------------------
+
+int main() {
+    test_frames();
+    test_zero_alloc();
+    test_selection();
+    test_reload();
+    test_compiled_catalog();
+    test_matcher();
+    test_counter();
+    test_uring();
+    test_db_loader();
+    test_coro();
+    test_pool();
+    test_out_queue();
+    test_backpressure();
+    test_deadlines();
+    test_ip_limiter();
+    test_compact_session();
+    test_async_log();
+    test_protocol_counters();
+    test_latency();
+
+    if (failures) {
+        cout << failures << " check(s) FAILED\n";
+        return 1;
+    }
+    cout << "ALL SELF-TESTS PASSED\n";
+    return 0;
+}
@@ -2,7 +2,8 @@
  * server.cpp
  * -----------
  * Multi-client knock-knock joke server with:
- *  - SQLite-backed "database" of jokes (table `jokes(setup, punchline)`).
+ *  - SQLite-backed "database" of jokes (table `jokes(setup, punchline)`), or a
+ *    compiled catalog file mapped straight into memory (catalog-compile).
  *  - Strict, case-insensitive-but-spelling-sensitive protocol:
  *      Server: "Knock knock! <input>"
  *      Client: "Who's there?"
@@ -12,349 +13,1160 @@
  *      Server: "Would you like to listen to another? (Y/N) <input>"
  *  - Robust error handling: if client says the wrong thing, the server explains
  *    what to say and restarts the joke from the beginning immediately.
- *  - Parallel clients (pthreads).
+ *  - Pipelining: a client that opens with "PIPELINE" may send replies ahead
+ *    of the prompts; they are checked in order and answered in one write.
+ *  - Parallel clients: one pthread per client (default), or a single-threaded
+ *    epoll reactor driving every connection as a non-blocking state machine
+ *    (`--mode=epoll`), or one such reactor per core, each with its own
+ *    SO_REUSEPORT listener and pinned to its CPU (`--mode=sharded`), or an
+ *    io_uring completion loop (`--mode=uring`, falls back to epoll), or one
+ *    C++20 coroutine per client on a few event-loop threads (`--mode=coro`),
+ *    or session steps as jobs on a work-stealing worker pool (`--mode=pool`).
+ *  - Backpressure: output queued per connection is bounded, clients that stop
+ *    reading are evicted after a send deadline, and new connections are shed
+ *    while the process is over its memory cap.
+ *  - Admission control: at most --max-clients sessions at once; a client over
+ *    the limit is told the server is busy before any session exists, or waits
+ *    in a short queue (--queue) with its place and an estimated wait. Each
+ *    source address may also be held to a connection rate and a number of
+ *    open connections (--ip-rate, --ip-max-conns).
+ *  - Deadlines: a client must send each line within a read deadline, and a
+ *    session ends at a lifetime limit; the event loops keep these (and the
+ *    send deadline) in a timer wheel and sleep until the next one is due.
  *  - Graceful termination: when active_clients == 0 for 10 seconds, the server exits.
+ *  - Hot reload: SIGHUP or a change to the database publishes a new catalog
+ *    snapshot; sessions switch at their next joke without repeating one.
+ *  - Logging: sessions hand binary records to per-thread rings and one thread
+ *    formats and writes them (async_log.h), so logging never blocks a client.
+ *  - Metrics: --admin-port serves per-thread sharded counters (connections,
+ *    jokes, corrections, bytes, catalog) in the Prometheus text format, and
+ *    percentiles of per-thread latency histograms for each protocol step.
  *
  * Build:
- *   g++ -std=c++17 -Wall -Wextra -O2 -pthread server.cpp -lsqlite3 -o server
+ *   g++ -std=c++20 -Wall -Wextra -O2 -pthread server.cpp -lsqlite3 -o server
+ *
+ * Usage:
+ *   ./server [--mode=threads|epoll|sharded|uring|coro|pool] [--reactors=N] [--workers=N] [--select=bitset|feistel] [--port=N] [--db=PATH]
+ *            [--catalog=FILE]   (FILE from ./catalog-compile; served via mmap)
+ *            [--load-threads=N] (parallel SQLite loader connections; default: cores, max 8)
+ *            [--max-output=BYTES] (per-connection output budget; default 256 KiB)
+ *            [--send-timeout=S]   (evict clients that leave output untaken this long; default 30, 0: never)
+ *            [--read-timeout=S]   (disconnect clients that take longer to send a line; default 60, 0: never)
+ *            [--max-session=S]    (end every session after this long; default 3600, 0: no limit)
+ *            [--max-memory=MB]    (shed new connections above this resident size; default 3/4 of RAM, 0: no cap)
+ *            [--max-clients=N]    (concurrent sessions; default 1024 with --mode=threads, else 0: no limit)
+ *            [--queue=N]          (clients over the limit that may wait for a slot; default 0)
+ *            [--ip-rate=R] [--ip-burst=B] (new connections per second per address, in bursts of B; default 0: no limit)
+ *            [--ip-max-conns=N]   (open connections per address; default 0: no cap)
+ *            [--seed=N]           (seed for every session's joke order, for reproducible runs; default: random)
+ *            [--log-level=L]      (error|warn|info|debug; default info)
+ *            [--log-sample=N]     (log 1 in N connects and disconnects; default 1: all)
+ *            [--admin-port=N]     (Prometheus metrics on 127.0.0.1:N/metrics; default off)
+ *   kill -HUP <pid>   -> reload the jokes (also happens when the database file changes)
+ *   kill -USR1 <pid>  -> print client, output-queue, eviction, timeout, admission and shedding counters
+ *   curl localhost:N/metrics -> the same and more (jokes, corrections, bytes, catalog) with --admin-port=N
+ *   curl localhost:N/latency -> p50/p90/p99/p99.9 of each protocol step (accept to first prompt, think, reply, joke)
  */
 
-#include <sqlite3.h>
+#include "async_log.h"
+#include "catalog_db.h"
+#include "counters.h"
+#include "ip_limiter.h"
+#include "pool.h"
+#include "session.h"
+#include "timer_wheel.h"
+#include "uring.h"
 
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <sys/poll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
 #include <atomic>
+#include <cerrno>
 #include <csignal>
 #include <algorithm>
 #include <cctype>
 #include <chrono>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <iostream>
+#include <sstream>
 #include <memory>
+#include <mutex>
 #include <random>
 #include <set>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <vector>
 
 using namespace std;
 
-constexpr int PORT        = 8079;  // server port
-constexpr int MAX_CLIENTS = 10;    // listen backlog & rough concurrency cap
+constexpr int PORT        = 8079;  // default server port
+constexpr int MAX_CLIENTS = 1024;  // default session limit for --mode=threads (a thread each)
 
-// ------------------------------ Joke model ------------------------------
+enum class ServerMode { Threads, Epoll, Sharded, Uring, Coro, Pool };
 
-struct Joke {
-    string setup;
-    string punchline;
+struct ServerConfig {
+    ServerMode mode    = ServerMode::Threads;
+    int        port    = PORT;
+    SelectMode select  = SelectMode::Bitset;  // per-session joke selector (selector.h)
+    string     db_path = "jokes.db";
+    string     catalog_path;              // compiled catalog to mmap instead of the database
+    unsigned   load_threads = default_load_threads();  // SQLite connections loading in parallel
+    unsigned   reactors = 0;              // --mode=sharded / --mode=coro event loops (0: one per CPU)
+    unsigned   workers  = 0;              // --mode=pool worker threads (0: one per CPU)
+    size_t     max_output   = 256 * 1024; // per-connection output budget, bytes
+    int        send_timeout = 30;         // seconds a client may leave output untaken (0: forever)
+    int        read_timeout = 60;         // seconds a client may take to send its next line (0: forever)
+    int        max_session  = 3600;       // seconds a session may last (0: no limit)
+    int64_t    max_memory   = -1;         // resident bytes before new clients are shed (0: no cap; -1: 3/4 of RAM)
+    int64_t    max_clients  = -1;         // concurrent sessions (0: no limit; -1: MAX_CLIENTS in threads mode, else none)
+    size_t     queue        = 0;          // clients over the limit that may wait for a session slot
+    double     ip_rate      = 0;          // new connections per second per source address (0: no limit)
+    unsigned   ip_burst     = 0;          // bucket size for ip_rate (0: one second's worth)
+    unsigned   ip_max_conns = 0;          // open connections per source address (0: no cap)
+    bool       fixed_seed   = false;      // --seed given: joke orders are reproducible
+    uint64_t   seed         = 0;          // startup seed the session seeds derive from
+    LogLevel   log_level    = LogLevel::Info;
+    unsigned   log_sample   = 1;          // log 1 in N connects and disconnects
+    int        admin_port   = 0;          // metrics on 127.0.0.1:admin_port (0: off)
 };
 
-// Global in-memory list populated from SQLite at startup
-static vector<Joke> jokes;
+static ServerConfig config;
+
+// ------------------------------ Joke model ------------------------------
+
+// Current catalog snapshot; frames are pre-rendered and snapshots are swapped on reload (see catalog.h)
+static CatalogStore catalog_store;
 
 /*
- * SQLite row callback: appends each (setup, punchline) row to `jokes`.
- * `data` and `azColName` are not needed here; explicitly mark them unused to
- * silence -Wunused-parameter warnings.
+ * One loop's (or thread's) handle on the newest snapshot, through a control
+ * block of its own: the store is read and its shared_ptr copied once per
+ * reload, and sessions copy this one. Otherwise it costs one atomic load of
+ * the version.
  */
-static int load_callback(void* /*unused*/,
-                         int argc,
-                         char** argv,
-                         char** /*unused*/) {
-    if (argc == 2) {
-        Joke j{argv[0] ? argv[0] : "", argv[1] ? argv[1] : ""};
-        jokes.push_back(std::move(j));
+class PinnedCatalog {
+public:
+    shared_ptr<const Catalog> get() {
+        if (!pinned_ || pinned_->version() != catalog_store.version()) {
+            auto pin = make_shared<shared_ptr<const Catalog>>(catalog_store.acquire());
+            pinned_  = shared_ptr<const Catalog>(pin, pin->get());
+        }
+        return pinned_;
     }
-    return 0;
+
+private:
+    shared_ptr<const Catalog> pinned_;
+};
+
+/* This thread's PinnedCatalog, for drivers that start sessions on several threads (threads, pool). */
+static shared_ptr<const Catalog> thread_catalog() {
+    thread_local PinnedCatalog pinned;
+    return pinned.get();
+}
+
+// Every session's joke order is seeded from this, in accept order (selector.h)
+static SeedSource session_seeds;
+
+/* One strong seed for the whole run, read once at startup. */
+static uint64_t startup_seed() {
+    random_device rd;
+    return (static_cast<uint64_t>(rd()) << 32) | rd();
+}
+
+// ------------------------------- Globals --------------------------------
+
+static vector<int>  listen_fds;        // one, or one per event loop in --mode=sharded / --mode=coro
+static atomic<bool> server_running{true};
+static ShardedCounter active_clients;  // each reactor bumps its own slot (counters.h)
+static ShardedCounter bytes_received;  // from clients, by every driver (for the metrics endpoint)
+static ShardedCounter bytes_sent;      // to clients
+static AsyncLog       logger;          // every message after startup goes through here (async_log.h)
+
+/* perror() through the logger; `what` must be a string literal. */
+static void log_errno(const char* what) {
+    logger.write(LogLevel::Error, "%s: %e\n", what, errno);
 }
 
+/* Whether the next of a thread's connect (or disconnect) lines is one of the 1 in --log-sample logged. */
+static bool log_sampled(unsigned& seen) {
+    return config.log_sample <= 1 || seen++ % config.log_sample == 0;
+}
+
+// ----------------------------- I/O utilities ----------------------------
+
 /*
- * Load jokes from `filename` into global `jokes`.
- * Table schema: CREATE TABLE jokes (id INTEGER PRIMARY KEY, setup TEXT, punchline TEXT);
+ * Every turn already leaves in one write (out_queue.h), so Nagle has nothing
+ * left to merge and could only hold a turn back behind an unacknowledged one.
  */
-static void load_jokes_from_db(const string& filename) {
-    sqlite3* db = nullptr;
-    if (sqlite3_open(filename.c_str(), &db)) {
-        cerr << "Can't open database: " << sqlite3_errmsg(db) << "\n";
-        sqlite3_close(db);
-        return;
-    }
+static void tune_socket(int fd) {
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// ----------------------------- Backpressure -----------------------------
+
+/*
+ * Output is bounded per connection and in total:
+ *
+ *   - a byte budget (--max-output): drivers answer lines a client sent ahead
+ *     only while less than this is queued for it. Past the budget they flush
+ *     and stop reading until the client takes its output, so a client that
+ *     pipelines requests but never reads cannot make the server queue more;
+ *   - a send deadline (--send-timeout): a client that leaves output untaken
+ *     for that long is evicted. Blocking sockets enforce it with SO_SNDTIMEO,
+ *     the event loops with a timer per session (see Deadlines below);
+ *   - a memory cap (--max-memory): while the resident set is above it, new
+ *     connections get a one-line "busy" reply and are closed before any
+ *     session is created.
+ *
+ * The gauges below move as sessions stall and recover; SIGUSR1 prints them.
+ */
+static ShardedCounter stalled_sessions;  // sessions waiting for the client to take output
+static ShardedCounter stalled_bytes;     // output those sessions held when they stalled
+static ShardedCounter evicted_clients;   // slow readers disconnected at the send deadline
+static ShardedCounter shed_clients;      // connections turned away over the memory cap
+static atomic<int64_t> deepest_queue{0}; // largest output queue seen stalled, bytes
+
+static int64_t now_ms() {
+    return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool past_send_deadline(int64_t stalled_since, int64_t now) {
+    return config.send_timeout > 0 && stalled_since != 0 && now - stalled_since >= config.send_timeout * 1000LL;
+}
+
+static void note_queue_depth(int64_t bytes) {
+    int64_t seen = deepest_queue.load(memory_order_relaxed);
+    while (bytes > seen && !deepest_queue.compare_exchange_weak(seen, bytes, memory_order_relaxed)) {}
+}
+
+static void count_io(int64_t received, int64_t sent) {
+    bytes_received.add(received);
+    bytes_sent.add(sent);
+}
+
+static void count_stall(int64_t sessions, int64_t bytes) {
+    stalled_sessions.add(sessions);
+    stalled_bytes.add(bytes);
+    if (sessions > 0) note_queue_depth(bytes);
+}
 
-    const char* sql = "SELECT setup, punchline FROM jokes;";
-    char* errmsg = nullptr;
-    if (sqlite3_exec(db, sql, load_callback, nullptr, &errmsg) != SQLITE_OK) {
-        cerr << "SQL error: " << (errmsg ? errmsg : "unknown") << "\n";
-        sqlite3_free(errmsg);
+/* The session's client stopped taking output, or caught up again: keep `stalled_since` and the gauges. */
+static void note_stall(ClientSession* session, bool stalled, int64_t now) {
+    if (stalled == (session->stalled_since != 0)) return;
+    if (stalled) {
+        session->stalled_since = now;
+        session->stall_bytes   = static_cast<uint32_t>(session->outbuf.size());
+        count_stall(1, static_cast<int64_t>(session->stall_bytes));
+    } else {
+        count_stall(-1, -static_cast<int64_t>(session->stall_bytes));
+        session->stalled_since = 0;
+        session->stall_bytes   = 0;
     }
+}
 
-    sqlite3_close(db);
+/* Resident set size in bytes (0 if /proc is unavailable). */
+static int64_t resident_bytes() {
+    int fd = ::open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    char buf[128];
+    ssize_t n = ::read(fd, buf, sizeof(buf) - 1);
+    ::close(fd);
+    if (n <= 0) return 0;
+    buf[n] = '\0';
+    long long size = 0, resident = 0;
+    if (sscanf(buf, "%lld %lld", &size, &resident) != 2) return 0;
+    return resident * ::sysconf(_SC_PAGESIZE);
 }
 
-// --------------------------- Per-client session -------------------------
+/*
+ * Whether the process is over --max-memory. The resident size is sampled at
+ * most every 100 ms, by whichever accept gets there first.
+ */
+static bool over_memory_cap() {
+    static atomic<int64_t> next_sample{0};
+    static atomic<bool>    over{false};
+    if (config.max_memory <= 0) return false;
+    int64_t now = now_ms();
+    int64_t due = next_sample.load(memory_order_relaxed);
+    if (now >= due && next_sample.compare_exchange_strong(due, now + 100, memory_order_relaxed)) {
+        bool was = over.load(memory_order_relaxed);
+        bool is  = resident_bytes() >= config.max_memory;
+        over.store(is, memory_order_relaxed);
+        if (is != was) logger.write(LogLevel::Warn, is ? "Memory cap reached; turning new clients away.\n" : "Memory back under the cap.\n");
+    }
+    return over.load(memory_order_relaxed);
+}
 
-struct ClientSession {
-    int fd = -1;                     // connected socket
-    set<size_t> told_jokes;          // joke indices already told to this client
-    mt19937 rng;                     // RNG for random joke order
-    sockaddr_in client_addr{};       // for logging
-};
+/* Tell a client without a session why it is turned away, and hang up. */
+static void turn_away(int fd, string_view why) {
+    [[maybe_unused]] ssize_t n = ::send(fd, why.data(), why.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    ::close(fd);
+}
 
-// ------------------------------- Globals --------------------------------
+static void send_busy(int fd) { turn_away(fd, "Server busy, please try again later.\n"); }
 
-static int listen_fd = -1;
-static atomic<bool> server_running{true};
-static atomic<int>  active_clients{0};
+/* Turn a just-accepted connection away (over the memory cap) without creating a session. */
+static void shed_client(int fd) {
+    send_busy(fd);
+    shed_clients.inc();
+}
 
-// ----------------------------- I/O utilities ----------------------------
+/*
+ * Send everything queued on a blocking socket, one sendmsg() per turn in the
+ * common case. With a send deadline the socket has SO_SNDTIMEO set to it, so
+ * a send comes back short (or with EAGAIN) when the client stops reading;
+ * once output has been stuck for the whole deadline, gives up with
+ * `timed_out` set.
+ */
+static bool send_all(int fd, OutQueue& out, bool& timed_out) {
+    int64_t stalled = 0;  // when the client first fell behind in this turn
+    int64_t counted = 0;  // bytes this call added to stalled_bytes
+    bool    ok      = true;
+    timed_out = false;
+    while (ok && !out.empty()) {
+        ssize_t n = out.send_some(fd);
+        if (n < 0 && errno == EINTR) continue;
+        if (n > 0) bytes_sent.add(n);
+        bool behind = (n > 0 && !out.empty()) || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+        if (!behind) { ok = n > 0; continue; }
 
-/* Send a full line ending with '\n' (appends newline if missing). */
-static bool send_line(int fd, const string& s) {
-    string out = s;
-    if (out.empty() || out.back() != '\n') out.push_back('\n');
-    const char* p = out.data();
-    size_t left = out.size();
-    while (left) {
-        ssize_t n = ::send(fd, p, left, 0);
-        if (n < 0) { if (errno == EINTR) continue; return false; }
-        if (n == 0) return false;
-        p += n; left -= static_cast<size_t>(n);
+        int64_t now = now_ms();
+        if (!stalled) { stalled = now; stalled_sessions.inc(); }
+        stalled_bytes.add(static_cast<int64_t>(out.size()) - counted);
+        counted = static_cast<int64_t>(out.size());
+        note_queue_depth(counted);
+        if (past_send_deadline(stalled, now)) {
+            ok        = false;
+            timed_out = true;
+        }
     }
-    return true;
+    if (stalled) { stalled_sessions.dec(); stalled_bytes.add(-counted); }
+    return ok;
 }
 
-/* Receive exactly one line (up to '\n'); strips '\r'. Returns false on EOF/error. */
-static bool recv_line(int fd, string& line) {
-    line.clear();
-    char ch;
-    while (true) {
-        ssize_t n = ::recv(fd, &ch, 1, 0);
-        if (n <= 0) return false;  // EOF/timeout/error
-        if (ch == '\r') continue;
-        if (ch == '\n') break;
-        line.push_back(ch);
-        if (line.size() > 4096) break;  // safety guard
+/*
+ * Answer buffered client lines while the session has room under its output
+ * budget. Returns whether it answered any (the session took a step).
+ */
+static bool answer_lines(ClientSession* session) {
+    string_view line;
+    bool stepped = false;
+    while (session->state != SessionState::Closing && session->outbuf.size() < config.max_output &&
+           session->in.next_line(line)) {
+        on_client_line(session, line);
+        stepped = true;
     }
-    return true;
+    return stepped;
+}
+
+// ------------------------------- Deadlines ------------------------------
+
+/*
+ * Every wait on a client has a deadline: its next line within --read-timeout
+ * of the last step, output it stopped taking within --send-timeout, and all
+ * of it within --max-session of connecting. The event loops keep one timer
+ * per session in a TimerWheel (timer_wheel.h) armed for whichever of these
+ * comes first, re-armed only when the session takes a step or stalls, so a
+ * busy loop pays a few pointer writes per step and an idle one sleeps until
+ * the next deadline instead of ticking. The thread-per-client driver uses
+ * SO_RCVTIMEO and SO_SNDTIMEO instead.
+ */
+static ShardedCounter timed_out_clients;  // read deadline or lifetime limit reached
+
+static int64_t session_end(int64_t now) {
+    return config.max_session > 0 ? now + config.max_session * 1000LL : 0;
+}
+
+/*
+ * When the session's current wait ends (steady ms; 0: never): the send
+ * deadline while it is stalled, the read deadline counted from `now`
+ * otherwise, and never later than its lifetime limit.
+ */
+static int64_t session_deadline(const ClientSession* session, int64_t now) {
+    int64_t at = 0;
+    if (session->stalled_since) {
+        if (config.send_timeout > 0) at = session->stalled_since + config.send_timeout * 1000LL;
+    } else if (config.read_timeout > 0) {
+        at = now + config.read_timeout * 1000LL;
+    }
+    if (session->ends_at && (at == 0 || session->ends_at < at)) at = session->ends_at;
+    return at;
+}
+
+/* Connection bookkeeping shared by both drivers. */
+static void log_connect(const ClientSession* session) {
+    thread_local unsigned seen = 0;
+    if (log_sampled(seen)) logger.write(LogLevel::Info, "Client connected from %a\n", AsyncLog::addr(session->client_addr));
 }
 
-/* Trim leading/trailing whitespace. */
-static string trim(const string& s) {
-    size_t i = s.find_first_not_of(" \t\r\n");
-    if (i == string::npos) return "";
-    size_t j = s.find_last_not_of(" \t\r\n");
-    return s.substr(i, j - i + 1);
+static void log_eviction(const ClientSession* session, size_t unsent) {
+    logger.write(LogLevel::Info, "Evicting slow reader %a (%u bytes unsent for %ds).\n",
+                 AsyncLog::addr(session->client_addr), unsent, config.send_timeout);
+    evicted_clients.inc();
 }
 
-/* Lowercase a string (unsigned-safe). */
-static string lower(string s) {
-    for (char& c : s) c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
-    return s;
+/* A session's deadline passed: `lifetime` if it was the session limit, else the read deadline. */
+static void log_timeout(const ClientSession* session, bool lifetime) {
+    if (lifetime) {
+        logger.write(LogLevel::Info, "Client %a reached the %ds session limit; disconnecting.\n",
+                     AsyncLog::addr(session->client_addr), config.max_session);
+    } else {
+        logger.write(LogLevel::Info, "Client %a sent nothing for %ds; disconnecting.\n",
+                     AsyncLog::addr(session->client_addr), config.read_timeout);
+    }
+    timed_out_clients.inc();
 }
 
-/* Case-insensitive equality after trimming; spelling-sensitive (no fuzzy match). */
-static bool iequals(const string& a, const string& b) {
-    return lower(trim(a)) == lower(trim(b));
+/* Which deadline a session that ran out at `now` with `unsent` bytes still queued hit, logged and counted. */
+static void log_expiry(const ClientSession* session, int64_t now, size_t unsent) {
+    bool lifetime = session->ends_at && now >= session->ends_at;
+    if (!lifetime && unsent > 0) log_eviction(session, unsent);
+    else log_timeout(session, lifetime);
 }
 
-// --------------------------- Knock-knock logic --------------------------
+// ------------------------------- Admission ------------------------------
 
 /*
- * Drive exactly one *complete* knock-knock exchange.
- * Returns true if the joke completed; false if:
- *   - there are no more jokes for this client, OR
- *   - the connection failed during the exchange.
+ * At most --max-clients sessions run at once. A connection over the limit
+ * costs no session: it is told the server is busy and closed by the accept
+ * loop, or, with --queue=N, waits as a bare accepted socket in a short FIFO
+ * after a line with its place and an estimated wait (its place over the
+ * rate at which sessions have been ending).
+ *
+ * Before that, its source address must be within its own limits
+ * (--ip-rate/--ip-burst, --ip-max-conns; see ip_limiter.h), so one host
+ * opening sockets in a loop is turned away without taking a slot from
+ * anyone else. An address's count covers its sessions and its waiting
+ * connections.
+ *
+ * The permits are a ShardedLimit (counters.h), so admitting and releasing
+ * touch the calling thread's own slot. A session releases its permit in
+ * log_disconnect(); the driver that closed it then starts the waiting
+ * clients that fit (next_waiting()), and so does an accept loop right after
+ * queueing one, in case every session ended in between.
  */
-static bool play_joke(ClientSession* session) {
-    // Build list of jokes that haven't been told to this client
-    vector<size_t> avail;
-    avail.reserve(jokes.size());
-    for (size_t i = 0; i < jokes.size(); ++i) {
-        if (!session->told_jokes.count(i)) avail.push_back(i);
+static ShardedCounter accepted_clients; // every connection accepted, before admission decides
+static ShardedCounter busy_clients;    // turned away at the session limit (queue full or off)
+static ShardedCounter queued_clients;  // made to wait for a session slot
+static ShardedCounter limited_clients; // over their address's rate or connection cap
+
+static int64_t now_us() {
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint32_t source_ip(const sockaddr_in& addr) { return ntohl(addr.sin_addr.s_addr); }
+
+class Admission {
+public:
+    void configure(int64_t limit, size_t queue) {
+        permits_.set_limit(limit);
+        unsigned burst = config.ip_burst ? config.ip_burst : static_cast<unsigned>(max(1.0, config.ip_rate));
+        per_ip_.configure(config.ip_rate, burst, config.ip_max_conns, kAddresses);
+        max_queue_ = limit > 0 ? queue : 0;
+        rate_at_   = now_ms();
     }
+    int64_t limit() const { return permits_.limit(); }
+    size_t  waiting() const { return waiting_.load(memory_order_relaxed); }
 
-    if (avail.empty()) {
-        send_line(session->fd, "I have no more jokes to tell.");
-        return false;  // session ends
+    /*
+     * A client was just accepted: true to start its session now. Otherwise
+     * the connection was queued or turned away, and belongs to admission.
+     */
+    bool admit(int fd, const sockaddr_in& addr) {
+        accepted_clients.inc();
+        if (per_ip_.admit(source_ip(addr), now_us()) != IpLimiter::Verdict::Ok) {
+            turn_away(fd, "Too many connections from your address, please try again later.\n");
+            limited_clients.inc();
+            return false;
+        }
+        if (over_memory_cap()) {
+            shed_client(fd);
+            per_ip_.release(source_ip(addr));
+            return false;
+        }
+        if (permits_.acquire()) return true;
+        if (max_queue_ > 0) {
+            lock_guard<mutex> lk(m_);
+            if (queue_.size() < max_queue_) {
+                queue_.push_back({fd, addr});
+                waiting_.store(queue_.size(), memory_order_relaxed);
+                tell_place(fd, queue_.size());
+                queued_clients.inc();
+                return false;
+            }
+        }
+        send_busy(fd);
+        busy_clients.inc();
+        per_ip_.release(source_ip(addr));
+        return false;
     }
 
-    // Select a random unused joke
-    uniform_int_distribution<size_t> dist(0, avail.size() - 1);
-    size_t idx = avail[dist(session->rng)];
-    session->told_jokes.insert(idx);
+    /* A session ended. */
+    void release(const sockaddr_in& addr) {
+        permits_.release();
+        per_ip_.release(source_ip(addr));
+        ended_.inc();
+    }
 
-    const Joke& jk = jokes[idx];
-    const string expect1 = "Who's there?";
-    const string expect2 = jk.setup + " who?";
+    size_t addresses() const { return per_ip_.tracked(); }
 
-    // Step 1: "Knock knock!"
-    if (!send_line(session->fd, "Knock knock! <input>")) return false;
-    string resp;
-    while (true) {
-        if (!recv_line(session->fd, resp)) return false;
-        if (iequals(resp, expect1)) break;  // good
-        // incorrect -> explain and immediately restart from the beginning
-        if (!send_line(session->fd, "You are supposed to say, \"Who's there?\". Let's try again.")) return false;
-        if (!send_line(session->fd, "Knock knock! <input>")) return false;
+    /* A waiting client that now holds a permit: start its session. False if none (or none fits). */
+    bool next_waiting(int& fd, sockaddr_in& addr) {
+        if (waiting_.load(memory_order_relaxed) == 0 || !server_running.load()) return false;
+        if (!permits_.acquire()) return false;
+        {
+            lock_guard<mutex> lk(m_);
+            if (!queue_.empty()) {
+                fd   = queue_.front().fd;
+                addr = queue_.front().addr;
+                queue_.pop_front();
+                waiting_.store(queue_.size(), memory_order_relaxed);
+                return true;
+            }
+        }
+        permits_.release();
+        return false;
     }
 
-    // Step 2: send setup and expect "<setup> who?"
-    if (!send_line(session->fd, jk.setup + " <input>")) return false;
-    if (!recv_line(session->fd, resp)) return false;
-    if (!iequals(resp, expect2)) {
-        if (!send_line(session->fd, "You are supposed to say, \"" + expect2 + "\". Let's try again.")) return false;
-        // Restart the *same* joke from the top
-        return play_joke(session);
+    /* Shutting down: nobody still waiting will get a session. */
+    void turn_away_waiting() {
+        lock_guard<mutex> lk(m_);
+        for (const Waiting& w : queue_) {
+            send_busy(w.fd);
+            per_ip_.release(source_ip(w.addr));
+        }
+        queue_.clear();
+        waiting_.store(0, memory_order_relaxed);
     }
 
-    // Step 3: punchline
-    if (!send_line(session->fd, jk.punchline)) return false;
-    return true;
+private:
+    struct Waiting {
+        int         fd;
+        sockaddr_in addr;
+    };
+
+    /* Under m_: tell a queued client its place and roughly how long it will wait. */
+    void tell_place(int fd, size_t place) {
+        int64_t now = now_ms(), ended = ended_.load();
+        if (now - rate_at_ >= 1000) {  // sessions ended per second since the last sample
+            double rate = static_cast<double>(ended - rate_ended_) * 1000.0 / static_cast<double>(now - rate_at_);
+            per_sec_    = per_sec_ > 0 ? (per_sec_ + rate) / 2 : rate;
+            rate_at_    = now;
+            rate_ended_ = ended;
+        }
+        char line[128];
+        int  n;
+        if (per_sec_ > 0) {
+            double wait = static_cast<double>(place) / per_sec_;
+            n = snprintf(line, sizeof(line), "Server busy; you are number %zu in line, estimated wait %.0f s.\n", place,
+                         wait < 1 ? 1.0 : wait);
+        } else {
+            n = snprintf(line, sizeof(line), "Server busy; you are number %zu in line.\n", place);
+        }
+        [[maybe_unused]] ssize_t sent = ::send(fd, line, static_cast<size_t>(n), MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+
+    static constexpr size_t kAddresses = 65536;  // per-address table size
+
+    ShardedLimit   permits_;
+    IpLimiter      per_ip_;
+    ShardedCounter ended_;          // sessions released, for the wait estimate
+    size_t         max_queue_ = 0;
+    atomic<size_t> waiting_{0};     // queue_.size(), readable without the lock
+    mutex          m_;              // guards the rest
+    deque<Waiting> queue_;
+    int64_t        rate_at_    = 0; // last departure-rate sample
+    int64_t        rate_ended_ = 0;
+    double         per_sec_    = 0;
+};
+
+static Admission admission;
+
+// ----------------------------- Idle shutdown ----------------------------
+
+/*
+ * The 10 s idle rule, without a periodic check: every disconnect pushes the
+ * deadline to 10 s out (it is also armed once at startup), and the loop that
+ * runs the rule (the accept loop, reactor 0, coroutine loop 0, the pool's
+ * epoll thread, the io_uring loop) sleeps until it. A disconnect does not
+ * count the clients left; that would read every slot of active_clients. At
+ * the deadline the rule checks active_clients once and, if anyone is
+ * connected, just disarms. Arming a disarmed rule pokes an eventfd so a loop
+ * asleep on another thread recomputes its timeout.
+ */
+class IdleShutdown {
+public:
+    static constexpr int64_t kDelayMs = 10000;
+    static constexpr int64_t kSlackMs = 100;  // how often a stream of disconnects writes the deadline
+
+    bool open() {
+        fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        return fd_ >= 0;
+    }
+    int fd() const { return fd_; }
+
+    void arm() {
+        deadline_.store(now_ms() + kDelayMs, memory_order_relaxed);
+        poke();
+    }
+
+    /*
+     * A client left: make the deadline at least kDelayMs from now. Usually a
+     * relaxed read of a line no one writes; the deadline is moved (kSlackMs
+     * late, so this is rare) only when it is closer than the delay.
+     */
+    void client_left() {
+        int64_t now = now_ms();
+        int64_t at  = deadline();
+        if (at >= now + kDelayMs) return;
+        deadline_.store(now + kDelayMs + kSlackMs, memory_order_relaxed);
+        if (at == 0) poke();
+    }
+
+    /* Wake the watching loop (async-signal-safe). */
+    void poke() {
+        uint64_t one = 1;
+        [[maybe_unused]] ssize_t n = ::write(fd_, &one, sizeof(one));
+    }
+    void drain() {
+        uint64_t n;
+        [[maybe_unused]] ssize_t r = ::read(fd_, &n, sizeof(n));
+    }
+
+    /* Steady ms of the armed deadline, 0 if none. */
+    int64_t deadline() const { return deadline_.load(memory_order_relaxed); }
+
+    /* Milliseconds until the deadline (for a poll timeout), -1 if none. */
+    int timeout(int64_t now) const {
+        int64_t at = deadline();
+        if (at == 0) return -1;
+        return at <= now ? 0 : static_cast<int>(min<int64_t>(at - now, 0x7fffffff));
+    }
+
+    /* Has the server been empty for the whole delay? A deadline reached with clients connected is dropped. */
+    bool expired(int64_t now) {
+        int64_t at = deadline();
+        if (at == 0 || now < at) return false;
+        if (active_clients.load() == 0) return true;
+        deadline_.compare_exchange_strong(at, 0, memory_order_relaxed);
+        return false;
+    }
+
+private:
+    int             fd_ = -1;
+    atomic<int64_t> deadline_{0};
+};
+
+static IdleShutdown idle_shutdown;
+
+/* The shorter of two poll timeouts (-1: none). */
+static int min_timeout(int a, int b) {
+    if (a < 0) return b;
+    if (b < 0) return a;
+    return min(a, b);
+}
+
+/* The idle rule fired: refuse new clients on every listener now; sessions still running finish. */
+static void shut_down_idle() {
+    logger.write(LogLevel::Info, "No active clients for 10s. Shutting down server.\n");
+    server_running.store(false);
+    for (int fd : listen_fds) ::shutdown(fd, SHUT_RDWR);
+}
+
+static void log_disconnect(const sockaddr_in& addr) {
+    admission.release(addr);
+    active_clients.dec();
+    idle_shutdown.client_left();
+    thread_local unsigned seen = 0;
+    if (!log_sampled(seen)) return;
+    int64_t left = active_clients.load();
+    logger.write(LogLevel::Info, "Client disconnected. Active clients: %d\n", left);
+    if (left == 0) logger.write(LogLevel::Info, "Server will shutdown in 10s if no other client comes up.\n");
 }
 
 // ---------------------------- Signal handling ---------------------------
 
-/* Stop accepting new clients; running sessions will finish. */
+static int reload_pipe[2] = {-1, -1};  // [0] watched by the reloader; signal handlers write to [1]
+
+/*
+ * Stop accepting new clients; running sessions will finish. A handler may
+ * not log (it could interrupt a record half-written to this thread's ring),
+ * so the watcher thread announces the signal.
+ */
 static void signal_handler(int) {
-    cout << "\nShutdown signal received. Waiting for clients to finish...\n";
+    static const char msg[] = "\nShutdown signal received. Waiting for clients to finish...\n";
+    char c = 'x';
+    if (::write(reload_pipe[1], &c, 1) != 1) {  // no watcher yet: say it directly
+        [[maybe_unused]] ssize_t n = ::write(STDOUT_FILENO, msg, sizeof(msg) - 1);
+    }
     server_running.store(false);
-    if (listen_fd >= 0) ::shutdown(listen_fd, SHUT_RDWR);  // wake poll()
+    for (int fd : listen_fds) ::shutdown(fd, SHUT_RDWR);  // wake poll()
+    idle_shutdown.poke();                                  // and a loop waiting only on the idle rule
 }
 
-// ------------------------------- Thread --------------------------------
+// ------------------------------- Metrics -------------------------------
 
 /*
- * Thread entry per client. Manages the conversation loop and the "another?" prompt.
- * Decrements active_clients on exit.
+ * --admin-port=N serves the counters on 127.0.0.1:N in the Prometheus text
+ * format: `curl localhost:N/metrics`, or a scrape job pointed at it. A bare
+ * command line works too (`echo metrics | nc localhost N`). The `latency`
+ * page reports percentiles of the protocol step histograms (session.h).
+ *
+ * Every counter is a ShardedCounter: the session path bumps its own thread's
+ * cache-line slot, and only a scrape adds the slots up. The watcher thread
+ * answers scrapes one at a time from its poll() loop (see catalog_watcher()),
+ * so the admin port adds no thread and nothing to the event loops.
  */
-static void* handle_client(void* arg) {
-    unique_ptr<ClientSession> session(static_cast<ClientSession*>(arg));
 
-    char ip[INET_ADDRSTRLEN]{};
-    inet_ntop(AF_INET, &session->client_addr.sin_addr, ip, INET_ADDRSTRLEN);
-    cout << "Client connected from " << ip << ":" << ntohs(session->client_addr.sin_port) << "\n";
+static int admin_fd = -1;  // --admin-port listener, or -1
 
-    random_device rd;
-    session->rng.seed(rd());
+static void metric_family(string& out, const char* name, const char* type, const char* help) {
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
 
-    bool cont = true;
-    while (cont) {
-        if (!play_joke(session.get())) break;
+/* One sample; `labels` is empty or like `reason="busy"`. */
+static void metric_sample(string& out, const char* name, const char* labels, int64_t value) {
+    out += name;
+    if (*labels) {
+        out += '{';
+        out += labels;
+        out += '}';
+    }
+    out += ' ';
+    out += to_string(value);
+    out += '\n';
+}
 
-        // Ask until we get a valid Y/N
-        while (true) {
-            if (!send_line(session->fd, "Would you like to listen to another? (Y/N) <input>")) { cont = false; break; }
-            string choice;
-            if (!recv_line(session->fd, choice)) { cont = false; break; }
+static void metric(string& out, const char* name, const char* type, const char* help, int64_t value) {
+    metric_family(out, name, type, help);
+    metric_sample(out, name, "", value);
+}
 
-            if (iequals(choice, "N") || iequals(choice, "no")) { cont = false; break; }
-            if (iequals(choice, "Y") || iequals(choice, "yes")) { break; }
+static string render_metrics() {
+    string out;
+    out.reserve(4096);
+    metric(out, "knock_connections_accepted_total", "counter", "Connections accepted, before admission control.",
+           accepted_clients.load());
+    metric_family(out, "knock_connections_rejected_total", "counter", "Connections turned away, by reason.");
+    metric_sample(out, "knock_connections_rejected_total", "reason=\"busy\"", busy_clients.load());
+    metric_sample(out, "knock_connections_rejected_total", "reason=\"address_limit\"", limited_clients.load());
+    metric_sample(out, "knock_connections_rejected_total", "reason=\"memory\"", shed_clients.load());
+    metric(out, "knock_connections_queued_total", "counter", "Connections made to wait for a session slot.",
+           queued_clients.load());
+    metric(out, "knock_connections_waiting", "gauge", "Connections waiting for a session slot now.",
+           static_cast<int64_t>(admission.waiting()));
+    metric(out, "knock_connections_active", "gauge", "Sessions in progress.", active_clients.load());
+    metric(out, "knock_sessions_evicted_total", "counter", "Slow readers disconnected at the send deadline.",
+           evicted_clients.load());
+    metric(out, "knock_sessions_timed_out_total", "counter", "Sessions ended by the read deadline or lifetime limit.",
+           timed_out_clients.load());
+    metric(out, "knock_sessions_stalled", "gauge", "Sessions waiting for their client to take output.",
+           stalled_sessions.load());
+    metric(out, "knock_output_stalled_bytes", "gauge", "Output held by stalled sessions.", stalled_bytes.load());
+    metric(out, "knock_jokes_told_total", "counter", "Punchlines delivered.", protocol_counters.jokes_told.load());
+    metric_family(out, "knock_corrections_total", "counter", "Wrong replies corrected, by protocol step.");
+    metric_sample(out, "knock_corrections_total", "step=\"whos_there\"", protocol_counters.whos_there_fixes.load());
+    metric_sample(out, "knock_corrections_total", "step=\"setup_who\"", protocol_counters.setup_who_fixes.load());
+    metric(out, "knock_yes_no_reprompts_total", "counter", "Replies at the Y/N prompt that were neither.",
+           protocol_counters.yes_no_reprompts.load());
+    metric(out, "knock_bytes_received_total", "counter", "Bytes read from clients.", bytes_received.load());
+    metric(out, "knock_bytes_sent_total", "counter", "Bytes sent to clients.", bytes_sent.load());
+    shared_ptr<const Catalog> cat = catalog_store.acquire();
+    metric(out, "knock_catalog_jokes", "gauge", "Jokes in the current catalog.", static_cast<int64_t>(cat ? cat->size() : 0));
+    metric(out, "knock_catalog_version", "gauge", "Catalog version (1 at startup, +1 per reload).",
+           static_cast<int64_t>(catalog_store.version()));
+    metric(out, "knock_resident_bytes", "gauge", "Resident set size of the server.", resident_bytes());
+    metric(out, "knock_log_dropped_total", "counter", "Log lines dropped because output fell behind.",
+           static_cast<int64_t>(logger.dropped()));
+    return out;
+}
 
-            if (!send_line(session->fd, "Please reply with Y or N.")) { cont = false; break; }
+/* A duration in nanoseconds with three significant digits and a unit, e.g. "41.2us". */
+static string format_ns(double ns) {
+    static const struct { double scale; const char* unit; } units[] = {{1e9, "s"}, {1e6, "ms"}, {1e3, "us"}, {1, "ns"}};
+    for (const auto& u : units) {
+        if (ns >= u.scale || u.scale == 1) {
+            double v = ns / u.scale;
+            char   buf[32];
+            snprintf(buf, sizeof(buf), v >= 100 ? "%.0f%s" : v >= 10 ? "%.1f%s" : "%.2f%s", v, u.unit);
+            return buf;
         }
     }
+    return {};
+}
+
+/* Percentiles of each protocol step, merged over every thread's histogram. */
+static string render_latency() {
+    const struct { const char* name; const latency::Histogram& h; } steps[] = {
+        {"first_knock", protocol_latency.first_knock},  // accept -> first "Knock knock!"
+        {"think",       protocol_latency.think},        // prompt -> client reply
+        {"reply",       protocol_latency.reply},        // client reply -> answer queued
+        {"joke",        protocol_latency.joke},         // "Knock knock!" -> punchline
+    };
+    double tick_ns = latency::ns_per_tick();
+    string out;
+    char   line[160];
+    snprintf(line, sizeof(line), "%-12s %10s %9s %9s %9s %9s %9s\n", "step", "count", "p50", "p90", "p99", "p99.9", "max");
+    out += line;
+    for (const auto& step : steps) {
+        latency::Summary sum = step.h.summary(tick_ns);
+        snprintf(line, sizeof(line), "%-12s %10llu %9s %9s %9s %9s %9s\n", step.name,
+                 static_cast<unsigned long long>(sum.count), format_ns(sum.p50).c_str(), format_ns(sum.p90).c_str(),
+                 format_ns(sum.p99).c_str(), format_ns(sum.p999).c_str(), format_ns(sum.max).c_str());
+        out += line;
+    }
+    return out;
+}
 
-    ::close(session->fd);
-    int left = --active_clients;
-    cout << "Client disconnected. Active clients: " << left << "\n";
-    if (left == 0) {
-        cout << "Server will shutdown in 10s if no other client comes up.\n";
+/* Listen on 127.0.0.1:port for admin requests (non-blocking, polled by the watcher). -1 on failure. */
+static int open_admin_listener(int port) {
+    int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    int opt = 1;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    sockaddr_in addr{};
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port        = htons(static_cast<uint16_t>(port));
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || ::listen(fd, 16) < 0) {
+        ::close(fd);
+        return -1;
     }
-    return nullptr;
+    return fd;
 }
 
-// --------------------------------- Main ---------------------------------
+/*
+ * Answer one admin connection: an HTTP GET for /<page>, or just the page's
+ * name on a line. The socket gets one-second timeouts, so a stuck client
+ * holds up the watcher thread for at most that long.
+ */
+static void serve_admin() {
+    int fd = ::accept4(admin_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) return;
+    timeval tv{1, 0};
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
 
-int main() {
-    // Load jokes from SQLite DB
-    load_jokes_from_db("jokes.db");
-    if (jokes.empty()) {
-        cerr << "No jokes found in database!\n";
-        return 1;
+    LineReader  in(fd, 1024);
+    string_view line;
+    if (in.read_line(line)) {
+        bool http = line.rfind("GET /", 0) == 0;
+        string_view page = trim_view(http ? line.substr(5, line.find(' ', 5) - 5) : line);
+        string body, status = "200 OK";
+        if (page == "metrics") {
+            body = render_metrics();
+        } else if (page == "latency") {
+            body = render_latency();
+        } else {
+            status = "404 Not Found";
+            body   = "Unknown page; try: metrics, latency\n";
+        }
+        string reply;
+        if (http) {
+            reply = "HTTP/1.1 " + status + "\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                    "Content-Length: " + to_string(body.size()) + "\r\nConnection: close\r\n\r\n";
+        }
+        reply += body;
+        for (size_t off = 0; off < reply.size();) {
+            ssize_t n = ::send(fd, reply.data() + off, reply.size() - off, MSG_NOSIGNAL);
+            if (n <= 0) break;
+            off += static_cast<size_t>(n);
+        }
+        // Let the client see the end of the reply before the close (unread headers would reset it)
+        ::shutdown(fd, SHUT_WR);
+        char sink[512];
+        while (::recv(fd, sink, sizeof(sink), 0) > 0) {}
     }
+    ::close(fd);
+}
 
-    // Basic signal setup
-    ::signal(SIGPIPE, SIG_IGN);
-    ::signal(SIGINT,  signal_handler);
-    ::signal(SIGTERM, signal_handler);
+// ---------------------------- Catalog reload ---------------------------
 
-    // Listening socket
-    listen_fd = ::socket(AF_INET, SOCK_STREAM, 0);
-    if (listen_fd < 0) { perror("socket"); return 1; }
+/*
+ * Hot reload: a watcher thread rebuilds the catalog from the database (or
+ * remaps the compiled catalog) when the process gets SIGHUP or when that file
+ * changes on disk, then publishes it as a new snapshot. The thread sleeps in poll()
+ * on an inotify descriptor and a self-pipe (and answers the admin port, see
+ * Metrics), so it costs nothing while idle.
+ * A reload that fails or finds no jokes keeps the current catalog.
+ */
 
-    int opt = 1;
-    ::setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+static void reload_signal_handler(int) {
+    char c = 'r';
+    [[maybe_unused]] ssize_t n = ::write(reload_pipe[1], &c, 1);
+}
 
-    sockaddr_in addr{};
-    addr.sin_family      = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port        = htons(PORT);
+/* SIGUSR1: the watcher thread prints the counters (see print_stats()). */
+static void stats_signal_handler(int) {
+    char c = 's';
+    [[maybe_unused]] ssize_t n = ::write(reload_pipe[1], &c, 1);
+}
+
+static void print_stats() {
+    ostringstream out;
+    out << "Stats: " << active_clients.load() << " active clients, " << stalled_sessions.load()
+        << " stalled on output (" << stalled_bytes.load() << " bytes queued, deepest queue "
+        << deepest_queue.load() << " bytes), " << evicted_clients.load() << " slow readers evicted, "
+        << timed_out_clients.load() << " timed out; " << admission.waiting() << " waiting for a session slot ("
+        << queued_clients.load() << " queued so far), " << busy_clients.load() << " turned away busy";
+    if (admission.limit() > 0) out << " at " << admission.limit() << " sessions";
+    out << ", " << limited_clients.load() << " over their address's limits (" << admission.addresses()
+        << " addresses tracked), " << shed_clients.load() << " connections shed; resident " << (resident_bytes() >> 20) << " MiB";
+    if (config.max_memory > 0) out << " of " << (config.max_memory >> 20) << " MiB allowed";
+    out << "; " << logger.dropped() << " log lines dropped.\n";
+    logger.text(LogLevel::Info, out.str());
+}
+
+/* Build a catalog from --catalog (mmap) if given, otherwise from the database. */
+static bool load_catalog(Catalog& out) {
+    if (config.catalog_path.empty()) return load_jokes_from_db(config.db_path, out, config.load_threads);
+    string err;
+    if (!Catalog::map_file(config.catalog_path, out, err)) {
+        logger.text(LogLevel::Error, "Can't map catalog: " + err + "\n");
+        return false;
+    }
+    return true;
+}
 
-    if (::bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) { perror("bind"); return 1; }
-    if (::listen(listen_fd, MAX_CLIENTS) < 0) { perror("listen"); return 1; }
+static bool reload_catalog() {
+    auto next = make_shared<Catalog>();
+    if (!load_catalog(*next) || next->empty()) {
+        logger.write(LogLevel::Error, "Catalog reload failed; keeping the current jokes.\n");
+        return false;
+    }
+    size_t   n       = next->size();
+    uint64_t version = catalog_store.publish(std::move(next));
+    logger.write(LogLevel::Info, "Catalog reloaded: %u jokes (version %u).\n", n, version);
+    return true;
+}
 
-    cout << "Server listening on port " << PORT << "...\n";
-    cout << "Press Ctrl+C to stop the server gracefully.\n";
+static void catalog_watcher(string path) {
+    // Watch the directory: SQLite rewrites the file in place or through a journal next to it
+    string dir  = ".";
+    string base = path;
+    size_t slash = path.find_last_of('/');
+    if (slash != string::npos) {
+        dir  = slash == 0 ? "/" : path.substr(0, slash);
+        base = path.substr(slash + 1);
+    }
 
-    // Idle shutdown timer bookkeeping
-    bool timer_running = false;
-    auto zero_since    = chrono::steady_clock::now();
+    int ino = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ino >= 0 && ::inotify_add_watch(ino, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+        log_errno("inotify_add_watch");
+        ::close(ino);
+        ino = -1;
+    }
 
-    // Accept loop with poll() so we can check timers once per second
-    while (server_running.load()) {
-        pollfd pfd{listen_fd, POLLIN, 0};
-        int pr = ::poll(&pfd, 1, 1000);  // 1-second tick
-
-        if (pr > 0 && (pfd.revents & POLLIN)) {
-            // New client
-            sockaddr_in caddr{};
-            socklen_t   clen = sizeof(caddr);
-            int cfd = ::accept(listen_fd, reinterpret_cast<sockaddr*>(&caddr), &clen);
-            if (cfd < 0) {
-                if (errno == EINTR) continue;
-                perror("accept");
-                continue;
-            }
+    alignas(inotify_event) char buf[4096];
+    while (true) {
+        pollfd pfds[3] = {{reload_pipe[0], POLLIN, 0}, {ino, POLLIN, 0}, {admin_fd, POLLIN, 0}};  // -1: skipped
+        if (::poll(pfds, 3, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
 
-            active_clients.fetch_add(1);
-            timer_running = false;  // reset idle timer
-
-            auto* session     = new ClientSession();
-            session->fd       = cfd;
-            session->client_addr = caddr;
-
-            pthread_t tid;
-            if (pthread_create(&tid, nullptr, handle_client, session) != 0) {
-                perror("pthread_create");
-                ::close(cfd);
-                delete session;
-                active_clients.fetch_sub(1);
-            } else {
-                pthread_detach(tid);
+        bool reload = false;
+        if (pfds[0].revents & POLLIN) {
+            char c = 0;
+            while (::read(reload_pipe[0], &c, 1) == 1) {
+                if (c == 'q') { if (ino >= 0) ::close(ino); return; }
+                if (c == 's') { print_stats(); continue; }
+                if (c == 'x') { logger.write(LogLevel::Info, "\nShutdown signal received. Waiting for clients to finish...\n"); continue; }
+                reload = true;  // SIGHUP
             }
-        } else if (pr == 0) {
-            // poll() timeout -> check idle condition
-            if (active_clients.load() == 0) {
-                if (!timer_running) {
-                    timer_running = true;
-                    zero_since    = chrono::steady_clock::now();
-                } else {
-                    auto elapsed = chrono::steady_clock::now() - zero_since;
-                    if (elapsed >= chrono::seconds(10)) {
-                        cout << "No active clients for 10s. Shutting down server.\n";
-                        break;
-                    }
+        }
+        if (pfds[2].revents & POLLIN) serve_admin();
+        if (ino >= 0 && (pfds[1].revents & POLLIN)) {
+            ssize_t len;
+            while ((len = ::read(ino, buf, sizeof(buf))) > 0) {
+                for (char* p = buf; p < buf + len;) {
+                    auto* ev = reinterpret_cast<inotify_event*>(p);
+                    if (ev->len && strncmp(ev->name, base.c_str(), base.size()) == 0) reload = true;
+                    p += sizeof(inotify_event) + ev->len;
                 }
-            } else {
-                timer_running = false;  // someone is active
             }
-        } else {
+            // Let a burst of writes (one transaction) settle before reading the file
+            if (reload) {
+                this_thread::sleep_for(chrono::milliseconds(200));
+                while (::read(ino, buf, sizeof(buf)) > 0) {}
+            }
+        }
+
+        if (reload) reload_catalog();
+    }
+    if (ino >= 0) ::close(ino);
+}
+
+// ------------------------------- Thread --------------------------------
+
+static void set_timeout(int fd, int opt, int64_t ms) {
+    timeval tv{static_cast<time_t>(ms / 1000), static_cast<suseconds_t>(ms % 1000 * 1000)};
+    ::setsockopt(fd, SOL_SOCKET, opt, &tv, sizeof(tv));
+}
+
+enum class LineWait { Line, Closed, ReadTimeout, SessionLimit };
+
+/*
+ * Blocking read of the client's next line under the read deadline (the
+ * socket's SO_RCVTIMEO, set at accept) and the lifetime limit, which takes
+ * over the receive timeout once it is the nearer of the two.
+ */
+static LineWait read_line_by_deadline(ClientSession* session, string_view& line) {
+    if (session->in.next_line(line)) return LineWait::Line;
+    bool limit = false;  // the lifetime limit is what SO_RCVTIMEO counts down now
+    if (session->ends_at) {
+        int64_t left = session->ends_at - now_ms();
+        if (left <= 0) return LineWait::SessionLimit;
+        if (config.read_timeout == 0 || left < config.read_timeout * 1000LL) {
+            set_timeout(session->fd, SO_RCVTIMEO, left);
+            limit = true;
+        }
+    }
+    errno = 0;
+    ssize_t n;
+    while ((n = session->in.fill()) > 0) {
+        bytes_received.add(n);
+        if (session->in.next_line(line)) return LineWait::Line;
+    }
+    if (n == 0) return LineWait::Closed;
+    if (errno != EAGAIN && errno != EWOULDBLOCK) return LineWait::Closed;
+    return limit ? LineWait::SessionLimit : LineWait::ReadTimeout;
+}
+
+/* A session for an admitted client of --mode=threads: deadlines on the socket, counted as active. */
+static ClientSession* new_thread_session(int cfd, const sockaddr_in& caddr) {
+    tune_socket(cfd);
+    if (config.send_timeout > 0) set_timeout(cfd, SO_SNDTIMEO, config.send_timeout * 1000LL);
+    if (config.read_timeout > 0) set_timeout(cfd, SO_RCVTIMEO, config.read_timeout * 1000LL);
+    active_clients.inc();
+
+    auto* session     = new ClientSession();
+    session->fd       = cfd;
+    session->client_addr = caddr;
+    session->store    = &catalog_store;
+    session->select_mode = config.select;
+    session->ends_at  = session_end(now_ms());
+    session->rng.seed(session_seeds.next());  // here, in accept order, not when its thread gets going
+    adopt_catalog(session, thread_catalog());
+    session->in.reset(cfd);
+    return session;
+}
+
+/*
+ * One client of --mode=threads, start to finish. Runs the session state
+ * machine with blocking I/O: flush what it queued, read one line, repeat (the
+ * flush waits while the client's next line is already buffered).
+ * Decrements active_clients on exit.
+ */
+static void serve_thread_session(unique_ptr<ClientSession> session) {
+    set_counter_shard(static_cast<size_t>(session->fd));  // live sessions have distinct fds: spread the slots
+    log_connect(session.get());
+
+    start_joke(session.get());
+    string_view resp;
+    while (true) {
+        // Lines the client sent ahead (pipelining) are answered together, in one write
+        bool more = session->state != SessionState::Closing && session->in.has_line() &&
+                    session->outbuf.size() < config.max_output;
+        if (!more) {
+            bool timed_out = false;
+            bool sent      = send_all(session->fd, session->outbuf, timed_out);
+            if (timed_out) log_eviction(session.get(), session->outbuf.size());
+            if (!sent || session->state == SessionState::Closing) break;
+        }
+        LineWait got = read_line_by_deadline(session.get(), resp);
+        if (got != LineWait::Line) {
+            if (got != LineWait::Closed) log_timeout(session.get(), got == LineWait::SessionLimit);
+            break;
+        }
+        on_client_line(session.get(), resp);
+    }
+
+    ::close(session->fd);
+    log_disconnect(session->client_addr);
+}
+
+/* Thread entry per client; the thread goes on to serve clients that were waiting for a slot. */
+static void* handle_client(void* arg) {
+    serve_thread_session(unique_ptr<ClientSession>(static_cast<ClientSession*>(arg)));
+    int         fd;
+    sockaddr_in addr;
+    while (admission.next_waiting(fd, addr)) serve_thread_session(unique_ptr<ClientSession>(new_thread_session(fd, addr)));
+    return nullptr;
+}
+
+/* Start a thread for an admitted client. */
+static void spawn_thread_session(int cfd, const sockaddr_in& caddr) {
+    ClientSession* session = new_thread_session(cfd, caddr);
+    pthread_t tid;
+    if (pthread_create(&tid, nullptr, handle_client, session) != 0) {
+        log_errno("pthread_create");
+        ::close(cfd);
+        delete session;
+        active_clients.dec();
+        idle_shutdown.client_left();
+        admission.release(caddr);
+    } else {
+        pthread_detach(tid);
+    }
+}
+
+/*
+ * Accept loop for --mode=threads: one detached pthread per client. Sleeps in
+ * poll() until a client arrives or the idle deadline (see IdleShutdown) is due.
+ */
+static void run_thread_per_client() {
+    int listen_fd = listen_fds[0];
+    while (server_running.load()) {
+        pollfd pfds[2] = {{listen_fd, POLLIN, 0}, {idle_shutdown.fd(), POLLIN, 0}};
+        int pr = ::poll(pfds, 2, idle_shutdown.timeout(now_ms()));
+        if (pr < 0) {
             // Interrupted or error; loop condition will decide next step
             if (!server_running.load()) break;
+            continue;
         }
+        if (pfds[1].revents & POLLIN) idle_shutdown.drain();  // re-armed: recompute the timeout
+        if (idle_shutdown.expired(now_ms())) {
+            shut_down_idle();
+            break;
+        }
+        if (!(pfds[0].revents & POLLIN)) continue;
+
+        // New client
+        sockaddr_in caddr{};
+        socklen_t   clen = sizeof(caddr);
+        int cfd = ::accept(listen_fd, reinterpret_cast<sockaddr*>(&caddr), &clen);
+        if (cfd < 0) {
+            if (errno == EINTR) continue;
+            log_errno("accept");
+            continue;
+        }
+
+        if (admission.admit(cfd, caddr)) spawn_thread_session(cfd, caddr);
+        while (admission.next_waiting(cfd, caddr)) spawn_thread_session(cfd, caddr);  // slots freed meanwhile
     }
 
     ::close(listen_fd);
@@ -363,6 +1175,1314 @@ int main() {
     while (active_clients.load() > 0) {
         this_thread::sleep_for(chrono::milliseconds(100));
     }
-    cout << "Server shut down successfully.\n";
+}
+
+// ------------------------------- Reactor -------------------------------
+
+/*
+ * --mode=epoll: a single thread multiplexes every client over epoll. Sockets
+ * are non-blocking; each ClientSession buffers partial input in its LineReader
+ * and unsent output in `outbuf`, and only the state machine above decides what
+ * happens next. A session costs a heap object and two small strings instead
+ * of a pthread stack, so one core can hold tens of thousands of them.
+ *
+ * --mode=sharded runs one Reactor per core. Each has its own SO_REUSEPORT
+ * listener (the kernel spreads new connections across them by address hash),
+ * runs on a thread pinned to its CPU, and owns its sessions from accept to
+ * close. Nothing on the per-connection path is shared between reactors: the
+ * client count is a ShardedCounter slot, and each reactor pins the current
+ * catalog through its own shared_ptr control block, so handing a snapshot to
+ * a session does not bounce a reference count between cores. Reactor 0 also
+ * runs the 10 s idle rule for the whole server.
+ *
+ * Each reactor keeps its sessions' deadlines in its own TimerWheel and
+ * passes the time to the next one (or to the idle deadline) as the
+ * epoll_wait() timeout: with nothing due it blocks until a socket is ready.
+ */
+
+static bool set_nonblocking(int fd) {
+    int flags = ::fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+/* Write as much of the pending output as the socket takes. False on error. */
+static bool flush_nonblocking(ClientSession* session) {
+    while (!session->outbuf.empty()) {
+        ssize_t n = session->outbuf.send_some(session->fd);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            return false;
+        }
+        bytes_sent.add(n);
+    }
+    return true;
+}
+
+/*
+ * Flush, and each time that empties the queue, answer the lines the output
+ * budget held back. False on error.
+ */
+static bool flush_and_answer(ClientSession* session) {
+    while (flush_nonblocking(session)) {
+        bool held_back = session->state != SessionState::Closing && session->in.has_line();
+        if (!session->outbuf.empty() || !held_back) return true;
+        answer_lines(session);
+    }
+    return false;
+}
+
+class Reactor {
+public:
+    explicit Reactor(int lfd, size_t index = 0) : lfd_(lfd), index_(index) {}
+    ~Reactor() { if (epfd_ >= 0) ::close(epfd_); }
+
+    void run();
+
+private:
+    void accept_clients();
+    void start_session(int cfd, const sockaddr_in& caddr);
+    void start_waiting();
+    void on_client_event(ClientSession* session, uint32_t events);
+    void update_interest(ClientSession* session, bool stepped);
+    void close_session(ClientSession* session);
+    void on_deadline(ClientSession* session);
+
+    int    lfd_;
+    size_t index_;                  // 0 runs the server-wide idle rule
+    int    epfd_ = -1;
+    bool   accepting_ = true;
+    size_t live_ = 0;               // sessions this reactor owns
+    int64_t    now_ = now_ms();     // as of the last wakeup
+    TimerWheel timers_{static_cast<uint64_t>(now_)};  // one per session: its current deadline
+    PinnedCatalog catalog_;         // this reactor's handle on the current snapshot
+    vector<unique_ptr<ClientSession>> sessions_;  // indexed by fd
+};
+
+void Reactor::run() {
+    set_counter_shard(index_);
+    epfd_ = ::epoll_create1(EPOLL_CLOEXEC);
+    if (epfd_ < 0) { log_errno("epoll_create1"); return; }
+
+    set_nonblocking(lfd_);
+    epoll_event lev{};
+    lev.events   = EPOLLIN;
+    lev.data.ptr = nullptr;  // nullptr marks the listening socket
+    if (::epoll_ctl(epfd_, EPOLL_CTL_ADD, lfd_, &lev) < 0) { log_errno("epoll_ctl"); return; }
+    if (index_ == 0) {
+        epoll_event iev{};
+        iev.events   = EPOLLIN;
+        iev.data.ptr = &idle_shutdown;  // marks the idle rule's eventfd
+        if (::epoll_ctl(epfd_, EPOLL_CTL_ADD, idle_shutdown.fd(), &iev) < 0) { log_errno("epoll_ctl"); return; }
+    }
+
+    vector<epoll_event> events(1024);
+    while (accepting_ || live_ > 0) {
+        now_ = now_ms();
+        int timeout = timers_.timeout(static_cast<uint64_t>(now_));
+        if (accepting_ && index_ == 0) timeout = min_timeout(timeout, idle_shutdown.timeout(now_));
+        int n = ::epoll_wait(epfd_, events.data(), static_cast<int>(events.size()), timeout);
+        if (n < 0 && errno != EINTR) { log_errno("epoll_wait"); break; }
+
+        now_ = now_ms();
+        for (int i = 0; i < n; ++i) {
+            void* tag = events[i].data.ptr;
+            if (tag == nullptr) accept_clients();
+            else if (tag == &idle_shutdown) idle_shutdown.drain();  // re-armed: recompute the timeout
+            else on_client_event(static_cast<ClientSession*>(tag), events[i].events);
+        }
+        timers_.advance(static_cast<uint64_t>(now_),
+                        [this](TimerWheel::Timer& t) { on_deadline(static_cast<ClientSession*>(t.owner)); });
+        start_waiting();
+
+        if (accepting_ && !server_running.load()) {
+            // Stop accepting; keep serving the sessions already connected
+            ::epoll_ctl(epfd_, EPOLL_CTL_DEL, lfd_, nullptr);
+            accepting_ = false;
+        }
+        if (accepting_ && index_ == 0 && idle_shutdown.expired(now_)) {
+            shut_down_idle();  // every shard stops accepting on its next wakeup
+            break;
+        }
+    }
+
+    ::close(lfd_);
+    for (auto& s : sessions_) {
+        if (s) close_session(s.get());
+    }
+}
+
+void Reactor::accept_clients() {
+    while (true) {
+        sockaddr_in caddr{};
+        socklen_t   clen = sizeof(caddr);
+        int cfd = ::accept4(lfd_, reinterpret_cast<sockaddr*>(&caddr), &clen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (cfd < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == EMFILE || errno == ENFILE) { log_errno("accept4"); return; }
+            if (server_running.load()) log_errno("accept4");
+            return;
+        }
+        if (admission.admit(cfd, caddr)) start_session(cfd, caddr);
+    }
+}
+
+/* Clients that were waiting for a slot, now that sessions (on any reactor) have ended. */
+void Reactor::start_waiting() {
+    int         cfd;
+    sockaddr_in caddr;
+    while (admission.next_waiting(cfd, caddr)) start_session(cfd, caddr);
+}
+
+void Reactor::start_session(int cfd, const sockaddr_in& caddr) {
+    tune_socket(cfd);
+    active_clients.inc();
+    ++live_;
+
+    auto* session        = new ClientSession();
+    session->fd          = cfd;
+    session->client_addr = caddr;
+    session->store       = &catalog_store;
+    session->select_mode = config.select;
+    session->ends_at     = session_end(now_);
+    session->deadline.owner = session;
+    adopt_catalog(session, catalog_.get());
+    session->in.reset(cfd);
+    if (static_cast<size_t>(cfd) >= sessions_.size()) sessions_.resize(static_cast<size_t>(cfd) + 1);
+    sessions_[static_cast<size_t>(cfd)].reset(session);
+    log_connect(session);
+
+    session->rng.seed(session_seeds.next());
+
+    epoll_event ev{};
+    ev.events   = EPOLLIN;
+    ev.data.ptr = session;
+    if (::epoll_ctl(epfd_, EPOLL_CTL_ADD, cfd, &ev) < 0) {
+        log_errno("epoll_ctl");
+        close_session(session);
+        return;
+    }
+
+    start_joke(session);
+    if (!flush_nonblocking(session)) { close_session(session); return; }
+    update_interest(session, true);
+}
+
+void Reactor::on_client_event(ClientSession* session, uint32_t events) {
+    bool stepped = false;  // answered a line: the read deadline starts over
+    if (events & EPOLLIN) {
+        while (true) {
+            ssize_t n = session->in.fill();
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (n <= 0) { close_session(session); return; }  // EOF or error
+            bytes_received.add(n);
+
+            stepped |= answer_lines(session);
+            if (session->outbuf.size() >= config.max_output) break;  // over budget: read on once it drains
+            // A short read drained the socket; level-triggered epoll reports any later bytes
+            if (static_cast<size_t>(n) < LineReader::kChunk) break;
+        }
+    } else if (events & (EPOLLERR | EPOLLHUP)) {
+        close_session(session);
+        return;
+    }
+
+    if (!flush_and_answer(session)) { close_session(session); return; }
+    update_interest(session, stepped);
+}
+
+/*
+ * Watch for writability only while output is pending; hang up once a closing
+ * session has drained. Re-arms the session's deadline when it took a step or
+ * stalled or recovered.
+ */
+void Reactor::update_interest(ClientSession* session, bool stepped) {
+    bool pending = !session->outbuf.empty();
+    if (!pending && session->state == SessionState::Closing) {
+        close_session(session);
+        return;
+    }
+    if (pending != session->want_write) {
+        session->want_write = pending;
+        note_stall(session, pending, now_);  // the socket is full: the send deadline runs
+
+        epoll_event ev{};
+        ev.events   = pending ? EPOLLOUT : EPOLLIN;
+        ev.data.ptr = session;
+        ::epoll_ctl(epfd_, EPOLL_CTL_MOD, session->fd, &ev);
+    } else if (!stepped) {
+        return;  // same wait as before: its deadline stands
+    }
+
+    int64_t at = session_deadline(session, now_);
+    if (at) timers_.arm(session->deadline, static_cast<uint64_t>(at));
+    else timers_.cancel(session->deadline);
+}
+
+void Reactor::close_session(ClientSession* session) {
+    int fd = session->fd;
+    timers_.cancel(session->deadline);
+    note_stall(session, false, now_);
+    ::close(fd);  // also drops it from the epoll set
+    log_disconnect(session->client_addr);
+    sessions_[static_cast<size_t>(fd)].reset();
+    --live_;
+}
+
+/* The session's deadline passed without it taking a step. */
+void Reactor::on_deadline(ClientSession* session) {
+    log_expiry(session, now_, session->outbuf.size());
+    close_session(session);
+}
+
+/* CPUs this process may run on, in order. */
+static vector<int> allowed_cpus() {
+    vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (::sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int c = 0; c < CPU_SETSIZE; ++c) {
+            if (CPU_ISSET(c, &set)) cpus.push_back(c);
+        }
+    }
+    if (cpus.empty()) cpus.push_back(0);
+    return cpus;
+}
+
+/* --mode=sharded: one pinned thread per listener, each running its own Reactor. */
+static void run_sharded(const vector<int>& cpus) {
+    vector<thread> loops;
+    for (size_t i = 0; i < listen_fds.size(); ++i) {
+        loops.emplace_back([i] { Reactor(listen_fds[i], i).run(); });
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[i % cpus.size()], &set);
+        if (pthread_setaffinity_np(loops.back().native_handle(), sizeof(set), &set) != 0) {
+            logger.write(LogLevel::Warn, "Could not pin reactor %u to CPU %d\n", i, cpus[i % cpus.size()]);
+        }
+    }
+    for (auto& t : loops) t.join();
+}
+
+// ----------------------------- io_uring loop -----------------------------
+
+/*
+ * --mode=uring: the same non-blocking session state machine, driven by
+ * completions instead of readiness (uring.h). One multishot accept keeps
+ * producing new connections; each session has at most one operation in flight:
+ *
+ *   - a recv with no buffer of its own: the kernel takes one from the shared
+ *     provided-buffer group when bytes arrive, the loop copies them into the
+ *     session's LineReader and hands the buffer straight back;
+ *   - or a send of everything the state machine queued for this step (e.g.
+ *     punchline and Y/N prompt go out as one contiguous SEND).
+ *
+ * All submissions made while handling a batch of completions go to the
+ * kernel together in the next io_uring_enter(), which also waits for the
+ * next batch, so a reply/answer round trip costs one shared syscall rather
+ * than a recv() and a send() of its own. Because a session never has two
+ * operations outstanding, it can be freed as soon as its last one completes.
+ * Deadlines live in a TimerWheel as in the reactor; a single IORING_OP_TIMEOUT,
+ * re-armed only when the next deadline (or the idle rule's) moves earlier,
+ * wakes the loop for them. A session whose send is still in flight at its
+ * send deadline, or that sent no line by its read deadline, has its socket
+ * shut down: the operation fails and the session closes through the usual
+ * completion. An operation that finds the submission queue full and the
+ * kernel taking none (it answers -EBUSY while completions pile up) is kept
+ * on a list and armed again after the next io_uring_enter().
+ */
+
+class UringLoop {
+public:
+    explicit UringLoop(int lfd) : lfd_(lfd) {}
+
+    /* Set up the ring; false (with the reason) if this kernel cannot run the loop. */
+    bool open(string& err) { return ring_.open(kEntries, kBufGroup, kBuffers, kBufSize, err); }
+    void run();
+
+private:
+    static constexpr unsigned kEntries  = 4096;
+    static constexpr uint16_t kBufGroup = 0;
+    static constexpr unsigned kBuffers  = 1024;   // provided recv buffers shared by every session
+    static constexpr unsigned kBufSize  = 4096;
+
+    enum Op : uint64_t { OpAccept = 1, OpRecv, OpSend, OpTick };
+    static uint64_t tag(Op op, int fd) { return (static_cast<uint64_t>(op) << 56) | static_cast<uint32_t>(fd); }
+
+    void arm_accept();
+    void arm_tick(int64_t at);
+    void arm_recv(ClientSession* session);
+    void arm_send(ClientSession* session);
+    void retry_unarmed();
+    void schedule_wakeup();
+    ClientSession* session_at(int fd) const;
+    void on_completion(const io_uring_cqe& cqe);
+    void on_accept(int cfd);
+    void start_session(int cfd, const sockaddr_in& caddr);
+    void advance(ClientSession* session, bool stepped);
+    void close_session(ClientSession* session);
+    void on_deadline(ClientSession* session);
+    void stop_accepting();
+
+    IoUring ring_;
+    int  lfd_;
+    bool accepting_ = true;
+    size_t live_ = 0;
+    int64_t    now_ = now_ms();  // as of the last wakeup
+    TimerWheel timers_{static_cast<uint64_t>(now_)};
+    __kernel_timespec tick_{};   // copied by the kernel when the timeout is submitted
+    int64_t  tick_at_  = 0;      // when the armed timeout fires, 0 if none
+    uint32_t tick_seq_ = 0;      // which timeout is the armed one; earlier ones are stale
+    PinnedCatalog catalog_;      // this loop's handle on the current snapshot
+    vector<unique_ptr<ClientSession>> sessions_;  // indexed by fd
+    vector<uint64_t> unarmed_;   // tags of operations that found no submission slot
+};
+
+void UringLoop::arm_accept() {
+    io_uring_sqe* s = ring_.sqe();
+    if (!s) { unarmed_.push_back(tag(OpAccept, lfd_)); return; }
+    s->opcode      = IORING_OP_ACCEPT;
+    s->fd          = lfd_;
+    s->ioprio      = IORING_ACCEPT_MULTISHOT;
+    s->accept_flags = SOCK_CLOEXEC;
+    s->user_data   = tag(OpAccept, lfd_);
+}
+
+/* No slot: schedule_wakeup() simply tries again before the next submit. */
+void UringLoop::arm_tick(int64_t at) {
+    io_uring_sqe* s = ring_.sqe();
+    if (!s) return;
+    int64_t ms = max<int64_t>(at - now_, 1);
+    tick_    = {ms / 1000, ms % 1000 * 1000000};
+    tick_at_ = at;
+    s->opcode    = IORING_OP_TIMEOUT;
+    s->addr      = reinterpret_cast<uint64_t>(&tick_);
+    s->len       = 1;
+    s->user_data = tag(OpTick, static_cast<int>(++tick_seq_));
+}
+
+void UringLoop::arm_recv(ClientSession* session) {
+    io_uring_sqe* s = ring_.sqe();
+    if (!s) { unarmed_.push_back(tag(OpRecv, session->fd)); return; }
+    s->opcode    = IORING_OP_RECV;
+    s->fd        = session->fd;
+    s->flags     = IOSQE_BUFFER_SELECT;
+    s->buf_group = ring_.buffer_group();
+    s->user_data = tag(OpRecv, session->fd);
+}
+
+void UringLoop::arm_send(ClientSession* session) {
+    io_uring_sqe* s = ring_.sqe();
+    if (!s) { unarmed_.push_back(tag(OpSend, session->fd)); return; }
+    s->opcode    = IORING_OP_SENDMSG;
+    s->fd        = session->fd;
+    s->addr      = reinterpret_cast<uint64_t>(session->outbuf.message());  // stays put until the completion
+    s->len       = 1;
+    s->msg_flags = MSG_NOSIGNAL | (session->outbuf.more_than_one_message() ? MSG_MORE : 0);
+    s->user_data = tag(OpSend, session->fd);
+}
+
+/*
+ * Arm again what found the submission queue full. A session on the list has
+ * nothing in flight, so nothing can have closed it in the meantime.
+ */
+void UringLoop::retry_unarmed() {
+    vector<uint64_t> again;
+    again.swap(unarmed_);
+    for (uint64_t t : again) {
+        Op  op = static_cast<Op>(t >> 56);
+        int fd = static_cast<int>(static_cast<uint32_t>(t));
+        if (op == OpAccept) {
+            if (accepting_) arm_accept();
+        } else if (ClientSession* session = session_at(fd)) {
+            if (op == OpRecv) arm_recv(session);
+            else arm_send(session);
+        }
+    }
+}
+
+ClientSession* UringLoop::session_at(int fd) const {
+    return static_cast<size_t>(fd) < sessions_.size() ? sessions_[static_cast<size_t>(fd)].get() : nullptr;
+}
+
+/* Make sure a timeout wakes the loop by the next deadline (sessions' or the idle rule's). */
+void UringLoop::schedule_wakeup() {
+    uint64_t next = timers_.next_event();
+    int64_t  due  = next == TimerWheel::kNever ? 0 : static_cast<int64_t>(next);
+    int64_t  idle = accepting_ ? idle_shutdown.deadline() : 0;
+    if (idle && (due == 0 || idle < due)) due = idle;
+    if (due && (tick_at_ == 0 || due < tick_at_)) arm_tick(due);
+}
+
+void UringLoop::run() {
+    arm_accept();
+
+    while (accepting_ || live_ > 0) {
+        schedule_wakeup();
+        int r = ring_.submit(1);
+        if (r < 0 && r != -EINTR && r != -EAGAIN && r != -EBUSY) {
+            logger.write(LogLevel::Error, "io_uring_enter: %e\n", -r);
+            break;
+        }
+        now_ = now_ms();
+        if (!unarmed_.empty()) retry_unarmed();
+        ring_.drain([this](const io_uring_cqe& cqe) { on_completion(cqe); });
+        timers_.advance(static_cast<uint64_t>(now_),
+                        [this](TimerWheel::Timer& t) { on_deadline(static_cast<ClientSession*>(t.owner)); });
+        int         cfd;
+        sockaddr_in caddr;
+        while (admission.next_waiting(cfd, caddr)) start_session(cfd, caddr);  // sessions ended this batch
+        if (accepting_ && !server_running.load()) stop_accepting();
+        if (accepting_ && idle_shutdown.expired(now_)) {
+            shut_down_idle();
+            stop_accepting();
+        }
+    }
+
+    if (accepting_) ::close(lfd_);
+    ring_.close();  // cancel whatever is still in flight before its sessions go away
+    for (auto& s : sessions_) {
+        if (s) close_session(s.get());
+    }
+}
+
+/* Keep serving connected clients, but take no new ones. */
+void UringLoop::stop_accepting() {
+    accepting_ = false;
+    ::shutdown(lfd_, SHUT_RDWR);  // ends the multishot accept
+    ::close(lfd_);
+}
+
+void UringLoop::on_completion(const io_uring_cqe& cqe) {
+    Op  op = static_cast<Op>(cqe.user_data >> 56);
+    int fd = static_cast<int>(static_cast<uint32_t>(cqe.user_data));
+
+    if (op == OpTick) {
+        if (static_cast<uint32_t>(fd) == tick_seq_) tick_at_ = 0;  // the loop re-arms if anything is still due
+        return;
+    }
+
+    if (op == OpAccept) {
+        if (cqe.res >= 0) {
+            on_accept(cqe.res);
+        } else if (accepting_ && server_running.load()) {
+            if (cqe.res != -EAGAIN && cqe.res != -EINTR) logger.write(LogLevel::Error, "accept: %e\n", -cqe.res);
+        }
+        if (!(cqe.flags & IORING_CQE_F_MORE) && accepting_ && server_running.load()) arm_accept();
+        return;
+    }
+
+    ClientSession* session = session_at(fd);
+    if (!session) return;
+
+    if (op == OpRecv) {
+        if (cqe.res == -ENOBUFS) { arm_recv(session); return; }  // every buffer busy; try again
+        if (cqe.res <= 0) { close_session(session); return; }   // EOF or error
+        unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        session->in.feed(ring_.buffer(bid), static_cast<size_t>(cqe.res));
+        bytes_received.add(cqe.res);
+        ring_.recycle(bid);
+        advance(session, false);
+        return;
+    }
+
+    // OpSend
+    if (cqe.res < 0) { close_session(session); return; }
+    const msghdr* sent = session->outbuf.message();  // what that send was given
+    size_t whole = 0;
+    for (size_t i = 0; i < sent->msg_iovlen; ++i) whole += sent->msg_iov[i].iov_len;
+    if (static_cast<size_t>(cqe.res) < whole) note_stall(session, true, now_);  // short: the socket is full
+    session->outbuf.consume(static_cast<size_t>(cqe.res));
+    bytes_sent.add(cqe.res);
+    if (!session->outbuf.empty()) { arm_send(session); return; }  // the turn's send deadline stands
+    note_stall(session, false, now_);
+    advance(session, true);  // the turn is out: the read deadline starts now
+}
+
+void UringLoop::on_accept(int cfd) {
+    sockaddr_in caddr{};
+    socklen_t   clen = sizeof(caddr);
+    ::getpeername(cfd, reinterpret_cast<sockaddr*>(&caddr), &clen);
+    if (admission.admit(cfd, caddr)) start_session(cfd, caddr);
+}
+
+void UringLoop::start_session(int cfd, const sockaddr_in& caddr) {
+    tune_socket(cfd);
+    active_clients.inc();
+    ++live_;
+
+    auto* session        = new ClientSession();
+    session->fd          = cfd;
+    session->client_addr = caddr;
+    session->store       = &catalog_store;
+    session->select_mode = config.select;
+    session->ends_at     = session_end(now_);
+    session->deadline.owner = session;
+    adopt_catalog(session, catalog_.get());
+    session->in.reset(cfd);
+    if (static_cast<size_t>(cfd) >= sessions_.size()) sessions_.resize(static_cast<size_t>(cfd) + 1);
+    sessions_[static_cast<size_t>(cfd)].reset(session);
+    log_connect(session);
+
+    session->rng.seed(session_seeds.next());
+
+    start_joke(session);
+    advance(session, true);
+}
+
+/*
+ * The session's only operation just finished: run every complete buffered
+ * line through the state machine, then send what it queued, wait for more
+ * input, or hang up. The deadline moves with the wait: a turn handed to the
+ * kernel must go out within the send deadline, and a client that was just
+ * answered (`stepped`) gets a fresh read deadline.
+ */
+void UringLoop::advance(ClientSession* session, bool stepped) {
+    stepped |= answer_lines(session);  // the rest wait for this send when over the output budget
+    int64_t at;
+    if (!session->outbuf.empty()) {
+        arm_send(session);
+        at = config.send_timeout > 0 ? now_ + config.send_timeout * 1000LL : 0;
+        if (session->ends_at && (at == 0 || session->ends_at < at)) at = session->ends_at;
+    } else if (session->state == SessionState::Closing) {
+        close_session(session);
+        return;
+    } else {
+        arm_recv(session);
+        if (!stepped) return;  // still waiting for the same line: its deadline stands
+        at = session_deadline(session, now_);
+    }
+    if (at) timers_.arm(session->deadline, static_cast<uint64_t>(at));
+    else timers_.cancel(session->deadline);
+}
+
+void UringLoop::close_session(ClientSession* session) {
+    int fd = session->fd;
+    timers_.cancel(session->deadline);
+    note_stall(session, false, now_);
+    ::close(fd);
+    log_disconnect(session->client_addr);
+    sessions_[static_cast<size_t>(fd)].reset();
+    --live_;
+}
+
+/* Deadline passed with an operation in flight: shut the socket down, and its completion closes the session. */
+void UringLoop::on_deadline(ClientSession* session) {
+    log_expiry(session, now_, session->outbuf.size());
+    ::shutdown(session->fd, SHUT_RDWR);
+}
+
+// ------------------------------ Worker pool ------------------------------
+
+/*
+ * --mode=pool: a fixed set of worker threads (--workers=N; default one per
+ * CPU) instead of a pthread per connection. The main thread only waits for
+ * readiness: it accepts new clients and turns each ready socket into a job
+ * for the work-stealing pool (pool.h). A job is one session step, the same
+ * non-blocking state-machine step the reactor runs: read what arrived, answer
+ * every complete line, write what the socket takes.
+ *
+ * Sockets are registered EPOLLONESHOT, so after an event the session is
+ * disarmed until the job that handles it re-arms it (or closes it): at most
+ * one worker touches a session at a time, yet consecutive steps of the same
+ * session can run on different workers. A connection costs no thread
+ * creation or teardown.
+ *
+ * Deadlines are kept by the epoll thread, in a TimerWheel behind a mutex,
+ * and it never touches a session's buffers. A step publishes the session's
+ * next deadline in an atomic and only takes the lock when that is earlier
+ * than the timer already armed; a later one is picked up when the timer
+ * fires and finds it has not come yet. A session whose deadline has come is
+ * shut down under the lock, so the next step sees the error and closes it.
+ */
+
+struct PoolSession : ClientSession {
+    bool armed = false;  // registered with epoll yet (first step sends "Knock knock!" first)
+    atomic<int64_t> stall_since{0};  // stalled_since, for the deadline handler
+    atomic<int64_t> stall_bytes{0};  // output pending while stalled
+    atomic<int64_t> due{0};          // deadline as the last step left it (steady ms, 0: none)
+    atomic<int64_t> timer_at{0};     // what the wheel timer is armed for, 0 if not armed (set under the lock)
+
+    static void* operator new(size_t) { return Slab<PoolSession>::get(); }
+    static void  operator delete(void* p) { Slab<PoolSession>::put(p); }
+};
+
+class PoolServer {
+public:
+    PoolServer(int lfd, unsigned workers) : lfd_(lfd), pool_(workers) {}
+    ~PoolServer() {
+        if (epfd_ >= 0) ::close(epfd_);
+        if (wake_fd_ >= 0) ::close(wake_fd_);
+    }
+
+    void run();
+
+private:
+    static void step_job(void* arg);
+    void accept_clients();
+    void start_session(int cfd, const sockaddr_in& caddr);
+    void start_waiting();
+    void step(PoolSession* session);
+    void close_session(PoolSession* session);
+    void set_deadline(PoolSession* session, int64_t at);
+    void on_deadline(PoolSession* session, int64_t now);
+
+    int lfd_;
+    int epfd_ = -1;
+    int wake_fd_ = -1;        // a step moved a deadline earlier than the epoll thread sleeps
+    bool accepting_ = true;
+    atomic<size_t> live_{0};  // sessions accepted and not yet closed
+    mutex      timers_m_;     // guards timers_, and closing a session's fd
+    TimerWheel timers_{static_cast<uint64_t>(now_ms())};
+    WorkerPool pool_;
+};
+
+static PoolServer* pool_server = nullptr;  // for step_job()
+
+/* Watch `fd` for input with `tag` as its epoll data. */
+static bool watch_fd(int epfd, int fd, void* tag) {
+    epoll_event ev{};
+    ev.events   = EPOLLIN;
+    ev.data.ptr = tag;
+    return ::epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+void PoolServer::run() {
+    pool_server = this;
+    epfd_    = ::epoll_create1(EPOLL_CLOEXEC);
+    wake_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epfd_ < 0 || wake_fd_ < 0) { log_errno("epoll_create1"); return; }
+
+    set_nonblocking(lfd_);
+    // nullptr marks the listening socket; the eventfds are marked by their owners
+    if (!watch_fd(epfd_, lfd_, nullptr) || !watch_fd(epfd_, wake_fd_, &wake_fd_) ||
+        !watch_fd(epfd_, idle_shutdown.fd(), &idle_shutdown)) {
+        log_errno("epoll_ctl");
+        return;
+    }
+
+    vector<epoll_event> events(1024);
+    while (accepting_ || live_.load() > 0) {
+        int64_t now = now_ms();
+        int timeout;
+        {
+            lock_guard<mutex> lk(timers_m_);
+            timeout = timers_.timeout(static_cast<uint64_t>(now));
+        }
+        if (accepting_) timeout = min_timeout(timeout, idle_shutdown.timeout(now));
+        int n = ::epoll_wait(epfd_, events.data(), static_cast<int>(events.size()), timeout);
+        if (n < 0 && errno != EINTR) { log_errno("epoll_wait"); break; }
+
+        for (int i = 0; i < n; ++i) {
+            void* tag = events[i].data.ptr;
+            if (tag == nullptr) accept_clients();
+            else if (tag == &idle_shutdown) idle_shutdown.drain();
+            else if (tag == &wake_fd_) { uint64_t v; [[maybe_unused]] ssize_t r = ::read(wake_fd_, &v, sizeof(v)); }
+            else pool_.submit(step_job, tag);  // disarmed until that step re-arms it
+        }
+
+        now = now_ms();
+        {
+            lock_guard<mutex> lk(timers_m_);
+            timers_.advance(static_cast<uint64_t>(now),
+                            [&](TimerWheel::Timer& t) { on_deadline(static_cast<PoolSession*>(t.owner), now); });
+        }
+        start_waiting();  // in case every session ended while a client was being queued
+
+        if (accepting_ && !server_running.load()) {
+            // Stop accepting; keep serving the sessions already connected
+            ::epoll_ctl(epfd_, EPOLL_CTL_DEL, lfd_, nullptr);
+            accepting_ = false;
+        }
+        if (accepting_ && idle_shutdown.expired(now)) {
+            shut_down_idle();
+            break;
+        }
+    }
+
+    ::close(lfd_);
+    pool_.stop();
+}
+
+void PoolServer::accept_clients() {
+    while (true) {
+        sockaddr_in caddr{};
+        socklen_t   clen = sizeof(caddr);
+        int cfd = ::accept4(lfd_, reinterpret_cast<sockaddr*>(&caddr), &clen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (cfd < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == EMFILE || errno == ENFILE) { log_errno("accept4"); return; }
+            if (server_running.load()) log_errno("accept4");
+            return;
+        }
+        if (admission.admit(cfd, caddr)) start_session(cfd, caddr);
+    }
+}
+
+/* Clients that were waiting for a slot; called by the accept loop and by workers that closed a session. */
+void PoolServer::start_waiting() {
+    int         cfd;
+    sockaddr_in caddr;
+    while (admission.next_waiting(cfd, caddr)) start_session(cfd, caddr);
+}
+
+/* Any thread: the session's first step goes to the pool. */
+void PoolServer::start_session(int cfd, const sockaddr_in& caddr) {
+    tune_socket(cfd);
+    active_clients.inc();
+    live_.fetch_add(1);
+
+    auto* session        = new PoolSession();
+    session->fd          = cfd;
+    session->client_addr = caddr;
+    session->store       = &catalog_store;
+    session->select_mode = config.select;
+    int64_t now          = now_ms();
+    session->ends_at     = session_end(now);
+    session->deadline.owner = session;
+    adopt_catalog(session, thread_catalog());
+    session->in.reset(cfd);
+    log_connect(session);
+
+    session->rng.seed(session_seeds.next());
+
+    // Arm the first deadline here, so the first step finds a timer that fires in time
+    if (int64_t at = session_deadline(session, now)) {
+        {
+            lock_guard<mutex> lk(timers_m_);
+            session->due.store(at);
+            timers_.arm(session->deadline, static_cast<uint64_t>(at));
+            session->timer_at.store(at);
+        }
+        if (WorkerPool::current_worker() >= 0) {
+            uint64_t one = 1;  // the epoll thread may be asleep until later
+            [[maybe_unused]] ssize_t n = ::write(wake_fd_, &one, sizeof(one));
+        }
+    }
+    pool_.submit(step_job, session);  // the first step tells "Knock knock!" and registers the socket
+}
+
+void PoolServer::step_job(void* arg) { pool_server->step(static_cast<PoolSession*>(arg)); }
+
+/* One session step on a worker; ends by re-arming the socket or closing it. */
+void PoolServer::step(PoolSession* session) {
+    bool stepped = !session->armed;  // answered the client: the read deadline starts over
+    if (!session->armed) {
+        start_joke(session);
+    } else {
+        while (true) {
+            ssize_t n = session->in.fill();
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (n <= 0) { close_session(session); return; }  // EOF or error
+            bytes_received.add(n);
+
+            stepped |= answer_lines(session);
+            if (session->outbuf.size() >= config.max_output) break;  // over budget: read on once it drains
+            // A short read drained the socket; a re-armed level-triggered socket reports any later bytes
+            if (static_cast<size_t>(n) < LineReader::kChunk) break;
+        }
+    }
+
+    if (!flush_and_answer(session)) { close_session(session); return; }
+    bool pending = !session->outbuf.empty();
+    if (!pending && session->state == SessionState::Closing) { close_session(session); return; }
+    if (stepped || pending != (session->stalled_since != 0)) {
+        int64_t now = now_ms();
+        note_stall(session, pending, now);
+        session->stall_since.store(session->stalled_since, memory_order_relaxed);
+        session->stall_bytes.store(static_cast<int64_t>(session->stall_bytes), memory_order_relaxed);
+        set_deadline(session, session_deadline(session, now));
+    }
+
+    epoll_event ev{};
+    ev.events   = (pending ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+    ev.data.ptr = session;
+    int op = session->armed ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    session->armed = true;
+    if (::epoll_ctl(epfd_, op, session->fd, &ev) < 0) {  // the session may be picked up right after this
+        log_errno("epoll_ctl");
+        close_session(session);
+    }
+}
+
+/*
+ * Publish the session's new deadline (from a step). The lock is only taken
+ * when the armed timer would fire too late for it.
+ */
+void PoolServer::set_deadline(PoolSession* session, int64_t at) {
+    session->due.store(at);
+    int64_t armed = session->timer_at.load();
+    if (at == 0 || (armed != 0 && armed <= at)) return;  // that timer fires first and re-arms from `due`
+    {
+        lock_guard<mutex> lk(timers_m_);
+        timers_.arm(session->deadline, static_cast<uint64_t>(at));
+        session->timer_at.store(at);
+    }
+    uint64_t one = 1;  // the epoll thread may be asleep until later
+    [[maybe_unused]] ssize_t n = ::write(wake_fd_, &one, sizeof(one));
+}
+
+/* On the epoll thread, under timers_m_: the session's timer fired. */
+void PoolServer::on_deadline(PoolSession* session, int64_t now) {
+    int64_t due = session->due.load();
+    if (due == 0 || due <= now) {
+        session->timer_at.store(0);
+        due = session->due.load();  // a step that saw the timer still armed has published by now
+    }
+    if (due > now) {  // the session stepped since: wait for its new deadline
+        timers_.arm(session->deadline, static_cast<uint64_t>(due));
+        session->timer_at.store(due);
+        return;
+    }
+    if (due == 0) return;
+    size_t unsent = session->stall_since.load(memory_order_relaxed) ? session->stall_bytes.load(memory_order_relaxed) : 0;
+    log_expiry(session, now, unsent);
+    ::shutdown(session->fd, SHUT_RDWR);  // its armed event fires; that step fails and closes
+}
+
+void PoolServer::close_session(PoolSession* session) {
+    note_stall(session, false, now_ms());
+    {
+        lock_guard<mutex> lk(timers_m_);  // the deadline handler must not shut down a reused fd
+        timers_.cancel(session->deadline);
+        ::close(session->fd);  // also drops it from the epoll set
+    }
+    log_disconnect(session->client_addr);
+    delete session;
+    live_.fetch_sub(1);
+    start_waiting();
+}
+
+// ---------------------------- Coroutine loops ----------------------------
+
+/*
+ * --mode=coro: each client is one coroutine, tell_jokes() in session.h, that
+ * reads like the blocking thread-per-client code (`co_await conn.read_line()`)
+ * but suspends instead of blocking. A session is a pooled coroutine frame
+ * holding its ClientSession, not a pthread with its own stack.
+ *
+ * A few event-loop threads (--reactors=N; default one per CPU) each own a
+ * SO_REUSEPORT listener, an epoll instance and the coroutines they accepted;
+ * a coroutine is resumed on the loop that started it, so frames are recycled
+ * without locks. Each connection waits with its read, send and lifetime
+ * deadlines (coro::Conn), which the loop's timer wheel enforces. Loop 0 runs
+ * the 10 s idle rule in a coroutine of its own that waits on the rule's eventfd.
+ */
+class CoroLoop {
+public:
+    CoroLoop(int lfd, size_t index) : lfd_(lfd), index_(index) {}
+
+    void run();
+
+private:
+    coro::Detached accept_clients();
+    coro::Detached serve_client(int fd, sockaddr_in addr);
+    void start_waiting();
+    coro::Detached watch_idle();
+
+    coro::EventLoop loop_;
+    coro::Waiter    listen_waiter_;
+    int    lfd_;
+    size_t index_;                  // 0 runs the server-wide idle rule
+    bool   accepting_ = true;
+    size_t live_ = 0;               // client coroutines this loop owns
+    PinnedCatalog   catalog_;       // this loop's handle on the current snapshot
+};
+
+void CoroLoop::run() {
+    set_counter_shard(index_);
+    if (!loop_.ok()) { log_errno("epoll_create1"); return; }
+    set_nonblocking(lfd_);
+    if (!loop_.add(lfd_, &listen_waiter_)) { log_errno("epoll_ctl"); return; }
+    loop_.set_stall_hook(count_stall);
+    loop_.set_io_hook(count_io);
+
+    accept_clients();  // runs until the listener is shut down
+    if (index_ == 0) watch_idle();
+    loop_.run([this] { return !accepting_ && live_ == 0; });
+    ::close(lfd_);
+}
+
+coro::Detached CoroLoop::accept_clients() {
+    while (server_running.load()) {
+        sockaddr_in caddr{};
+        socklen_t   clen = sizeof(caddr);
+        int cfd = ::accept4(lfd_, reinterpret_cast<sockaddr*>(&caddr), &clen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (cfd < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { co_await coro::ReadyAwaiter{listen_waiter_}; continue; }
+            if (errno == EMFILE || errno == ENFILE) { log_errno("accept4"); co_await coro::ReadyAwaiter{listen_waiter_}; continue; }
+            if (server_running.load()) log_errno("accept4");
+            break;
+        }
+        if (admission.admit(cfd, caddr)) serve_client(cfd, caddr);  // runs until its first wait, then comes back here
+        else start_waiting();  // in case every session ended while this one was being queued
+    }
+    accepting_ = false;
+}
+
+coro::Detached CoroLoop::serve_client(int fd, sockaddr_in addr) {
+    tune_socket(fd);
+    active_clients.inc();
+    ++live_;
+
+    ClientSession session;
+    session.fd          = fd;
+    session.client_addr = addr;
+    session.store       = &catalog_store;
+    session.select_mode = config.select;
+    session.ends_at     = session_end(loop_.now());
+    adopt_catalog(&session, catalog_.get());
+    session.in.reset(fd);
+    log_connect(&session);
+
+    session.rng.seed(session_seeds.next());
+
+    coro::Conn conn(loop_, fd, session.in, session.outbuf, config.max_output);
+    conn.set_deadlines(config.read_timeout * 1000LL, config.send_timeout * 1000LL, session.ends_at);
+    if (conn.ok()) {
+        co_await tell_jokes(conn, &session);
+        co_await conn.flush();
+        switch (conn.expired()) {
+        case coro::Conn::Expired::No:       break;
+        case coro::Conn::Expired::Send:     log_eviction(&session, session.outbuf.size()); break;
+        case coro::Conn::Expired::Read:     log_timeout(&session, false); break;
+        case coro::Conn::Expired::Lifetime: log_timeout(&session, true); break;
+        }
+    } else {
+        log_errno("epoll_ctl");
+    }
+
+    ::close(fd);
+    --live_;
+    log_disconnect(addr);
+    start_waiting();
+}
+
+/* Clients that were waiting for a slot start on this loop, now that a session here ended. */
+void CoroLoop::start_waiting() {
+    int         cfd;
+    sockaddr_in caddr;
+    while (admission.next_waiting(cfd, caddr)) serve_client(cfd, caddr);
+}
+
+/* Loop 0: the idle rule, asleep until its deadline or until a poke re-arms it (see IdleShutdown). */
+coro::Detached CoroLoop::watch_idle() {
+    coro::Waiter waiter;
+    if (!loop_.add(idle_shutdown.fd(), &waiter)) { log_errno("epoll_ctl"); co_return; }
+    while (accepting_ && server_running.load()) {
+        co_await loop_.wait(waiter, idle_shutdown.deadline());
+        idle_shutdown.drain();
+        if (accepting_ && idle_shutdown.expired(loop_.now())) {
+            shut_down_idle();  // wakes every loop's accept coroutine
+            break;
+        }
+    }
+    loop_.remove(idle_shutdown.fd());  // `waiter` goes away with this frame
+}
+
+/* --mode=coro: one thread per listener, each running its own CoroLoop. */
+static void run_coro_loops() {
+    vector<thread> loops;
+    for (size_t i = 0; i < listen_fds.size(); ++i) {
+        loops.emplace_back([i] { CoroLoop(listen_fds[i], i).run(); });
+    }
+    for (auto& t : loops) t.join();
+}
+
+/* Let the reactor hold as many sockets as the hard limit allows. */
+static void raise_fd_limit() {
+    rlimit rl{};
+    if (::getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        ::setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+// ------------------------------ Arguments ------------------------------
+
+static bool parse_args(int argc, char** argv, ServerConfig& cfg) {
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--mode=threads") {
+            cfg.mode = ServerMode::Threads;
+        } else if (arg == "--mode=epoll") {
+            cfg.mode = ServerMode::Epoll;
+        } else if (arg == "--mode=uring") {
+            cfg.mode = ServerMode::Uring;
+        } else if (arg == "--mode=sharded") {
+            cfg.mode = ServerMode::Sharded;
+        } else if (arg == "--mode=coro") {
+            cfg.mode = ServerMode::Coro;
+        } else if (arg == "--mode=pool") {
+            cfg.mode = ServerMode::Pool;
+        } else if (arg.rfind("--workers=", 0) == 0) {
+            int n = atoi(arg.c_str() + 10);
+            if (n < 1 || n > 1024) {
+                cerr << "Workers must be in 1..1024\n";
+                return false;
+            }
+            cfg.workers = static_cast<unsigned>(n);
+        } else if (arg.rfind("--reactors=", 0) == 0) {
+            int n = atoi(arg.c_str() + 11);
+            if (n < 1 || n > 1024) {
+                cerr << "Reactors must be in 1..1024\n";
+                return false;
+            }
+            cfg.reactors = static_cast<unsigned>(n);
+        } else if (arg == "--select=bitset") {
+            cfg.select = SelectMode::Bitset;
+        } else if (arg == "--select=feistel") {
+            cfg.select = SelectMode::Feistel;
+        } else if (arg.rfind("--db=", 0) == 0) {
+            cfg.db_path = arg.substr(5);
+        } else if (arg.rfind("--catalog=", 0) == 0) {
+            cfg.catalog_path = arg.substr(10);
+        } else if (arg.rfind("--load-threads=", 0) == 0) {
+            int n = atoi(arg.c_str() + 15);
+            if (n < 1 || n > 64) {
+                cerr << "Load threads must be in 1..64\n";
+                return false;
+            }
+            cfg.load_threads = static_cast<unsigned>(n);
+        } else if (arg.rfind("--max-output=", 0) == 0) {
+            long long n = atoll(arg.c_str() + 13);
+            if (n < 1024) {
+                cerr << "Output budget must be at least 1024 bytes\n";
+                return false;
+            }
+            cfg.max_output = static_cast<size_t>(n);
+        } else if (arg.rfind("--send-timeout=", 0) == 0) {
+            int n = atoi(arg.c_str() + 15);
+            if (n < 0 || n > 86400) {
+                cerr << "Send timeout must be in 0..86400 seconds\n";
+                return false;
+            }
+            cfg.send_timeout = n;
+        } else if (arg.rfind("--read-timeout=", 0) == 0) {
+            int n = atoi(arg.c_str() + 15);
+            if (n < 0 || n > 86400) {
+                cerr << "Read timeout must be in 0..86400 seconds\n";
+                return false;
+            }
+            cfg.read_timeout = n;
+        } else if (arg.rfind("--max-session=", 0) == 0) {
+            int n = atoi(arg.c_str() + 14);
+            if (n < 0 || n > 30 * 86400) {
+                cerr << "Session limit must be in 0..2592000 seconds\n";
+                return false;
+            }
+            cfg.max_session = n;
+        } else if (arg.rfind("--max-memory=", 0) == 0) {
+            long long n = atoll(arg.c_str() + 13);
+            if (n < 0) {
+                cerr << "Memory cap must be a number of MiB (0: none)\n";
+                return false;
+            }
+            cfg.max_memory = n << 20;
+        } else if (arg.rfind("--max-clients=", 0) == 0) {
+            long long n = atoll(arg.c_str() + 14);
+            if (n < 0) {
+                cerr << "Session limit must be a number of clients (0: none)\n";
+                return false;
+            }
+            cfg.max_clients = n;
+        } else if (arg.rfind("--queue=", 0) == 0) {
+            long long n = atoll(arg.c_str() + 8);
+            if (n < 0 || n > 1000000) {
+                cerr << "Queue length must be in 0..1000000\n";
+                return false;
+            }
+            cfg.queue = static_cast<size_t>(n);
+        } else if (arg.rfind("--ip-rate=", 0) == 0) {
+            double r = atof(arg.c_str() + 10);
+            if (r < 0 || r > 1e6) {
+                cerr << "Per-address rate must be in 0..1000000 connections per second\n";
+                return false;
+            }
+            cfg.ip_rate = r;
+        } else if (arg.rfind("--ip-burst=", 0) == 0) {
+            int n = atoi(arg.c_str() + 11);
+            if (n < 1 || n > 1000000) {
+                cerr << "Per-address burst must be in 1..1000000\n";
+                return false;
+            }
+            cfg.ip_burst = static_cast<unsigned>(n);
+        } else if (arg.rfind("--ip-max-conns=", 0) == 0) {
+            int n = atoi(arg.c_str() + 15);
+            if (n < 0 || n > 65534) {
+                cerr << "Per-address connection cap must be in 0..65534\n";
+                return false;
+            }
+            cfg.ip_max_conns = static_cast<unsigned>(n);
+        } else if (arg.rfind("--seed=", 0) == 0) {
+            char* end = nullptr;
+            errno = 0;
+            cfg.seed = strtoull(arg.c_str() + 7, &end, 0);
+            if (errno || end == arg.c_str() + 7 || *end) {
+                cerr << "Seed must be a 64-bit unsigned number\n";
+                return false;
+            }
+            cfg.fixed_seed = true;
+        } else if (arg.rfind("--log-level=", 0) == 0) {
+            string v = arg.substr(12);
+            if (v == "error") cfg.log_level = LogLevel::Error;
+            else if (v == "warn") cfg.log_level = LogLevel::Warn;
+            else if (v == "info") cfg.log_level = LogLevel::Info;
+            else if (v == "debug") cfg.log_level = LogLevel::Debug;
+            else {
+                cerr << "Log level must be error, warn, info or debug\n";
+                return false;
+            }
+        } else if (arg.rfind("--log-sample=", 0) == 0) {
+            long n = strtol(arg.c_str() + 13, nullptr, 10);
+            if (n < 1 || n > 1000000) {
+                cerr << "Log sampling must be in 1..1000000 (1: every connection)\n";
+                return false;
+            }
+            cfg.log_sample = static_cast<unsigned>(n);
+        } else if (arg.rfind("--admin-port=", 0) == 0) {
+            long n = strtol(arg.c_str() + 13, nullptr, 10);
+            if (n < 1 || n > 65535) {
+                cerr << "Admin port must be in 1..65535\n";
+                return false;
+            }
+            cfg.admin_port = static_cast<int>(n);
+        } else if (arg.rfind("--port=", 0) == 0) {
+            try {
+                cfg.port = stoi(arg.substr(7));
+            } catch (...) {
+                cfg.port = 0;
+            }
+            if (cfg.port <= 0 || cfg.port > 65535) {
+                cerr << "Port must be in 1..65535\n";
+                return false;
+            }
+        } else {
+            cerr << "Usage: " << argv[0] << " [--mode=threads|epoll|sharded|uring|coro|pool] [--reactors=N] [--workers=N] [--select=bitset|feistel] [--port=N] [--db=PATH] [--catalog=FILE] [--load-threads=N] [--max-output=BYTES] [--send-timeout=S] [--read-timeout=S] [--max-session=S] [--max-memory=MB] [--max-clients=N] [--queue=N] [--ip-rate=R] [--ip-burst=B] [--ip-max-conns=N] [--seed=N] [--log-level=error|warn|info|debug] [--log-sample=N] [--admin-port=N]\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// --------------------------------- Main ---------------------------------
+
+int main(int argc, char** argv) {
+    if (!parse_args(argc, argv, config)) return 1;
+    logger.set_level(config.log_level);
+    logger.start();
+    if (config.max_memory < 0) {
+        long pages = ::sysconf(_SC_PHYS_PAGES);
+        config.max_memory = pages > 0 ? pages / 4 * 3 * ::sysconf(_SC_PAGESIZE) : 0;
+    }
+    if (config.max_clients < 0) config.max_clients = config.mode == ServerMode::Threads ? MAX_CLIENTS : 0;
+    admission.configure(config.max_clients, config.queue);
+    if (!config.fixed_seed) config.seed = startup_seed();
+    session_seeds.reset(config.seed);
+
+    // Load jokes from SQLite DB (or map the compiled catalog)
+    auto initial = make_shared<Catalog>();
+    load_catalog(*initial);
+    if (initial->empty()) {
+        logger.write(LogLevel::Error, "No jokes found in database!\n");
+        return 1;
+    }
+    catalog_store.publish(std::move(initial));
+
+    // Basic signal setup
+    ::signal(SIGPIPE, SIG_IGN);
+    ::signal(SIGINT,  signal_handler);
+    ::signal(SIGTERM, signal_handler);
+
+    // Listening socket(s): in sharded and coro mode one per event loop, all bound to the same port
+    vector<int> cpus = allowed_cpus();
+    bool   per_loop  = config.mode == ServerMode::Sharded || config.mode == ServerMode::Coro;
+    size_t listeners = 1;
+    if (per_loop) listeners = config.reactors ? config.reactors : cpus.size();
+
+    // A full-size accept queue in every mode: admission control, not the backlog, caps the sessions
+    int backlog = SOMAXCONN;
+
+    for (size_t i = 0; i < listeners; ++i) {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) { log_errno("socket"); return 1; }
+        listen_fds.push_back(fd);
+
+        int opt = 1;
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if (per_loop &&
+            ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+            log_errno("setsockopt(SO_REUSEPORT)");
+            return 1;
+        }
+
+        sockaddr_in addr{};
+        addr.sin_family      = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port        = htons(static_cast<uint16_t>(config.port));
+
+        if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) { log_errno("bind"); return 1; }
+        if (::listen(fd, backlog) < 0) { log_errno("listen"); return 1; }
+    }
+
+    logger.write(LogLevel::Info, "Server listening on port %d...\n", config.port);
+    logger.write(LogLevel::Info, "Joke order seed: %u %s\n", config.seed, config.fixed_seed ? "(fixed)" : "(--seed=N to replay)");
+    logger.write(LogLevel::Info, "Press Ctrl+C to stop the server gracefully.\n");
+
+    // Reload on SIGHUP or when the database changes
+    if (::pipe2(reload_pipe, O_NONBLOCK | O_CLOEXEC) < 0) { log_errno("pipe2"); return 1; }
+    ::signal(SIGHUP, reload_signal_handler);
+    ::signal(SIGUSR1, stats_signal_handler);
+    if (!idle_shutdown.open()) { log_errno("eventfd"); return 1; }
+    if (config.admin_port) {
+        admin_fd = open_admin_listener(config.admin_port);
+        if (admin_fd < 0) { log_errno("admin port"); return 1; }
+        logger.write(LogLevel::Info, "Metrics on http://127.0.0.1:%d/metrics\n", config.admin_port);
+    }
+    idle_shutdown.arm();  // no clients yet: the 10 s rule applies from the start
+    thread watcher(catalog_watcher, config.catalog_path.empty() ? config.db_path : config.catalog_path);
+
+    if (config.mode == ServerMode::Sharded) {
+        raise_fd_limit();
+        logger.write(LogLevel::Info, "Running %u reactors.\n", listen_fds.size());
+        run_sharded(cpus);
+    } else if (config.mode == ServerMode::Pool) {
+        raise_fd_limit();
+        unsigned workers = config.workers ? config.workers : static_cast<unsigned>(cpus.size());
+        logger.write(LogLevel::Info, "Running %u pool workers.\n", workers);
+        PoolServer(listen_fds[0], workers).run();
+    } else if (config.mode == ServerMode::Coro) {
+        raise_fd_limit();
+        logger.write(LogLevel::Info, "Running %u coroutine event loops.\n", listen_fds.size());
+        run_coro_loops();
+    } else if (config.mode == ServerMode::Uring) {
+        raise_fd_limit();
+        UringLoop loop(listen_fds[0]);
+        string err;
+        if (loop.open(err)) {
+            logger.write(LogLevel::Info, "Using io_uring.\n");
+            loop.run();
+        } else {
+            logger.text(LogLevel::Info, "io_uring unavailable (" + err + "); falling back to epoll.\n");
+            Reactor(listen_fds[0]).run();
+        }
+    } else if (config.mode == ServerMode::Epoll) {
+        raise_fd_limit();
+        Reactor(listen_fds[0]).run();
+    } else {
+        run_thread_per_client();
+    }
+
+    admission.turn_away_waiting();
+
+    char quit = 'q';
+    [[maybe_unused]] ssize_t wn = ::write(reload_pipe[1], &quit, 1);
+    watcher.join();
+
+    logger.write(LogLevel::Info, "Server shut down successfully.\n");
+    logger.stop();
     return 0;
 }
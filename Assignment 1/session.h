@@ -0,0 +1,436 @@
+/*
+ * session.h
+ * ---------
+ * Per-client conversation state machine for the knock-knock server.
+ *
+ * The I/O drivers in server.cpp (thread-per-client, epoll reactor) only move
+ * bytes: they call start_joke() once, feed every complete client line to
+ * on_client_line(), and send whatever was queued in `outbuf` (out_queue.h). All protocol
+ * decisions live here, so every driver speaks exactly the same protocol.
+ * tell_jokes() is the same conversation written as one coroutine, for the
+ * coroutine driver (coro.h); the self-tests hold the two to identical bytes.
+ *
+ * Steady state is allocation-free: outgoing lines are pre-rendered frames
+ * (compile-time constants or views into the Catalog heap) appended to a
+ * reused buffer, replies are matched in place against pre-lowered text
+ * (reply_match.h), and jokes are drawn from a per-session bitset (selector.h).
+ *
+ * A session is also small: about 240 bytes once it waits for its client,
+ * because input and output buffers are only held while they have bytes in
+ * them. Sessions are allocated from a slab (slab.h), so a million idle
+ * connections cost about a quarter of a gigabyte of user memory (bench.cpp,
+ * "sessions").
+ *
+ * The conversation counts what happens in it (jokes told, corrections, Y/N
+ * re-prompts) in protocol_counters, sharded per thread, for the server's
+ * metrics endpoint. It also times its steps into protocol_latency: accept to
+ * the first "Knock knock!", the client's think time per prompt, the server's
+ * time per reply, and each joke from "Knock knock!" to punchline.
+ */
+
+#pragma once
+
+#include "catalog.h"
+#include "coro.h"
+#include "counters.h"
+#include "latency.h"
+#include "line_reader.h"
+#include "out_queue.h"
+#include "reply_match.h"
+#include "selector.h"
+#include "slab.h"
+#include "timer_wheel.h"
+
+#include <netinet/in.h>
+
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+
+// ------------------------------ Wire frames ------------------------------
+
+constexpr std::string_view kKnockFrame       = "Knock knock! <input>\n";
+constexpr std::string_view kAnotherFrame     = "Would you like to listen to another? (Y/N) <input>\n";
+constexpr std::string_view kWhosThereCorrect = "You are supposed to say, \"Who's there?\". Let's try again.\n";
+constexpr std::string_view kYesNoFrame       = "Please reply with Y or N.\n";
+constexpr std::string_view kNoMoreJokesFrame = "I have no more jokes to tell.\n";
+constexpr std::string_view kPipelineFrame    = "Pipelining on.\n";
+constexpr std::string_view kNewline          = "\n";
+
+// Expected replies, already trimmed and lower-cased
+constexpr std::string_view kExpectWhosThere = "who's there?";
+constexpr std::string_view kExpectPipeline  = "pipeline";
+constexpr std::string_view kExpectBatch     = "batch ";  // followed by the joke count
+
+constexpr size_t kMaxBatch = 1000;  // jokes one "BATCH <n>" may ask for
+
+// ---------------------------- Session state ----------------------------
+
+/*
+ * Where a session is in the conversation, i.e. which client line it waits for.
+ * Every transition happens in on_client_line().
+ */
+enum class SessionState : uint8_t {
+    AwaitWhosThere,   // sent "Knock knock! <input>"
+    AwaitSetupWho,    // sent "<setup> <input>"
+    AwaitAnother,     // sent "Would you like to listen to another? (Y/N) <input>"
+    Closing,          // flush pending output, then hang up
+};
+
+struct ClientSession {
+    int fd = -1;                     // connected socket
+    SelectMode   select_mode = SelectMode::Bitset;
+    SessionState state = SessionState::Closing;
+    bool negotiable = true;          // no client line yet: "PIPELINE" may still be asked for
+    bool want_write = false;         // registered for EPOLLOUT instead of EPOLLIN (reactor)
+    JokePicker told_jokes;           // joke indices already told to this client (bitset mode)
+    PermutationPicker shuffle;       // this client's joke order (feistel mode)
+    Pcg32 rng;                       // RNG for random joke order
+    sockaddr_in client_addr{};       // for logging
+
+    const CatalogStore* store = nullptr;       // where newer snapshots appear (may be null)
+    std::shared_ptr<const Catalog> snapshot;   // keeps `catalog` alive across reloads
+    const Catalog* catalog = nullptr;          // snapshot the current joke is drawn from
+    uint32_t joke = 0;               // index of the joke in progress (a catalog holds fewer than 2^32)
+    uint32_t stall_bytes = 0;        // output pending when the client stopped taking it (stall gauges)
+    LineReader in{-1, 4096};         // buffered input; keeps pipelined bytes between lines
+    OutQueue outbuf;                 // frames queued for the client, not yet sent
+    int64_t stalled_since = 0;       // steady ms when the client stopped taking output, 0 if it keeps up
+    int64_t ends_at = 0;             // steady ms when the session's lifetime runs out, 0: no limit
+    TimerWheel::Timer deadline;      // the event loop's timer for the current wait (owner: this session)
+    latency::Stamp step_at = latency::stamp(latency::now());  // last prompt queued (until the first, when the session began)
+    latency::Stamp joke_at = 0;      // "Knock knock!" of the joke in progress
+
+    // Heap sessions come from a slab; a derived type of another size brings its own or gets the heap
+    static void* operator new(size_t size) {
+        return size == sizeof(ClientSession) ? Slab<ClientSession>::get() : ::operator new(size);
+    }
+    static void operator delete(void* p, size_t size) {
+        if (size == sizeof(ClientSession)) Slab<ClientSession>::put(p);
+        else ::operator delete(p);
+    }
+};
+
+// ------------------------------- Counters -------------------------------
+
+/* Conversation events across all sessions; each thread bumps its own slot (counters.h). */
+struct ProtocolCounters {
+    ShardedCounter jokes_told;        // punchlines delivered, batched ones included
+    ShardedCounter whos_there_fixes;  // wrong "Who's there?", corrected and restarted
+    ShardedCounter setup_who_fixes;   // wrong "<setup> who?", corrected with a fresh joke
+    ShardedCounter yes_no_reprompts;  // neither Y nor N at the Y/N prompt
+};
+
+inline ProtocolCounters protocol_counters;
+
+/* Step latencies across all sessions, in ticks (latency.h); each thread records into its own slot. */
+struct ProtocolLatency {
+    latency::Histogram first_knock;  // session began (accept, or leaving the wait queue) -> first "Knock knock!" queued
+    latency::Histogram think;        // prompt queued -> the client's reply handled
+    latency::Histogram reply;        // reply handled -> the answer queued
+    latency::Histogram joke;         // "Knock knock!" queued -> punchline queued (batched jokes not included)
+};
+
+inline ProtocolLatency protocol_latency;
+
+/*
+ * Times one client line: arrived() when it is about to be handled (the time
+ * since the last prompt is the client's think time), answered() once the
+ * answer is queued. The destructor answers a line still open.
+ */
+struct ReplyTiming {
+    ClientSession* session;
+    uint64_t began = 0;  // when the line being answered arrived; 0 between lines
+
+    void arrived() {
+        began = latency::now();
+        protocol_latency.think.record(latency::since(session->step_at, began));
+    }
+    void answered() {
+        if (!began) return;
+        uint64_t t = latency::now();
+        protocol_latency.reply.record(latency::elapsed(began, t));
+        session->step_at = latency::stamp(t);
+        began = 0;
+    }
+    ~ReplyTiming() { answered(); }
+};
+
+/* A joke's "Knock knock!" is queued (the session's first ends its accept-to-prompt wait). */
+inline void knock_queued(ClientSession* session) {
+    uint64_t t = latency::now();
+    if (session->negotiable) protocol_latency.first_knock.record(latency::since(session->step_at, t));
+    session->joke_at = session->step_at = latency::stamp(t);
+}
+
+/* The joke in progress reached its punchline. */
+inline void punchline_queued(ClientSession* session) {
+    protocol_latency.joke.record(latency::since(session->joke_at, latency::now()));
+}
+
+// --------------------------- Knock-knock logic --------------------------
+
+/* Queue one pre-rendered frame (already '\n'-terminated); the driver sends it later. */
+inline void queue_frame(ClientSession* session, std::string_view frame) {
+    session->outbuf.append(frame);
+}
+
+/*
+ * Move the session onto catalog snapshot `next`. Told-joke history is carried
+ * over by database row id, so rows that were added, removed or reordered by
+ * a reload never make a client hear the same joke twice.
+ */
+inline void adopt_catalog(ClientSession* session, std::shared_ptr<const Catalog> next) {
+    const Catalog* prev = session->catalog;
+    if (prev && session->told_jokes.told() > 0) {
+        JokePicker carried;
+        carried.reset(next->size());
+        session->told_jokes.for_each_told([&](size_t i) {
+            size_t j = next->find(prev->id(i));
+            if (j < next->size()) carried.set_told(j);
+        });
+        session->told_jokes = std::move(carried);
+    }
+    if (!session->outbuf.empty() && session->snapshot) {
+        session->outbuf.keep_alive(std::move(session->snapshot));  // queued frames may point into it
+    }
+    session->snapshot = std::move(next);
+    session->catalog  = session->snapshot.get();
+}
+
+/*
+ * Switch to the newest snapshot at a joke boundary, if there is one. Feistel
+ * sessions keep the snapshot they started with: their permutation is defined
+ * over that catalog's row positions and cannot be carried over.
+ */
+inline void refresh_catalog(ClientSession* session) {
+    if (!session->store || session->select_mode != SelectMode::Bitset) return;
+    if (session->store->version() == session->catalog->version()) return;  // lock-free common case
+    adopt_catalog(session, session->store->acquire());
+}
+
+/* Draw the next untold joke with whichever selector the session was configured for. */
+inline bool pick_joke(ClientSession* session, size_t& out) {
+    size_t n = session->catalog->size();
+    if (session->select_mode == SelectMode::Feistel) return session->shuffle.pick(session->rng, n, out);
+    return session->told_jokes.pick(session->rng, n, out);
+}
+
+/* pick_joke() into the session's joke in progress. */
+inline bool next_joke(ClientSession* session) {
+    size_t j;
+    if (!pick_joke(session, j)) return false;
+    session->joke = static_cast<uint32_t>(j);
+    return true;
+}
+
+/*
+ * Start a new knock-knock exchange with a random joke this client hasn't heard.
+ * If every joke has been told, queue the farewell line and close the session.
+ */
+inline void start_joke(ClientSession* session) {
+    refresh_catalog(session);
+
+    // Select a random unused joke (see selector.h)
+    if (!next_joke(session)) {
+        queue_frame(session, kNoMoreJokesFrame);
+        session->state = SessionState::Closing;  // session ends
+        return;
+    }
+
+    // Step 1: "Knock knock!"
+    queue_frame(session, kKnockFrame);
+    knock_queued(session);
+    session->state = SessionState::AwaitWhosThere;
+}
+
+/*
+ * Pipelining is negotiated by sending "PIPELINE" as the very first line (it
+ * may go out right after connect, before "Knock knock!" has been read). The
+ * server acknowledges and the client may from then on send its replies ahead
+ * of the prompts: they are checked in order, wrong ones get the usual
+ * correction and restart, and every answer to lines that arrived together
+ * leaves in one write. A server without pipelining treats the line as a
+ * wrong "Who's there?", so a client can tell and stay in lock step.
+ *
+ * Returns true if `resp` was the request (and the acknowledgement is queued).
+ */
+inline bool negotiate(ClientSession* session, std::string_view resp) {
+    if (!session->negotiable) return false;
+    session->negotiable = false;
+    if (!reply_matches(resp, kExpectPipeline)) return false;
+    queue_frame(session, kPipelineFrame);
+    return true;
+}
+
+/*
+ * "BATCH <n>" (1 <= n <= kMaxBatch, any case and surrounding spaces) at the
+ * Y/N prompt. False for anything else, which then gets the usual Y/N hint.
+ */
+inline bool parse_batch(std::string_view resp, size_t& n) {
+    resp = trim_view(resp);
+    if (resp.size() <= kExpectBatch.size() ||
+        !reply_match::equal_folded(resp.data(), kExpectBatch.data(), kExpectBatch.size())) return false;
+    resp = trim_view(resp.substr(kExpectBatch.size()));
+    if (resp.empty() || resp.size() > 4) return false;
+    n = 0;
+    for (char c : resp) {
+        if (c < '0' || c > '9') return false;
+        n = n * 10 + static_cast<size_t>(c - '0');
+    }
+    return n >= 1 && n <= kMaxBatch;
+}
+
+/*
+ * Marathon mode: tell the next `n` untold jokes back to back, setup line then
+ * punchline, without the knock-knock dialogue or a Y/N question in between,
+ * then ask Y/N once. If the jokes run out first, say so and return false:
+ * the session ends. Everything is queued at once, so the driver sends the
+ * whole batch in one write.
+ */
+inline bool tell_batch(ClientSession* session, size_t n) {
+    refresh_catalog(session);
+    for (size_t i = 0; i < n; ++i) {
+        if (!next_joke(session)) {
+            queue_frame(session, kNoMoreJokesFrame);
+            return false;
+        }
+        const Joke jk = (*session->catalog)[session->joke];
+        queue_frame(session, jk.setup);
+        queue_frame(session, kNewline);
+        queue_frame(session, jk.punchline);
+        protocol_counters.jokes_told.inc();
+    }
+    queue_frame(session, kAnotherFrame);
+    return true;
+}
+
+/*
+ * Advance the conversation by one client line, queueing whatever the server
+ * says in response:
+ *   - wrong "Who's there?"  -> explain and restart from "Knock knock!"
+ *   - wrong "<setup> who?"  -> explain and start over with a fresh "Knock knock!"
+ *   - after the punchline   -> ask Y/N until we get a valid answer
+ *                              ("BATCH <n>" is one: see tell_batch())
+ */
+inline void on_client_line(ClientSession* session, std::string_view resp) {
+    ReplyTiming timing{session};
+    timing.arrived();
+    if (negotiate(session, resp)) return;
+
+    switch (session->state) {
+    case SessionState::AwaitWhosThere:
+        if (!reply_matches(resp, kExpectWhosThere)) {
+            // incorrect -> explain and immediately restart from the beginning
+            queue_frame(session, kWhosThereCorrect);
+            queue_frame(session, kKnockFrame);
+            protocol_counters.whos_there_fixes.inc();
+            return;
+        }
+        // Step 2: send setup and expect "<setup> who?"
+        queue_frame(session, (*session->catalog)[session->joke].prompt);
+        session->state = SessionState::AwaitSetupWho;
+        return;
+
+    case SessionState::AwaitSetupWho: {
+        const Joke jk = (*session->catalog)[session->joke];
+        if (!reply_matches(resp, jk.expect)) {
+            queue_frame(session, jk.correction);
+            protocol_counters.setup_who_fixes.inc();
+            start_joke(session);
+            return;
+        }
+        // Step 3: punchline, then offer another one
+        queue_frame(session, jk.punchline);
+        queue_frame(session, kAnotherFrame);
+        protocol_counters.jokes_told.inc();
+        punchline_queued(session);
+        session->state = SessionState::AwaitAnother;
+        return;
+    }
+
+    case SessionState::AwaitAnother:
+        if (reply_matches(resp, "n") || reply_matches(resp, "no")) { session->state = SessionState::Closing; return; }
+        if (reply_matches(resp, "y") || reply_matches(resp, "yes")) { start_joke(session); return; }
+        if (size_t n; parse_batch(resp, n)) {
+            if (!tell_batch(session, n)) session->state = SessionState::Closing;  // ran out of jokes
+            return;
+        }
+        queue_frame(session, kYesNoFrame);
+        queue_frame(session, kAnotherFrame);
+        protocol_counters.yes_no_reprompts.inc();
+        return;
+
+    case SessionState::Closing:
+        return;  // ignore anything sent after we decided to hang up
+    }
+}
+
+// --------------------------- Coroutine form -----------------------------
+
+/*
+ * The conversation of start_joke() + on_client_line(), top to bottom, for
+ * the coroutine driver. Writes queue frames; each read flushes them (unless
+ * the client already sent its next line) and suspends until that line. Returns when the client says N,
+ * every joke has been told, or the connection goes away; the caller flushes
+ * whatever is still queued and hangs up.
+ */
+inline coro::Task<> tell_jokes(coro::Conn& conn, ClientSession* session) {
+    std::string_view line;
+    ReplyTiming timing{session};
+    while (true) {
+        refresh_catalog(session);
+        if (!next_joke(session)) {
+            co_await conn.write(kNoMoreJokesFrame);
+            co_return;
+        }
+
+        // Step 1: "Knock knock!" until the client says "Who's there?"
+        co_await conn.write(kKnockFrame);
+        knock_queued(session);
+        while (true) {
+            timing.answered();
+            if (!co_await conn.read_line(line)) co_return;
+            timing.arrived();
+            if (negotiate(session, line)) continue;  // only ever the first line
+            if (reply_matches(line, kExpectWhosThere)) break;
+            protocol_counters.whos_there_fixes.inc();
+            co_await conn.write(kWhosThereCorrect);
+            co_await conn.write(kKnockFrame);
+        }
+
+        // Step 2: setup; a wrong "<setup> who?" starts over with a fresh joke
+        const Joke jk = (*session->catalog)[session->joke];
+        co_await conn.write(jk.prompt);
+        timing.answered();
+        if (!co_await conn.read_line(line)) co_return;
+        timing.arrived();
+        if (!reply_matches(line, jk.expect)) {
+            protocol_counters.setup_who_fixes.inc();
+            co_await conn.write(jk.correction);
+            continue;
+        }
+
+        // Step 3: punchline, then ask Y/N until we get a valid answer
+        protocol_counters.jokes_told.inc();
+        punchline_queued(session);
+        co_await conn.write(jk.punchline);
+        co_await conn.write(kAnotherFrame);
+        while (true) {
+            timing.answered();
+            if (!co_await conn.read_line(line)) co_return;
+            timing.arrived();
+            if (reply_matches(line, "n") || reply_matches(line, "no")) co_return;
+            if (reply_matches(line, "y") || reply_matches(line, "yes")) break;
+            if (size_t n; parse_batch(line, n)) {
+                if (!tell_batch(session, n)) co_return;  // queued straight into the buffer `conn` sends from
+                continue;
+            }
+            protocol_counters.yes_no_reprompts.inc();
+            co_await conn.write(kYesNoFrame);
+            co_await conn.write(kAnotherFrame);
+        }
+    }
+}
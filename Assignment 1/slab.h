@@ -0,0 +1,127 @@
+/*
+ * slab.h
+ * ------
+ * Fixed-size object pools for the memory a connection holds: its session,
+ * the chunk its input is read into, and the blocks its pending output is
+ * described in (session.h, line_reader.h, out_queue.h).
+ *
+ * With a million mostly idle connections, memory rather than CPU is the
+ * limit. The general-purpose allocator adds a header to every block, rounds
+ * its size up, and spreads a session's pieces across the heap. Slab<T> cuts
+ * objects from 64 KB chunks with nothing between them. Freed objects are
+ * recycled through a free list whose links live inside the objects.
+ *
+ * Each thread caches a few free objects, so get() and put() are a handful of
+ * instructions and take no lock. The cache trades a batch with the shared
+ * free list, under its mutex, only when it runs empty or overflows. Objects
+ * may move between threads: one allocated on the accept thread and freed on
+ * a worker just joins that worker's cache. Chunks are never handed back to
+ * the system, so a slab stays at its high-water mark.
+ *
+ * get() returns raw storage and put() takes it back; constructing and
+ * destroying the object is up to the caller (see ClientSession's operator new).
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <new>
+
+template <class T>
+class Slab {
+public:
+    static constexpr size_t kChunkBytes = 64 * 1024;
+    static constexpr size_t kCache      = 64;  // free objects a thread keeps
+    static constexpr size_t kBatch      = kCache / 2;
+
+    /* Storage for one T. */
+    static void* get() {
+        Cache& c = cache();
+        if (!c.head) refill(c);
+        Node* n = c.head;
+        c.head  = n->next;
+        --c.count;
+        return n;
+    }
+
+    /* Give back storage from get() (on any thread). */
+    static void put(void* p) {
+        Cache& c = cache();
+        Node*  n = static_cast<Node*>(p);
+        n->next  = c.head;
+        c.head   = n;
+        if (++c.count > kCache) spill(c, kBatch);
+    }
+
+    /* Objects carved so far (live plus free): the slab's footprint is this times sizeof(T). */
+    static size_t reserved() { return shared().carved.load(std::memory_order_relaxed); }
+
+private:
+    struct Node {
+        Node* next;
+    };
+    static_assert(sizeof(T) >= sizeof(Node) && alignof(T) >= alignof(Node), "too small for a free-list link");
+
+    static constexpr size_t kPerChunk = std::max<size_t>(1, kChunkBytes / sizeof(T));
+
+    struct Shared {
+        std::mutex          m;
+        Node*               head = nullptr;
+        std::atomic<size_t> carved{0};
+    };
+
+    struct Cache {
+        Node*  head  = nullptr;
+        size_t count = 0;
+        ~Cache() { spill(*this, count); }  // thread exit: the shared list takes them
+    };
+
+    static Shared& shared() {
+        static Shared s;
+        return s;
+    }
+
+    static Cache& cache() {
+        thread_local Cache c;
+        return c;
+    }
+
+    /* Take a batch from the shared list, carving a new chunk if it is empty. */
+    static void refill(Cache& c) {
+        Shared& s = shared();
+        std::lock_guard<std::mutex> lk(s.m);
+        if (!s.head) {
+            char* chunk = static_cast<char*>(::operator new(kPerChunk * sizeof(T), std::align_val_t{alignof(T)}));
+            for (size_t i = kPerChunk; i-- > 0;) {
+                Node* n = reinterpret_cast<Node*>(chunk + i * sizeof(T));
+                n->next = s.head;
+                s.head  = n;
+            }
+            s.carved.fetch_add(kPerChunk, std::memory_order_relaxed);
+        }
+        for (size_t i = 0; i < kBatch && s.head; ++i) {
+            Node* n = s.head;
+            s.head  = n->next;
+            n->next = c.head;
+            c.head  = n;
+            ++c.count;
+        }
+    }
+
+    /* Move `n` objects from the cache to the shared list. */
+    static void spill(Cache& c, size_t n) {
+        if (n == 0) return;
+        Shared& s = shared();
+        std::lock_guard<std::mutex> lk(s.m);
+        for (; n > 0 && c.head; --n) {
+            Node* x = c.head;
+            c.head  = x->next;
+            --c.count;
+            x->next = s.head;
+            s.head  = x;
+        }
+    }
+};
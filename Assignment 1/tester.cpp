@@ -8,7 +8,22 @@
  *  2) Wrong first response: expect correction + immediate "Knock knock! <input>".
  *  3) Wrong second response: expect correction + restart.
  *  4) Concurrent clients (default: 3).
- *  5) Idle shutdown: wait ~12s; verify server refuses new connection after its 10s idle timeout.
+ *  5) Pipelining: "PIPELINE", then replies sent ahead of their prompts (a wrong
+ *     one included) get the same answers, in order.
+ *  6) Batch: "BATCH 2" at the Y/N prompt returns two setup/punchline pairs
+ *     and one new Y/N prompt.
+ *  7) Idle shutdown: wait ~12s; verify server refuses new connection after its 10s idle timeout.
+ *
+ * Load mode (--load=SECONDS) skips the scenarios and acts as a load generator:
+ * --conns=N connections, driven over epoll by --threads=T threads, each run
+ * back-to-back sessions (connect, --jokes=K jokes, "N", close); the runner
+ * reports completed jokes and sessions per second. With --pipeline every
+ * connection negotiates pipelining and sends all it can ahead, so a joke costs
+ * one round trip (for the setup) instead of three. It also reports the turn
+ * latency (a reply sent -> the server's next prompt received; p50 and p99),
+ * the first-prompt latency (connect() -> "Knock knock!" received: accept and
+ * session setup, p50 and p99) and the TCP data segments the server needed
+ * per joke, from TCP_INFO.
  *
  * Build:
  *   g++ -std=c++17 -Wall -Wextra -O2 tester.cpp -o tester
@@ -16,15 +31,25 @@
  * Run:
  *   ./server                 # terminal 1
  *   ./tester [host] [port]   # terminal 2 (defaults: 127.0.0.1 8079)
+ *   ./tester [host] [port] --load=10 [--conns=64] [--threads=1] [--jokes=1] [--pipeline] [--batch=B]
  */
 
+#include "line_reader.h"
+
 #include <arpa/inet.h>
+#include <linux/tcp.h>
 #include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cerrno>
 #include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <cstring>
 #include <functional>
 #include <iostream>
@@ -81,24 +106,10 @@ static bool send_line(int fd, const string& s) {
     return true;
 }
 
-static bool recv_line(int fd, string& line) {
-    line.clear();
-    char ch;
-    while (true) {
-        ssize_t n = ::recv(fd, &ch, 1, 0);
-        if (n <= 0) return false;      // timeout/EOF/error
-        if (ch == '\r') continue;
-        if (ch == '\n') break;
-        line.push_back(ch);
-        if (line.size() > 8192) break; // safety
-    }
-    return true;
-}
-
 /* Read lines until one contains "<input>". Returns the prompt line in `line`. */
-static bool read_until_prompt(int fd, string& line) {
+static bool read_until_prompt(LineReader& in, string& line) {
     while (true) {
-        if (!recv_line(fd, line)) return false;
+        if (!in.read_line(line)) return false;
         cout << "[S] " << line << "\n";
         if (line.find("<input>") != string::npos) return true;
     }
@@ -118,17 +129,18 @@ static bool scenario_happy(const string& host, int port) {
     cout << "\n[TEST] happy path\n";
     int fd = connect_to(host, port);
     if (fd < 0) { cerr << "connect failed\n"; return false; }
+    LineReader in(fd, 8192);
 
     string line;
 
     // Knock knock <input>
-    if (!read_until_prompt(fd, line) || line.find("Knock knock!") == string::npos) {
+    if (!read_until_prompt(in, line) || line.find("Knock knock!") == string::npos) {
         cerr << "did not get 'Knock knock! <input>'\n"; ::close(fd); return false;
     }
     if (!send_line(fd, "Who's there?")) { ::close(fd); return false; }
 
     // Setup <input>
-    if (!read_until_prompt(fd, line)) { cerr << "no setup prompt\n"; ::close(fd); return false; }
+    if (!read_until_prompt(in, line)) { cerr << "no setup prompt\n"; ::close(fd); return false; }
     string setup = strip_marker(line);
     string setup_word = setup;
     auto sp = setup_word.find(' ');
@@ -136,11 +148,11 @@ static bool scenario_happy(const string& host, int port) {
     if (!send_line(fd, setup_word + " who?")) { ::close(fd); return false; }
 
     // Punchline
-    if (!recv_line(fd, line)) { cerr << "no punchline\n"; ::close(fd); return false; }
+    if (!in.read_line(line)) { cerr << "no punchline\n"; ::close(fd); return false; }
     cout << "[S] " << line << "\n";
 
     // Y/N <input>
-    if (!read_until_prompt(fd, line) || line.find("(Y/N)") == string::npos) {
+    if (!read_until_prompt(in, line) || line.find("(Y/N)") == string::npos) {
         cerr << "no Y/N prompt\n"; ::close(fd); return false;
     }
     if (!send_line(fd, "N")) { ::close(fd); return false; }
@@ -154,35 +166,36 @@ static bool scenario_wrong_first(const string& host, int port) {
     cout << "\n[TEST] wrong first line -> correction\n";
     int fd = connect_to(host, port);
     if (fd < 0) { cerr << "connect failed\n"; return false; }
+    LineReader in(fd, 8192);
 
     string line;
 
     // Wrong reply to first prompt
-    if (!read_until_prompt(fd, line) || line.find("Knock knock!") == string::npos) {
+    if (!read_until_prompt(in, line) || line.find("Knock knock!") == string::npos) {
         cerr << "did not get initial knock prompt\n"; ::close(fd); return false;
     }
     if (!send_line(fd, "Who there?")) { ::close(fd); return false; }
 
     // Should get correction + immediate fresh "Knock knock! <input>"
-    if (!recv_line(fd, line) || line.find("You are supposed to say") == string::npos) {
+    if (!in.read_line(line) || line.find("You are supposed to say") == string::npos) {
         cerr << "no correction for first step\n"; ::close(fd); return false;
     }
     cout << "[S] " << line << "\n";
 
-    if (!recv_line(fd, line) || line.find("Knock knock!") == string::npos || line.find("<input>") == string::npos) {
+    if (!in.read_line(line) || line.find("Knock knock!") == string::npos || line.find("<input>") == string::npos) {
         cerr << "no immediate fresh Knock knock after correction\n"; ::close(fd); return false;
     }
     cout << "[S] " << line << "\n";
 
     // Do it correctly now
     if (!send_line(fd, "Who's there?")) { ::close(fd); return false; }
-    if (!read_until_prompt(fd, line)) { cerr << "no setup prompt\n"; ::close(fd); return false; }
+    if (!read_until_prompt(in, line)) { cerr << "no setup prompt\n"; ::close(fd); return false; }
     string setup = strip_marker(line);
     string setup_word = setup; auto sp = setup_word.find(' '); if (sp != string::npos) setup_word.erase(sp);
     if (!send_line(fd, setup_word + " who?")) { ::close(fd); return false; }
-    if (!recv_line(fd, line)) { cerr << "no punchline\n"; ::close(fd); return false; }
+    if (!in.read_line(line)) { cerr << "no punchline\n"; ::close(fd); return false; }
     cout << "[S] " << line << "\n";
-    if (!read_until_prompt(fd, line)) { cerr << "no Y/N prompt\n"; ::close(fd); return false; }
+    if (!read_until_prompt(in, line)) { cerr << "no Y/N prompt\n"; ::close(fd); return false; }
     if (!send_line(fd, "N")) { ::close(fd); return false; }
 
     ::close(fd);
@@ -194,41 +207,42 @@ static bool scenario_wrong_second(const string& host, int port) {
     cout << "\n[TEST] wrong second line -> correction + restart\n";
     int fd = connect_to(host, port);
     if (fd < 0) { cerr << "connect failed\n"; return false; }
+    LineReader in(fd, 8192);
 
     string line;
 
     // Correct first reply
-    if (!read_until_prompt(fd, line) || line.find("Knock knock!") == string::npos) {
+    if (!read_until_prompt(in, line) || line.find("Knock knock!") == string::npos) {
         cerr << "did not get initial knock\n"; ::close(fd); return false;
     }
     if (!send_line(fd, "Who's there?")) { ::close(fd); return false; }
 
     // Setup -> deliberately wrong "<setup> whoo?"
-    if (!read_until_prompt(fd, line)) { cerr << "no setup prompt\n"; ::close(fd); return false; }
+    if (!read_until_prompt(in, line)) { cerr << "no setup prompt\n"; ::close(fd); return false; }
     string setup = strip_marker(line);
     string setup_word = setup; auto sp = setup_word.find(' '); if (sp != string::npos) setup_word.erase(sp);
     if (!send_line(fd, setup_word + " whoo?")) { ::close(fd); return false; }
 
     // Expect correction, then restart from knock knock
-    if (!recv_line(fd, line) || line.find("You are supposed to say") == string::npos) {
+    if (!in.read_line(line) || line.find("You are supposed to say") == string::npos) {
         cerr << "no correction for second step\n"; ::close(fd); return false;
     }
     cout << "[S] " << line << "\n";
 
-    if (!recv_line(fd, line) || line.find("Knock knock!") == string::npos || line.find("<input>") == string::npos) {
+    if (!in.read_line(line) || line.find("Knock knock!") == string::npos || line.find("<input>") == string::npos) {
         cerr << "did not restart with Knock knock! after wrong second\n"; ::close(fd); return false;
     }
     cout << "[S] " << line << "\n";
 
     // Finish correctly
     if (!send_line(fd, "Who's there?")) { ::close(fd); return false; }
-    if (!read_until_prompt(fd, line)) { cerr << "no setup prompt after restart\n"; ::close(fd); return false; }
+    if (!read_until_prompt(in, line)) { cerr << "no setup prompt after restart\n"; ::close(fd); return false; }
     setup = strip_marker(line);
     setup_word = setup; sp = setup_word.find(' '); if (sp != string::npos) setup_word.erase(sp);
     if (!send_line(fd, setup_word + " who?")) { ::close(fd); return false; }
-    if (!recv_line(fd, line)) { cerr << "no punchline after restart\n"; ::close(fd); return false; }
+    if (!in.read_line(line)) { cerr << "no punchline after restart\n"; ::close(fd); return false; }
     cout << "[S] " << line << "\n";
-    if (!read_until_prompt(fd, line)) { cerr << "no Y/N prompt\n"; ::close(fd); return false; }
+    if (!read_until_prompt(in, line)) { cerr << "no Y/N prompt\n"; ::close(fd); return false; }
     if (!send_line(fd, "N")) { ::close(fd); return false; }
 
     ::close(fd);
@@ -245,19 +259,20 @@ static bool scenario_concurrent(const string& host, int port, int nclients = 3)
     auto job = [&](int id) {
         int fd = connect_to(host, port);
         if (fd < 0) { lock_guard<mutex> lk(err_mtx); ok = false; cerr << "[C" << id << "] connect failed\n"; return; }
+        LineReader in(fd, 8192);
         string line;
 
-        if (!read_until_prompt(fd, line) || line.find("Knock knock!") == string::npos) { lock_guard<mutex> lk(err_mtx); ok=false; cerr<<"[C"<<id<<"] no knock\n"; ::close(fd); return; }
+        if (!read_until_prompt(in, line) || line.find("Knock knock!") == string::npos) { lock_guard<mutex> lk(err_mtx); ok=false; cerr<<"[C"<<id<<"] no knock\n"; ::close(fd); return; }
         send_line(fd, "Who's there?");
 
-        if (!read_until_prompt(fd, line)) { lock_guard<mutex> lk(err_mtx); ok=false; cerr<<"[C"<<id<<"] no setup\n"; ::close(fd); return; }
+        if (!read_until_prompt(in, line)) { lock_guard<mutex> lk(err_mtx); ok=false; cerr<<"[C"<<id<<"] no setup\n"; ::close(fd); return; }
         string setup = strip_marker(line);
         string setup_word = setup; auto sp = setup_word.find(' '); if (sp != string::npos) setup_word.erase(sp);
         send_line(fd, setup_word + " who?");
 
-        if (!recv_line(fd, line)) { lock_guard<mutex> lk(err_mtx); ok=false; cerr<<"[C"<<id<<"] no punchline\n"; ::close(fd); return; }
+        if (!in.read_line(line)) { lock_guard<mutex> lk(err_mtx); ok=false; cerr<<"[C"<<id<<"] no punchline\n"; ::close(fd); return; }
 
-        if (!read_until_prompt(fd, line)) { lock_guard<mutex> lk(err_mtx); ok=false; cerr<<"[C"<<id<<"] no YN\n"; ::close(fd); return; }
+        if (!read_until_prompt(in, line)) { lock_guard<mutex> lk(err_mtx); ok=false; cerr<<"[C"<<id<<"] no YN\n"; ::close(fd); return; }
         send_line(fd, "N");
         ::close(fd);
     };
@@ -269,6 +284,84 @@ static bool scenario_concurrent(const string& host, int port, int nclients = 3)
     return ok;
 }
 
+/* Read one line and check that it contains `want`. */
+static bool expect_line(LineReader& in, const string& want) {
+    string line;
+    if (!in.read_line(line)) { cerr << "connection ended; wanted '" << want << "'\n"; return false; }
+    cout << "[S] " << line << "\n";
+    if (line.find(want) == string::npos) { cerr << "got '" << line << "', wanted '" << want << "'\n"; return false; }
+    return true;
+}
+
+static bool scenario_pipelined(const string& host, int port) {
+    cout << "\n[TEST] pipelining: replies sent ahead of the prompts\n";
+    int fd = connect_to(host, port);
+    if (fd < 0) { cerr << "connect failed\n"; return false; }
+    LineReader in(fd, 8192);
+    string line;
+    auto fail = [&] { ::close(fd); return false; };
+
+    // Negotiate and answer the first knock without waiting for it
+    if (!send_line(fd, "PIPELINE\nWho's there?")) return fail();
+    if (!expect_line(in, "Knock knock! <input>") || !expect_line(in, "Pipelining on.")) return fail();
+    if (!read_until_prompt(in, line)) { cerr << "no setup prompt\n"; return fail(); }
+    string word = strip_marker(line);
+    auto sp = word.find(' ');
+    if (sp != string::npos) word.erase(sp);
+
+    // A wrong setup reply and the next "Who's there?" in one go: correction, restart, new setup
+    if (!send_line(fd, word + " whoo?\nWho's there?")) return fail();
+    if (!expect_line(in, "You are supposed to say") || !expect_line(in, "Knock knock! <input>")) return fail();
+    if (!read_until_prompt(in, line)) { cerr << "no setup prompt after restart\n"; return fail(); }
+    word = strip_marker(line);
+    sp = word.find(' ');
+    if (sp != string::npos) word.erase(sp);
+
+    // Finish the joke, fumble Y/N, and leave, all at once
+    if (!send_line(fd, word + " who?\nmaybe\nN")) return fail();
+    if (!in.read_line(line)) { cerr << "no punchline\n"; return fail(); }
+    cout << "[S] " << line << "\n";
+    if (!expect_line(in, "(Y/N) <input>") || !expect_line(in, "Please reply with Y or N.") ||
+        !expect_line(in, "(Y/N) <input>")) return fail();
+    if (in.read_line(line)) { cerr << "server kept talking after N: '" << line << "'\n"; return fail(); }
+
+    ::close(fd);
+    cout << "[OK] pipelining\n";
+    return true;
+}
+
+static bool scenario_batch(const string& host, int port) {
+    cout << "\n[TEST] BATCH 2 at the Y/N prompt\n";
+    int fd = connect_to(host, port);
+    if (fd < 0) { cerr << "connect failed\n"; return false; }
+    LineReader in(fd, 8192);
+    string line;
+    auto fail = [&] { ::close(fd); return false; };
+
+    // One joke the usual way
+    if (!expect_line(in, "Knock knock! <input>") || !send_line(fd, "Who's there?")) return fail();
+    if (!read_until_prompt(in, line)) { cerr << "no setup prompt\n"; return fail(); }
+    string word = strip_marker(line);
+    auto sp = word.find(' ');
+    if (sp != string::npos) word.erase(sp);
+    if (!send_line(fd, word + " who?")) return fail();
+    if (!in.read_line(line)) { cerr << "no punchline\n"; return fail(); }
+    if (!expect_line(in, "(Y/N) <input>")) return fail();
+
+    // Two more, as setup / punchline lines, then one Y/N prompt
+    if (!send_line(fd, "BATCH 2")) return fail();
+    for (int i = 0; i < 4; ++i) {
+        if (!in.read_line(line)) { cerr << "batch ended after " << i << " lines\n"; return fail(); }
+        cout << "[S] " << line << "\n";
+        if (line.find("<input>") != string::npos) { cerr << "prompt inside the batch\n"; return fail(); }
+    }
+    if (!expect_line(in, "(Y/N) <input>") || !send_line(fd, "N")) return fail();
+
+    ::close(fd);
+    cout << "[OK] batch\n";
+    return true;
+}
+
 // Wait ~12s after last clients; new connection should fail if server auto-shut down.
 static bool scenario_idle_shutdown_check(const string& host, int port) {
     cout << "\n[TEST] idle shutdown (expect server to exit ~10s after last client)\n";
@@ -283,19 +376,255 @@ static bool scenario_idle_shutdown_check(const string& host, int port) {
     return true;
 }
 
+// ------------------------------ load mode -------------------------------
+
+/*
+ * Event-driven load generator: each runner thread drives its share of the
+ * connections over epoll, so tens of thousands of clients need only a few
+ * threads. A connection plays the protocol correctly, answers "Y" until it
+ * has heard --jokes jokes (or the server runs out), then "N", and reconnects.
+ * With --batch=B it asks for the jokes after the first with "BATCH <B>"
+ * instead, so they come without a round trip each.
+ * Connections to a loopback host are spread over 127.0.0.1-127.0.0.16 so the
+ * client side does not run out of ephemeral ports.
+ */
+struct LoadConn {
+    int        fd = -1;
+    LineReader in{-1, 8192};
+    int        heard = 0;        // jokes completed on this connection
+    int        batched = 0;      // jokes the last "BATCH" asked for (0: none pending)
+    bool       greeted = false;  // sent "PIPELINE" (--pipeline)
+    chrono::steady_clock::time_point sent{};    // last reply, until its prompt arrives
+    chrono::steady_clock::time_point opened{};  // connect() issued, until the first prompt arrives
+};
+
+struct LoadOptions {
+    int  seconds  = 0;
+    int  conns    = 64;
+    int  threads  = 1;
+    int  jokes    = 1;      // per session
+    int  batch    = 0;      // > 1: ask for jokes in "BATCH <n>" requests
+    bool pipeline = false;  // negotiate pipelining and send replies ahead
+};
+
+static const string kLoadHello = "PIPELINE\nWho's there?\n";
+
+struct LoadStats {
+    atomic<long> jokes{0}, sessions{0}, failed{0};
+    atomic<long> segs_in{0};      // data segments the server sent, over closed connections
+    mutex            m;
+    vector<uint32_t> turn_us;     // turn latencies of every runner, microseconds
+    vector<uint32_t> first_us;    // connect() to "Knock knock!", microseconds
+};
+
+/* Data segments this socket has received so far (0 if the kernel does not say). */
+static long data_segs_in(int fd) {
+    tcp_info ti{};
+    socklen_t len = sizeof(ti);
+    if (::getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) != 0) return 0;
+    return len >= offsetof(tcp_info, tcpi_data_segs_in) + sizeof(ti.tcpi_data_segs_in) ? ti.tcpi_data_segs_in : 0;
+}
+
+static int open_load_conn(const sockaddr_in& serv, size_t index) {
+    int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if ((ntohl(serv.sin_addr.s_addr) >> 24) == 127) {
+        int one = 1;
+        ::setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+        sockaddr_in src{};
+        src.sin_family      = AF_INET;
+        src.sin_addr.s_addr = htonl(0x7f000001u + static_cast<uint32_t>(index % 16));
+        ::bind(fd, reinterpret_cast<sockaddr*>(&src), sizeof(src));
+    }
+    if (::connect(fd, reinterpret_cast<const sockaddr*>(&serv), sizeof(serv)) < 0 && errno != EINPROGRESS) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void load_runner(const sockaddr_in& serv, size_t first, size_t count, const LoadOptions& opt,
+                        chrono::steady_clock::time_point deadline, LoadStats& st) {
+    const int  jokes    = opt.jokes;
+    const bool pipeline = opt.pipeline;
+    const bool batching = opt.batch > 1;
+    int ep = ::epoll_create1(EPOLL_CLOEXEC);
+    vector<LoadConn> conns(count);
+    vector<uint32_t> turn_us, first_us;
+    turn_us.reserve(1 << 16);
+    first_us.reserve(1 << 12);
+
+    auto start = [&](size_t i) {
+        LoadConn& c = conns[i];
+        c.opened  = chrono::steady_clock::now();
+        c.fd = open_load_conn(serv, first + i);
+        c.heard = 0;
+        c.batched = 0;
+        c.sent    = {};
+        if (c.fd < 0) { st.failed.fetch_add(1, memory_order_relaxed); return; }
+        c.in.reset(c.fd);
+        // Pipelined: greet before the first prompt if the connection is already up (loopback)
+        c.greeted = pipeline && ::send(c.fd, kLoadHello.data(), kLoadHello.size(), MSG_NOSIGNAL) ==
+                                    static_cast<ssize_t>(kLoadHello.size());
+        epoll_event ev{};
+        ev.events  = EPOLLIN;
+        ev.data.u64 = i;
+        ::epoll_ctl(ep, EPOLL_CTL_ADD, c.fd, &ev);
+    };
+    auto restart = [&](size_t i, bool ok) {
+        st.segs_in.fetch_add(data_segs_in(conns[i].fd), memory_order_relaxed);
+        ::close(conns[i].fd);  // also leaves the epoll set
+        conns[i].fd = -1;
+        (ok ? st.sessions : st.failed).fetch_add(1, memory_order_relaxed);
+        if (chrono::steady_clock::now() < deadline) start(i);
+    };
+
+    for (size_t i = 0; i < count; ++i) start(i);
+
+    vector<epoll_event> events(1024);
+    string line;
+    while (chrono::steady_clock::now() < deadline) {
+        int n = ::epoll_wait(ep, events.data(), static_cast<int>(events.size()), 100);
+        for (int e = 0; e < n; ++e) {
+            size_t i = events[e].data.u64;
+            LoadConn& c = conns[i];
+            if (c.fd < 0) continue;
+            ssize_t got = c.in.fill();
+            if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+            if (got <= 0) { restart(i, c.heard > 0); continue; }  // the server hung up
+
+            auto now = chrono::steady_clock::now();
+            bool ok = true;
+            while (ok && c.in.next_line(line)) {
+                if (line.find("<input>") == string::npos) continue;  // punchline, corrections
+                if (c.sent != chrono::steady_clock::time_point{}) {
+                    turn_us.push_back(static_cast<uint32_t>(
+                        chrono::duration_cast<chrono::microseconds>(now - c.sent).count()));
+                    c.sent = {};
+                }
+                string reply;
+                if (line.find("Knock knock!") != string::npos) {
+                    if (c.opened != chrono::steady_clock::time_point{}) {
+                        first_us.push_back(static_cast<uint32_t>(
+                            chrono::duration_cast<chrono::microseconds>(now - c.opened).count()));
+                        c.opened = {};
+                    }
+                    if (!pipeline) reply = "Who's there?\n";
+                    else if (!c.greeted) reply = kLoadHello;  // otherwise already sent ahead
+                    c.greeted = true;
+                } else if (line.find("(Y/N)") != string::npos) {
+                    int told = c.batched ? c.batched : 1;
+                    c.batched = 0;
+                    c.heard += told;
+                    st.jokes.fetch_add(told, memory_order_relaxed);
+                    if (c.heard < jokes && batching) {
+                        c.batched = min(opt.batch, jokes - c.heard);
+                        reply = "BATCH " + to_string(c.batched) + "\n";
+                    } else if (!pipeline || batching) {
+                        reply = c.heard < jokes ? "Y\n" : "N\n";
+                    }
+                } else {
+                    string word = strip_marker(line);
+                    auto sp = word.find(' ');
+                    if (sp != string::npos) word.erase(sp);
+                    reply = word + " who?\n";
+                    // Pipelined: the Y/N answer and the next "Who's there?" go out with it
+                    if (pipeline && !batching) reply += c.heard + 1 < jokes ? "Y\nWho's there?\n" : "N\n";
+                }
+                if (reply.empty()) continue;
+                ok = ::send(c.fd, reply.data(), reply.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(reply.size());
+                c.sent = chrono::steady_clock::now();
+            }
+            if (!ok) restart(i, false);
+        }
+    }
+    for (auto& c : conns) {
+        if (c.fd < 0) continue;
+        st.segs_in.fetch_add(data_segs_in(c.fd), memory_order_relaxed);
+        ::close(c.fd);
+    }
+    ::close(ep);
+    lock_guard<mutex> lk(st.m);
+    st.turn_us.insert(st.turn_us.end(), turn_us.begin(), turn_us.end());
+    st.first_us.insert(st.first_us.end(), first_us.begin(), first_us.end());
+}
+
+/* The q-quantile of `v` (sorted in place), in microseconds. */
+static uint32_t quantile_us(vector<uint32_t>& v, double q) {
+    if (v.empty()) return 0;
+    size_t k = min(v.size() - 1, static_cast<size_t>(q * static_cast<double>(v.size())));
+    nth_element(v.begin(), v.begin() + static_cast<ptrdiff_t>(k), v.end());
+    return v[k];
+}
+
+static int run_load(const string& host, int port, const LoadOptions& opt) {
+    cout << "[LOAD] " << opt.conns << " connections on " << opt.threads << " thread(s), " << opt.jokes
+         << " joke(s) per session" << (opt.pipeline ? ", pipelined" : "");
+    if (opt.batch > 1) cout << ", in batches of " << opt.batch;
+    cout << ", for " << opt.seconds << "s\n";
+    sockaddr_in serv{};
+    serv.sin_family = AF_INET;
+    serv.sin_port   = htons(port);
+    if (::inet_pton(AF_INET, host.c_str(), &serv.sin_addr) <= 0) { cerr << "[runner] invalid addr\n"; return 1; }
+
+    rlimit rl{};
+    if (::getrlimit(RLIMIT_NOFILE, &rl) == 0) { rl.rlim_cur = rl.rlim_max; ::setrlimit(RLIMIT_NOFILE, &rl); }
+
+    LoadStats st;
+    auto t0       = chrono::steady_clock::now();
+    auto deadline = t0 + chrono::seconds(opt.seconds);
+    vector<thread> ths;
+    for (int t = 0; t < opt.threads; ++t) {
+        size_t first = static_cast<size_t>(opt.conns) * t / opt.threads;
+        size_t last  = static_cast<size_t>(opt.conns) * (t + 1) / opt.threads;
+        ths.emplace_back(load_runner, cref(serv), first, last - first, cref(opt), deadline, ref(st));
+    }
+    for (auto& t : ths) t.join();
+
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    cout << "[LOAD] " << st.jokes.load() << " jokes (" << static_cast<long>(st.jokes.load() / secs) << "/s), "
+         << st.sessions.load() << " sessions (" << static_cast<long>(st.sessions.load() / secs) << "/s), "
+         << st.failed.load() << " failed\n";
+    cout << "[LOAD] " << static_cast<long>(st.jokes.load() / secs / opt.conns) << " jokes/s per connection\n";
+    if (st.jokes.load() > 0) {
+        cout << "[LOAD] turn latency p50 " << quantile_us(st.turn_us, 0.50) << " us, p99 "
+             << quantile_us(st.turn_us, 0.99) << " us; "
+             << static_cast<double>(st.segs_in.load()) / static_cast<double>(st.jokes.load())
+             << " data segments per joke\n";
+        cout << "[LOAD] first-prompt latency (connect to \"Knock knock!\") p50 " << quantile_us(st.first_us, 0.50)
+             << " us, p99 " << quantile_us(st.first_us, 0.99) << " us\n";
+    }
+    return st.failed.load() == 0 ? 0 : 1;
+}
+
 // --------------------------------- main ---------------------------------
 
 int main(int argc, char** argv) {
     string host = "127.0.0.1";
     int    port = PORT_DEFAULT;
-    if (argc >= 2) host = argv[1];
-    if (argc >= 3) port = stoi(argv[2]);
+    LoadOptions load;
+    vector<string> pos;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg.rfind("--load=", 0) == 0)       load.seconds = stoi(arg.substr(7));
+        else if (arg.rfind("--conns=", 0) == 0) load.conns = max(1, stoi(arg.substr(8)));
+        else if (arg.rfind("--threads=", 0) == 0) load.threads = max(1, stoi(arg.substr(10)));
+        else if (arg.rfind("--jokes=", 0) == 0) load.jokes = max(1, stoi(arg.substr(8)));
+        else if (arg.rfind("--batch=", 0) == 0) load.batch = stoi(arg.substr(8));
+        else if (arg == "--pipeline")           load.pipeline = true;
+        else pos.push_back(arg);
+    }
+    if (pos.size() >= 1) host = pos[0];
+    if (pos.size() >= 2) port = stoi(pos[1]);
+    if (load.seconds > 0) return run_load(host, port, load);
 
     bool ok = true;
     ok &= scenario_happy(host, port);
     ok &= scenario_wrong_first(host, port);
     ok &= scenario_wrong_second(host, port);
     ok &= scenario_concurrent(host, port, 3);
+    ok &= scenario_pipelined(host, port);
+    ok &= scenario_batch(host, port);
     ok &= scenario_idle_shutdown_check(host, port);
 
     cout << "\n========== SUMMARY ==========\n";
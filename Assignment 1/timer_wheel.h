@@ -0,0 +1,193 @@
+/*
+ * timer_wheel.h
+ * -------------
+ * Hierarchical timing wheel for the event loops' per-session deadlines (read
+ * deadline, send deadline, lifetime limit).
+ *
+ * Four levels of 256 slots, one millisecond per level-0 slot: level 0 holds
+ * timers due within 256 ms, level 1 within 65 s, level 2 within 4.6 hours,
+ * level 3 within 49 days (later ones wait in level 3 and are re-filed when
+ * their slot comes round). A Timer is an intrusive list node embedded in its
+ * owner, so arm() and cancel() are a few pointer writes, allocation-free and
+ * O(1) however many timers are armed. When time reaches a higher-level slot
+ * its timers cascade down a level; each timer moves at most three times.
+ *
+ * The loop asks next_event() how long it may sleep. A bitmap per level finds
+ * the next non-empty slot with a couple of word scans, so a loop with no
+ * timers (an idle server) sleeps until I/O wakes it instead of ticking, and
+ * advance() skips empty stretches instead of walking them slot by slot.
+ *
+ * Time is whatever unsigned millisecond count the owner passes in (the
+ * server uses steady-clock ms). Single-threaded: one wheel per event loop.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+class TimerWheel {
+public:
+    struct Timer {
+        Timer*   next  = nullptr;
+        Timer**  pprev = nullptr;  // slot head or previous node's `next`; null while not armed
+        uint64_t expires = 0;      // ms
+        void*    owner = nullptr;  // for the expiry handler
+
+        bool armed() const { return pprev != nullptr; }
+    };
+
+    static constexpr unsigned kBits   = 8;
+    static constexpr unsigned kSlots  = 1u << kBits;
+    static constexpr unsigned kLevels = 4;
+    static constexpr uint64_t kNever  = UINT64_MAX;
+
+    explicit TimerWheel(uint64_t now = 0) : cur_(now) {}
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    size_t size() const { return count_; }
+
+    /* (Re-)arm `t` to expire at `at`; a time already past fires on the next advance(). */
+    void arm(Timer& t, uint64_t at) {
+        if (t.armed()) unlink(t);
+        else ++count_;
+        t.expires = at;
+        file(t);
+    }
+
+    void cancel(Timer& t) {
+        if (!t.armed()) return;
+        unlink(t);
+        --count_;
+    }
+
+    /*
+     * The earliest time advance() has work to do: the next expiry, or an
+     * earlier cascade that may reveal it. kNever when nothing is armed.
+     */
+    uint64_t next_event() const {
+        if (count_ == 0) return kNever;
+        uint64_t best = kNever;
+        // Level 0 is exact: slot (cur_ + k) holds timers due at cur_ + k
+        unsigned k;
+        if (next_slot(0, static_cast<unsigned>(cur_ & (kSlots - 1)), k)) best = cur_ + k;
+        for (unsigned level = 1; level < kLevels; ++level) {
+            unsigned shift = kBits * level;
+            // The slot cur_ is in has already cascaded, unless cur_ is exactly its start
+            uint64_t pos   = (cur_ >> shift) + ((cur_ & ((uint64_t{1} << shift) - 1)) != 0);
+            if (!next_slot(level, static_cast<unsigned>(pos & (kSlots - 1)), k)) continue;
+            uint64_t at = (pos + k) << shift;
+            if (at < best) best = at;
+        }
+        return best;
+    }
+
+    /* Milliseconds from `now` until next_event(), for a poll timeout; -1 when nothing is armed. */
+    int timeout(uint64_t now) const {
+        uint64_t at = next_event();
+        if (at == kNever) return -1;
+        if (at <= now) return 0;
+        uint64_t ms = at - now;
+        return ms > 0x7fffffff ? 0x7fffffff : static_cast<int>(ms);
+    }
+
+    /*
+     * Move time forward to `now`, calling fire(Timer&) for each timer that
+     * came due (already disarmed). fire() may arm or cancel any timer,
+     * including the one it was given.
+     */
+    template <class F>
+    void advance(uint64_t now, F fire) {
+        while (count_ > 0) {
+            uint64_t at = next_event();
+            if (at > now) break;
+            cur_ = at;
+            for (unsigned level = kLevels - 1; level >= 1; --level) {
+                uint64_t mask = (uint64_t{1} << (kBits * level)) - 1;
+                if ((at & mask) == 0) cascade(level, static_cast<unsigned>((at >> (kBits * level)) & (kSlots - 1)));
+            }
+            // Detach the slot first: fire() may re-arm timers into it
+            unsigned slot = static_cast<unsigned>(at & (kSlots - 1));
+            take(0, slot);
+            while (Timer* t = held_) {
+                unlink(*t);
+                if (t->expires > at) { file(*t); continue; }  // filed early (e.g. beyond the horizon)
+                --count_;
+                fire(*t);
+            }
+            cur_ = at + 1;
+        }
+        if (now >= cur_) cur_ = now + 1;
+    }
+
+private:
+    /* Put an armed-but-unlinked timer into the slot its distance from cur_ calls for. */
+    void file(Timer& t) {
+        uint64_t at    = t.expires < cur_ ? cur_ : t.expires;
+        uint64_t delta = at - cur_;
+        unsigned level = 0;
+        while (level + 1 < kLevels && delta >= (uint64_t{1} << (kBits * (level + 1)))) ++level;
+        if (level == kLevels - 1) {
+            uint64_t horizon = (uint64_t{1} << (kBits * kLevels)) - 1;
+            if (delta > horizon) at = cur_ + horizon;  // re-filed when this slot cascades
+        }
+        unsigned slot = static_cast<unsigned>((at >> (kBits * level)) & (kSlots - 1));
+        Timer*&  head = slots_[level][slot];
+        t.next  = head;
+        t.pprev = &head;
+        if (head) head->pprev = &t.next;
+        head = &t;
+        bits_[level][slot / 64] |= uint64_t{1} << (slot % 64);
+    }
+
+    void unlink(Timer& t) {
+        *t.pprev = t.next;
+        if (t.next) t.next->pprev = t.pprev;
+        t.next  = nullptr;
+        t.pprev = nullptr;
+        // A slot emptied by cancel() keeps its bit until its time comes: at worst one early wakeup
+    }
+
+    /* Move a slot's whole list to `held_` (unlink() keeps working on its nodes). */
+    void take(unsigned level, unsigned slot) {
+        Timer*& head = slots_[level][slot];
+        held_ = head;
+        head  = nullptr;
+        if (held_) held_->pprev = &held_;
+        bits_[level][slot / 64] &= ~(uint64_t{1} << (slot % 64));
+    }
+
+    /* Re-file every timer of a higher-level slot whose time has come. */
+    void cascade(unsigned level, unsigned slot) {
+        take(level, slot);
+        while (Timer* t = held_) {
+            unlink(*t);
+            file(*t);
+        }
+    }
+
+    /* First slot at or after `from` (circularly) whose bit is set, as a distance `k` from `from`. */
+    bool next_slot(unsigned level, unsigned from, unsigned& k) const {
+        // The partial first word, the whole words after it, then the part of the first word before `from`
+        unsigned word = from / 64, bit = from % 64;
+        uint64_t w = bits_[level][word] & (~uint64_t{0} << bit);
+        for (unsigned step = 0; step <= kSlots / 64; ++step) {
+            if (w) {
+                unsigned slot = word * 64 + static_cast<unsigned>(__builtin_ctzll(w));
+                k = (slot - from) & (kSlots - 1);
+                return true;
+            }
+            word = (word + 1) % (kSlots / 64);
+            w    = bits_[level][word];
+            if (step + 1 == kSlots / 64) w &= (uint64_t{1} << bit) - 1;  // back at the first word
+        }
+        return false;
+    }
+
+    Timer*   slots_[kLevels][kSlots] = {};
+    uint64_t bits_[kLevels][kSlots / 64] = {};  // non-empty slots
+    Timer*   held_  = nullptr;                  // list being fired or cascaded
+    uint64_t cur_;                              // next ms to process
+    size_t   count_ = 0;
+};
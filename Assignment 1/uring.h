@@ -0,0 +1,251 @@
+/*
+ * uring.h
+ * -------
+ * A minimal io_uring driver on raw system calls (no liburing dependency),
+ * with just what the server's --mode=uring loop needs:
+ *
+ *   - one submission / completion ring pair, mmap'd from the kernel;
+ *   - sqe() hands out submission slots, submit() passes them all and waits,
+ *     in one io_uring_enter() call. sqe() returns null rather than reuse a
+ *     slot the kernel has not consumed yet;
+ *   - a provided-buffer ring (IORING_REGISTER_PBUF_RING): recvs are issued
+ *     without a buffer and the kernel picks one from the group only when data
+ *     actually arrives, so idle connections pin no receive memory.
+ *
+ * IoUring::open() probes everything the loop relies on (the opcodes, the
+ * buffer ring, and a kernel new enough for multishot accept) and fails with a
+ * reason instead, so the caller can fall back to epoll.
+ *
+ * Single-threaded: one IoUring belongs to one event loop.
+ */
+
+#pragma once
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+class IoUring {
+public:
+    IoUring() = default;
+    IoUring(const IoUring&)            = delete;
+    IoUring& operator=(const IoUring&) = delete;
+    ~IoUring() { close(); }
+
+    /*
+     * Create a ring with room for `entries` submissions plus a provided-buffer
+     * group `bgid` of `nbufs` buffers of `buf_size` bytes (nbufs: power of two).
+     * On failure returns false with the reason in `err`.
+     */
+    bool open(unsigned entries, uint16_t bgid, unsigned nbufs, unsigned buf_size, std::string& err) {
+        if (!kernel_at_least(6, 0)) { err = "kernel older than 6.0 (multishot accept, buffer rings)"; return false; }
+
+        io_uring_params p{};
+        p.flags      = IORING_SETUP_CQSIZE;
+        p.cq_entries = entries * 4;  // multishot accept and bursts can complete more than was submitted
+        ring_fd_ = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &p));
+        if (ring_fd_ < 0) { err = std::string("io_uring_setup: ") + std::strerror(errno); return false; }
+        if (!(p.features & IORING_FEAT_NODROP)) { err = "kernel may drop completions"; close(); return false; }
+
+        // Map the rings (one mapping for both on IORING_FEAT_SINGLE_MMAP kernels)
+        sq_len_ = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+        cq_len_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        single_mmap_ = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap_) sq_len_ = cq_len_ = std::max(sq_len_, cq_len_);
+        sq_ptr_ = ::mmap(nullptr, sq_len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+        if (sq_ptr_ == MAP_FAILED) { sq_ptr_ = nullptr; err = "mmap(sq ring) failed"; close(); return false; }
+        if (single_mmap_) {
+            cq_ptr_ = sq_ptr_;
+        } else {
+            cq_ptr_ = ::mmap(nullptr, cq_len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+            if (cq_ptr_ == MAP_FAILED) { cq_ptr_ = nullptr; err = "mmap(cq ring) failed"; close(); return false; }
+        }
+        sqes_len_ = p.sq_entries * sizeof(io_uring_sqe);
+        void* sqes = ::mmap(nullptr, sqes_len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) { err = "mmap(sqes) failed"; close(); return false; }
+        sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+        auto* sq  = static_cast<char*>(sq_ptr_);
+        sq_head_  = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+        sq_tail_  = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+        sq_mask_  = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+        sq_entries_ = p.sq_entries;
+        auto* cq  = static_cast<char*>(cq_ptr_);
+        cq_head_  = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+        cq_tail_  = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+        cq_mask_  = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+        cqes_     = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+
+        if (!probe_ops(err)) { close(); return false; }
+        if (!setup_buffers(bgid, nbufs, buf_size, err)) { close(); return false; }
+        return true;
+    }
+
+    void close() {
+        if (buf_ring_) ::munmap(buf_ring_, buf_ring_len_);
+        buf_ring_ = nullptr;
+        if (sqes_) ::munmap(sqes_, sqes_len_);
+        sqes_ = nullptr;
+        if (cq_ptr_ && cq_ptr_ != sq_ptr_) ::munmap(cq_ptr_, cq_len_);
+        cq_ptr_ = nullptr;
+        if (sq_ptr_) ::munmap(sq_ptr_, sq_len_);
+        sq_ptr_ = nullptr;
+        if (ring_fd_ >= 0) ::close(ring_fd_);
+        ring_fd_ = -1;
+    }
+
+    /*
+     * Next free submission slot, zeroed. A full queue is flushed to the kernel
+     * first; null if that freed nothing (e.g. -EBUSY while completions wait to
+     * be drained), and the caller must try again after the next submit().
+     */
+    io_uring_sqe* sqe() {
+        if (queued_ == sq_entries_) {
+            submit(0);
+            if (queued_ == sq_entries_) return nullptr;
+        }
+        unsigned tail = local_tail_++;
+        io_uring_sqe* s = &sqes_[tail & sq_mask_];
+        std::memset(s, 0, sizeof(*s));
+        sq_array_[tail & sq_mask_] = tail & sq_mask_;
+        ++queued_;
+        return s;
+    }
+
+    /*
+     * Submit everything queued and wait for at least `wait_nr` completions, in
+     * one io_uring_enter(). Returns the number submitted, or -errno.
+     */
+    int submit(unsigned wait_nr) {
+        __atomic_store_n(sq_tail_, local_tail_, __ATOMIC_RELEASE);
+        unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+        int r;
+        do {
+            r = static_cast<int>(::syscall(__NR_io_uring_enter, ring_fd_, queued_, wait_nr, flags, nullptr, 0));
+        } while (r < 0 && errno == EINTR && wait_nr == 0);
+        if (r < 0) return -errno;
+        queued_ -= std::min<unsigned>(queued_, static_cast<unsigned>(r));
+        return r;
+    }
+
+    /*
+     * Call f(cqe) for every completion already posted. Each is copied out and
+     * released before f runs, so f may submit (sqe() can flush) without the
+     * kernel finding the completion queue still full.
+     */
+    template <class F>
+    unsigned drain(F f) {
+        unsigned head = *cq_head_;
+        unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        unsigned n = 0;
+        for (; head != tail; ++n) {
+            io_uring_cqe cqe = cqes_[head & cq_mask_];
+            __atomic_store_n(cq_head_, ++head, __ATOMIC_RELEASE);
+            f(cqe);
+        }
+        return n;
+    }
+
+    // ---- Provided buffers ----
+
+    uint16_t buffer_group() const { return bgid_; }
+    unsigned buffer_size()  const { return buf_size_; }
+    const char* buffer(unsigned bid) const { return buf_mem_.data() + static_cast<size_t>(bid) * buf_size_; }
+
+    /* Give buffer `bid` back to the kernel once its bytes have been consumed. */
+    void recycle(unsigned bid) {
+        io_uring_buf* b = &buf_ring_[buf_tail_ & (nbufs_ - 1)];
+        b->addr = reinterpret_cast<uint64_t>(buffer(bid));
+        b->len  = buf_size_;
+        b->bid  = static_cast<uint16_t>(bid);
+        ++buf_tail_;
+        __atomic_store_n(&buf_ring_[0].resv, buf_tail_, __ATOMIC_RELEASE);  // the ring tail
+    }
+
+private:
+    static bool kernel_at_least(int major, int minor) {
+        utsname u{};
+        if (::uname(&u) != 0) return false;
+        int ma = 0, mi = 0;
+        if (std::sscanf(u.release, "%d.%d", &ma, &mi) != 2) return false;
+        return ma > major || (ma == major && mi >= minor);
+    }
+
+    int do_register(unsigned op, void* arg, unsigned nr) {
+        return static_cast<int>(::syscall(__NR_io_uring_register, ring_fd_, op, arg, nr));
+    }
+
+    bool probe_ops(std::string& err) {
+        const unsigned nops = 256;
+        std::vector<char> mem(sizeof(io_uring_probe) + nops * sizeof(io_uring_probe_op), 0);
+        auto* probe = reinterpret_cast<io_uring_probe*>(mem.data());
+        if (do_register(IORING_REGISTER_PROBE, probe, nops) < 0) { err = "IORING_REGISTER_PROBE unsupported"; return false; }
+        for (unsigned op : {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_TIMEOUT, IORING_OP_ASYNC_CANCEL}) {
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+                err = "io_uring opcode " + std::to_string(op) + " unsupported";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool setup_buffers(uint16_t bgid, unsigned nbufs, unsigned buf_size, std::string& err) {
+        bgid_ = bgid; nbufs_ = nbufs; buf_size_ = buf_size;
+        buf_ring_len_ = nbufs * sizeof(io_uring_buf);
+        void* mem = ::mmap(nullptr, buf_ring_len_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) { err = "mmap(buffer ring) failed"; return false; }
+        buf_ring_ = static_cast<io_uring_buf*>(mem);
+        buf_mem_.assign(static_cast<size_t>(nbufs) * buf_size, 0);
+
+        io_uring_buf_reg reg{};
+        reg.ring_addr    = reinterpret_cast<uint64_t>(buf_ring_);
+        reg.ring_entries = nbufs;
+        reg.bgid         = bgid;
+        if (do_register(IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+            err = std::string("IORING_REGISTER_PBUF_RING: ") + std::strerror(errno);
+            return false;
+        }
+        buf_tail_ = 0;
+        for (unsigned i = 0; i < nbufs; ++i) recycle(i);
+        return true;
+    }
+
+    int      ring_fd_ = -1;
+    void*    sq_ptr_  = nullptr;
+    void*    cq_ptr_  = nullptr;
+    size_t   sq_len_  = 0, cq_len_ = 0, sqes_len_ = 0;
+    bool     single_mmap_ = false;
+    io_uring_sqe* sqes_ = nullptr;
+
+    unsigned* sq_head_  = nullptr;
+    unsigned* sq_tail_  = nullptr;
+    unsigned* sq_array_ = nullptr;
+    unsigned  sq_mask_  = 0, sq_entries_ = 0;
+    unsigned  local_tail_ = 0;  // our tail; published to the kernel on submit
+    unsigned  queued_     = 0;  // prepared but not yet submitted
+
+    unsigned*     cq_head_ = nullptr;
+    unsigned*     cq_tail_ = nullptr;
+    unsigned      cq_mask_ = 0;
+    io_uring_cqe* cqes_    = nullptr;
+
+    // The buffer ring as a plain entry array whose tail overlays entry 0's `resv`
+    // (struct io_uring_buf_ring, but its flexible-array union lays out wrongly in C++)
+    io_uring_buf*      buf_ring_ = nullptr;
+    size_t             buf_ring_len_ = 0;
+    std::vector<char>  buf_mem_;  // nbufs_ * buf_size_ bytes, handed out by the kernel
+    uint16_t bgid_ = 0, buf_tail_ = 0;
+    unsigned nbufs_ = 0, buf_size_ = 0;
+};